@@ -4,6 +4,7 @@
 
 #include "bench.h"
 #include "coins.h"
+#include "crypto/common.h"
 #include "policy/policy.h"
 #include "wallet/crypter.h"
 
@@ -35,14 +36,14 @@ SetupDummyInputs(CBasicKeyStore& keystoreRet, CCoinsViewCache& coinsRet)
     dummyTransactions[0].vout[0].scriptPubKey << ToByteVector(key[0].GetPubKey()) << OP_CHECKSIG;
     dummyTransactions[0].vout[1].nValue = 50 * CENT;
     dummyTransactions[0].vout[1].scriptPubKey << ToByteVector(key[1].GetPubKey()) << OP_CHECKSIG;
-    coinsRet.ModifyCoins(dummyTransactions[0].GetHash())->FromTx(dummyTransactions[0], 0);
+    AddCoins(coinsRet, dummyTransactions[0], 0);
 
     dummyTransactions[1].vout.resize(2);
     dummyTransactions[1].vout[0].nValue = 21 * CENT;
     dummyTransactions[1].vout[0].scriptPubKey = GetScriptForDestination(key[2].GetPubKey().GetID());
     dummyTransactions[1].vout[1].nValue = 22 * CENT;
     dummyTransactions[1].vout[1].scriptPubKey = GetScriptForDestination(key[3].GetPubKey().GetID());
-    coinsRet.ModifyCoins(dummyTransactions[1].GetHash())->FromTx(dummyTransactions[1], 0);
+    AddCoins(coinsRet, dummyTransactions[1], 0);
 
     return dummyTransactions;
 }
@@ -84,4 +85,37 @@ static void CCoinsCaching(benchmark::State& state)
     }
 }
 
+// Filling a cache with new coins and flushing it every 100000 coins, as
+// connecting blocks does, which comes down to allocating cache entries and
+// freeing them all on flush
+static void CoinsCacheFill(benchmark::State& state, const CScript& scriptPubKey)
+{
+    CCoinsView coinsDummy;
+    CCoinsViewCache coins(&coinsDummy);
+    CTxOut out(CENT, scriptPubKey);
+    uint256 hash;
+    uint32_t n = 0;
+    while (state.KeepRunning()) {
+        WriteLE32(hash.begin(), n++);
+        coins.AddCoin(COutPoint(hash, 0), Coin(out, 1, false), false);
+        if (coins.GetCacheSize() >= 100000)
+            coins.Flush();
+    }
+}
+
+// P2PKH scripts fit in the inline storage of CScript
+static void CCoinsCacheFill(benchmark::State& state)
+{
+    CoinsCacheFill(state, GetScriptForDestination(CKeyID()));
+}
+
+// Coinstake outputs pay to a compressed public key, a 35 byte script that
+// takes a heap buffer of its own next to the pooled cache entry
+static void CCoinsCacheFillPubKey(benchmark::State& state)
+{
+    CoinsCacheFill(state, GetScriptForRawPubKey(CPubKey(std::vector<unsigned char>(33, 2))));
+}
+
 BENCHMARK(CCoinsCaching);
+BENCHMARK(CCoinsCacheFill);
+BENCHMARK(CCoinsCacheFillPubKey);
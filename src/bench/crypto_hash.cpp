@@ -10,12 +10,15 @@
 #include "uint256.h"
 #include "utiltime.h"
 #include "crypto/ripemd160.h"
+#include "crypto/scrypt.h"
 #include "crypto/sha1.h"
 #include "crypto/sha256.h"
 #include "crypto/sha512.h"
 
 /* Number of bytes to hash per iteration */
 static const uint64_t BUFFER_SIZE = 1000*1000;
+/* Number of block headers to scrypt per iteration */
+static const int SCRYPT_HEADERS = 64;
 
 static void RIPEMD160(benchmark::State& state)
 {
@@ -69,6 +72,22 @@ static void SipHash_32b(benchmark::State& state)
     }
 }
 
+static void Scrypt_80b(benchmark::State& state)
+{
+    std::vector<char> in(80 * SCRYPT_HEADERS, 0), out(32 * SCRYPT_HEADERS);
+    while (state.KeepRunning()) {
+        for (int i = 0; i < SCRYPT_HEADERS; i++)
+            scrypt_1024_1_1_256(&in[80 * i], &out[32 * i]);
+    }
+}
+
+static void ScryptMulti_80b(benchmark::State& state)
+{
+    std::vector<char> in(80 * SCRYPT_HEADERS, 0), out(32 * SCRYPT_HEADERS);
+    while (state.KeepRunning())
+        scrypt_1024_1_1_256_multi(in.data(), out.data(), SCRYPT_HEADERS);
+}
+
 BENCHMARK(RIPEMD160);
 BENCHMARK(SHA1);
 BENCHMARK(SHA256);
@@ -76,3 +95,6 @@ BENCHMARK(SHA512);
 
 BENCHMARK(SHA256_32b);
 BENCHMARK(SipHash_32b);
+
+BENCHMARK(Scrypt_80b);
+BENCHMARK(ScryptMulti_80b);
@@ -0,0 +1,237 @@
+// Copyright (c) 2018 The R3VCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "staking.h"
+
+#include "chainparams.h"
+#include "kernel.h"
+#include "key.h"
+#include "keystore.h"
+#include "pow.h"
+#include "random.h"
+#include "script/sign.h"
+#include "utiltime.h"
+#include "validation.h"
+
+#include <vector>
+
+// A hash target 1000 coin kernels meet every few dozen tries
+static const unsigned int STAKE_BITS_EASY = 0x1f00ffff;
+
+StakingChain::StakingChain(int nBlocks) : vHash(nBlocks), vIndex(nBlocks)
+{
+    LOCK(cs_main);
+    FastRandomContext rand(true);
+    const int64_t nTimeTip = GetTime();
+    const unsigned int nBitsWork = UintToArith256(Params().GetConsensus().powLimit).GetCompact();
+    const unsigned int nBitsStake = UintToArith256(Params().ProofOfStakeLimit()).GetCompact();
+    const CBlockIndex* pindexLastModifier = NULL;
+    for (int i = 0; i < nBlocks; i++) {
+        CBlockIndex& index = vIndex[i];
+        vHash[i] = ArithToUint256(i + 1);
+        index.phashBlock = &vHash[i];
+        index.pprev = i ? &vIndex[i - 1] : NULL;
+        index.nHeight = i;
+        index.nTime = nTimeTip - (nBlocks - 1 - i) * nTargetSpacing;
+        index.nTimeMax = index.nTime;
+        index.nBits = nBitsWork;
+        if (i > Params().LastProofOfWorkHeight()) {
+            index.nBits = nBitsStake;
+            index.SetProofOfStake();
+        }
+        index.SetStakeEntropyBit(rand.rand32() & 1);
+        index.hashProof = ArithToUint256(arith_uint256(((uint64_t)rand.rand32() << 32) | rand.rand32()) << 192);
+
+        // A new modifier is generated on the same schedule as in
+        // AddToBlockIndex, so ComputeNextStakeModifier does real work
+        if (!index.pprev) {
+            index.SetStakeModifier(0, true);
+            pindexLastModifier = &index;
+        } else if (pindexLastModifier->GetBlockTime() / nModifierInterval < index.pprev->GetBlockTime() / nModifierInterval) {
+            index.SetStakeModifier(((uint64_t)rand.rand32() << 32) | rand.rand32(), true);
+            pindexLastModifier = &index;
+        } else {
+            index.SetStakeModifier(index.pprev->nStakeModifier, false);
+        }
+
+        index.BuildSkip();
+        mapBlockIndex[vHash[i]] = &index;
+    }
+    chainActive.SetTip(&vIndex.back());
+    pcoinsTip = new CCoinsViewCache(&viewDummy);
+}
+
+StakingChain::~StakingChain()
+{
+    LOCK(cs_main);
+    delete pcoinsTip;
+    pcoinsTip = NULL;
+    chainActive.SetTip(NULL);
+    for (const uint256& hash : vHash)
+        mapBlockIndex.erase(hash);
+}
+
+void StakingChain::Confirm(const CTransaction& tx, int nHeight)
+{
+    LOCK(cs_main);
+    const CBlockIndex& index = vIndex[nHeight];
+    AddCoins(*pcoinsTip, tx, nHeight, index.nTime, index.IsProofOfStake());
+}
+
+int StakingChain::CoinHeight(int nCoin) const
+{
+    const int nFirst = Params().LastProofOfWorkHeight() + 1;
+    const int nLast = (int)vIndex.size() - STAKING_COIN_MIN_DEPTH;
+    return nFirst + nCoin % (nLast - nFirst);
+}
+
+// Resolved kernels of nCount outputs of 1 to 1000 coins spread over the chain
+static std::vector<std::pair<COutPoint, CStakeKernelContext> > StakeKernels(const StakingChain& chain, int nCount)
+{
+    LOCK(cs_main);
+    std::vector<std::pair<COutPoint, CStakeKernelContext> > vKernels;
+    vKernels.reserve(nCount);
+    for (int i = 0; i < nCount; i++) {
+        const CBlockIndex* pindexFrom = &chain.vIndex[chain.CoinHeight(i)];
+        COutPoint prevout(ArithToUint256(arith_uint256(i + 1) << 128), i % 4);
+        CStakeKernelContext kernel(pindexFrom, prevout.n, pindexFrom->nTime, (1 + i % 1000) * COIN);
+        bool fResolved = ResolveKernelStakeModifier(kernel);
+        assert(fResolved);
+        vKernels.push_back(std::make_pair(prevout, kernel));
+    }
+    return vKernels;
+}
+
+// Confirms a 1000 coin output to a new key and returns a signed coinstake
+// spending it whose kernel meets STAKE_BITS_EASY
+static CTransactionRef StakeCoinstake(StakingChain& chain, CBasicKeyStore& keystore)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+    CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+
+    LOCK(cs_main);
+    for (int nCoin = 0; ; nCoin++) {
+        int nHeight = chain.CoinHeight(nCoin);
+        CMutableTransaction txPrev;
+        txPrev.nTime = chain.vIndex[nHeight].nTime;
+        txPrev.vin.resize(1);
+        txPrev.vin[0].prevout = COutPoint(ArithToUint256(nCoin + 1), 0);
+        txPrev.vout.push_back(CTxOut(1000 * COIN, scriptPubKey));
+        CTransaction txPrevConst(txPrev);
+
+        CMutableTransaction txStake;
+        txStake.nTime = chain.vIndex.back().nTime;
+        txStake.vin.push_back(CTxIn(txPrevConst.GetHash(), 0));
+        txStake.vout.push_back(CTxOut(0, CScript()));
+        txStake.vout.push_back(CTxOut(1001 * COIN, scriptPubKey));
+
+        CStakeKernelContext kernel(&chain.vIndex[nHeight], 0, txPrev.nTime, 1000 * COIN);
+        uint256 hashProofOfStake, targetProofOfStake;
+        if (!ResolveKernelStakeModifier(kernel) ||
+            !CheckStakeKernelHash(STAKE_BITS_EASY, kernel, txStake.vin[0].prevout, txStake.nTime, hashProofOfStake, targetProofOfStake))
+            continue;
+
+        chain.Confirm(txPrevConst, nHeight);
+        bool fSigned = SignSignature(keystore, txPrevConst, txStake, 0, SIGHASH_ALL);
+        assert(fSigned);
+        return MakeTransactionRef(std::move(txStake));
+    }
+}
+
+// Kernels per second of the serial kernel hash, one kernel per iteration
+static void StakeKernelHash(benchmark::State& state)
+{
+    StakingChain chain;
+    std::vector<std::pair<COutPoint, CStakeKernelContext> > vKernels = StakeKernels(chain, 1000);
+    unsigned int nTimeTx = chain.vIndex.back().nTime;
+    uint256 hashProofOfStake, targetProofOfStake;
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        const std::pair<COutPoint, CStakeKernelContext>& candidate = vKernels[i++ % vKernels.size()];
+        CheckStakeKernelHash(STAKE_BITS_UNREACHABLE, candidate.second, candidate.first, nTimeTx, hashProofOfStake, targetProofOfStake);
+    }
+}
+
+// Kernels per second of the batched kernel hash, one stake search job of
+// STAKE_SEARCH_SLICE kernels per iteration
+static void StakeKernelHashes(benchmark::State& state)
+{
+    StakingChain chain;
+    std::vector<std::pair<COutPoint, CStakeKernelContext> > vKernels = StakeKernels(chain, STAKE_SEARCH_SLICE * 16);
+    unsigned int nTimeTx = chain.vIndex.back().nTime;
+    size_t nBegin = 0;
+    while (state.KeepRunning()) {
+        int nFound = CheckStakeKernelHashes(STAKE_BITS_UNREACHABLE, vKernels, nBegin, nBegin + STAKE_SEARCH_SLICE, nTimeTx);
+        assert(nFound < 0);
+        nBegin = (nBegin + STAKE_SEARCH_SLICE) % vKernels.size();
+    }
+}
+
+// Generating one stake modifier, as at the start of each modifier interval
+static void StakeModifierCompute(benchmark::State& state)
+{
+    StakingChain chain;
+    std::vector<const CBlockIndex*> vGenerating;
+    for (size_t i = chain.vIndex.size() / 2; i < chain.vIndex.size(); i++) {
+        if (chain.vIndex[i].GeneratedStakeModifier())
+            vGenerating.push_back(&chain.vIndex[i]);
+    }
+    LOCK(cs_main);
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        uint64_t nStakeModifier;
+        bool fGeneratedStakeModifier;
+        bool fComputed = ComputeNextStakeModifier(vGenerating[i++ % vGenerating.size()]->pprev, nStakeModifier, fGeneratedStakeModifier);
+        assert(fComputed && fGeneratedStakeModifier);
+    }
+}
+
+// Retargeting proof-of-stake difficulty over a full KimotoGravityWell window
+static void StakeKimotoGravityWell(benchmark::State& state)
+{
+    StakingChain chain;
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    LOCK(cs_main);
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        const CBlockIndex* pindexLast = &chain.vIndex[chain.vIndex.size() - 1 - i++ % 1000];
+        GetNextWorkRequired(pindexLast, consensusParams);
+    }
+}
+
+static void StakeCoinAge(benchmark::State& state)
+{
+    StakingChain chain;
+    CBasicKeyStore keystore;
+    CTransactionRef txStake = StakeCoinstake(chain, keystore);
+    while (state.KeepRunning()) {
+        uint64_t nCoinAge = GetCoinAge(txStake);
+        assert(nCoinAge > 0);
+    }
+}
+
+// Verification latency of a coinstake, kernel and signature
+static void StakeCheckProofOfStake(benchmark::State& state)
+{
+    ECCVerifyHandle verifyHandle;
+    StakingChain chain;
+    CBasicKeyStore keystore;
+    CTransactionRef txStake = StakeCoinstake(chain, keystore);
+    LOCK(cs_main);
+    while (state.KeepRunning()) {
+        uint256 hashProofOfStake, targetProofOfStake;
+        bool fValid = CheckProofOfStake(txStake, STAKE_BITS_EASY, hashProofOfStake, targetProofOfStake);
+        assert(fValid);
+    }
+}
+
+BENCHMARK(StakeKernelHash);
+BENCHMARK(StakeKernelHashes);
+BENCHMARK(StakeModifierCompute);
+BENCHMARK(StakeKimotoGravityWell);
+BENCHMARK(StakeCoinAge);
+BENCHMARK(StakeCheckProofOfStake);
@@ -0,0 +1,49 @@
+// Copyright (c) 2018 The R3VCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BENCH_STAKING_H
+#define BITCOIN_BENCH_STAKING_H
+
+#include "chain.h"
+#include "coins.h"
+#include "primitives/transaction.h"
+
+#include <vector>
+
+// Long enough for a full KimotoGravityWell window past the PoW blocks
+static const int STAKING_CHAIN_LENGTH = 12000;
+
+// Coins are confirmed at least this many blocks below the tip, so that they
+// are mature, past the min age and have a resolvable stake modifier
+static const int STAKING_COIN_MIN_DEPTH = 1000;
+
+// A hash target no kernel meets, so stake searches go through every
+// candidate
+static const unsigned int STAKE_BITS_UNREACHABLE = 0x03000001;
+
+/**
+ * A synthetic PoSV chain of one minute blocks ending at the current time.
+ * While it exists it is the active chain, backed by an in-memory UTXO set
+ * that transactions can be confirmed into.
+ */
+class StakingChain
+{
+public:
+    explicit StakingChain(int nBlocks = STAKING_CHAIN_LENGTH);
+    ~StakingChain();
+
+    //! Add the outputs of tx to the UTXO set as confirmed at nHeight
+    void Confirm(const CTransaction& tx, int nHeight);
+
+    //! A height a new coin can be confirmed at, spread over the chain
+    int CoinHeight(int nCoin) const;
+
+    std::vector<uint256> vHash;
+    std::vector<CBlockIndex> vIndex;
+
+private:
+    CCoinsView viewDummy;
+};
+
+#endif // BITCOIN_BENCH_STAKING_H
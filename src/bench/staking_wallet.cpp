@@ -0,0 +1,99 @@
+// Copyright (c) 2018 The R3VCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "staking.h"
+
+#include "key.h"
+#include "random.h"
+#include "timedata.h"
+#include "validation.h"
+#include "wallet/wallet.h"
+
+#include <vector>
+
+/**
+ * A wallet holding nCoins confirmed outputs of 1 to 1000 coins, paid to a
+ * handful of keys and spread over a StakingChain.
+ */
+class StakingWallet
+{
+public:
+    StakingWallet(StakingChain& chain, int nCoins)
+    {
+        LOCK2(cs_main, wallet.cs_wallet);
+        std::vector<CScript> vScripts;
+        for (int i = 0; i < 16; i++) {
+            CKey key;
+            key.MakeNewKey(true);
+            wallet.AddKeyPubKey(key, key.GetPubKey());
+            vScripts.push_back(GetScriptForDestination(key.GetPubKey().GetID()));
+        }
+
+        FastRandomContext rand(true);
+        vtx.reserve(nCoins);
+        for (int nCoin = 0; nCoin < nCoins; nCoin++) {
+            int nHeight = chain.CoinHeight(nCoin);
+            CMutableTransaction tx;
+            tx.nTime = chain.vIndex[nHeight].nTime;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(ArithToUint256(nCoin + 1), 0);
+            tx.vout.push_back(CTxOut((1 + rand.rand32() % 1000) * COIN, vScripts[nCoin % vScripts.size()]));
+            vtx.push_back(MakeTransactionRef(std::move(tx)));
+
+            CWalletTx wtx(&wallet, vtx.back());
+            wtx.hashBlock = chain.vHash[nHeight];
+            wtx.nIndex = 1;
+            wallet.LoadToWallet(wtx);
+            chain.Confirm(*vtx.back(), nHeight);
+        }
+        wallet.BuildStakeKernelCache();
+    }
+
+    CWallet wallet;
+    std::vector<CTransactionRef> vtx;
+};
+
+// Time per staking tick that finds no kernel, the common case, with every
+// coin looked up and hashed on the calling thread
+static void StakeTick(benchmark::State& state, int nCoins)
+{
+    StakingChain chain;
+    StakingWallet stakingWallet(chain, nCoins);
+    CWallet& wallet = stakingWallet.wallet;
+    while (state.KeepRunning()) {
+        CMutableTransaction txCoinStake;
+        txCoinStake.nTime = GetAdjustedTime();
+        CKey key;
+        bool fCreated = wallet.CreateCoinStake(STAKE_BITS_UNREACHABLE, 1, 0, txCoinStake, key);
+        assert(!fCreated);
+    }
+}
+
+// Stake weight as polled by getstakinginfo and the GUI
+static void StakeWeight(benchmark::State& state, int nCoins)
+{
+    StakingChain chain;
+    StakingWallet stakingWallet(chain, nCoins);
+    CWallet& wallet = stakingWallet.wallet;
+    while (state.KeepRunning()) {
+        uint64_t nAverageWeight = 0, nTotalWeight = 0;
+        bool fWeight = wallet.GetStakeWeight(nAverageWeight, nTotalWeight);
+        assert(fWeight && nTotalWeight > 0);
+    }
+}
+
+static void StakeTick1k(benchmark::State& state) { StakeTick(state, 1000); }
+static void StakeTick10k(benchmark::State& state) { StakeTick(state, 10000); }
+static void StakeTick100k(benchmark::State& state) { StakeTick(state, 100000); }
+static void StakeWeight1k(benchmark::State& state) { StakeWeight(state, 1000); }
+static void StakeWeight10k(benchmark::State& state) { StakeWeight(state, 10000); }
+static void StakeWeight100k(benchmark::State& state) { StakeWeight(state, 100000); }
+
+BENCHMARK(StakeTick1k);
+BENCHMARK(StakeTick10k);
+BENCHMARK(StakeTick100k);
+BENCHMARK(StakeWeight1k);
+BENCHMARK(StakeWeight10k);
+BENCHMARK(StakeWeight100k);
@@ -147,6 +147,12 @@ enum BlockStatus: uint32_t {
     BLOCK_FAILED_MASK        =   BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
 
     BLOCK_OPT_WITNESS       =   128, //!< block data in blk*.data was received with a witness-enforcing client
+
+    //! scrypt PoW hash of the header is stored in hashPoW. The hash is kept in
+    //! the block tree database under its own key rather than in the
+    //! CDiskBlockIndex record, so the record format is unchanged and older
+    //! versions can still read the index; they ignore the flag and the key.
+    BLOCK_HAVE_POW_HASH     =   256,
 };
 
 /** The block chain is a tree shaped structure starting with the
@@ -186,6 +192,9 @@ public:
     uint256 hashProof;
     COutPoint prevoutStake;
 
+    //! Scrypt PoW hash of the header, computed when it was accepted. Only valid if BLOCK_HAVE_POW_HASH is set
+    uint256 hashPoW;
+
     //! Which # file this block is stored in (blk?????.dat)
     int nFile;
 
@@ -253,6 +262,7 @@ public:
         hashProof = uint256();
         prevoutStake.SetNull();
         nStakeTime = 0;
+        hashPoW = uint256();
     }
 
     CBlockIndex()
@@ -321,6 +331,8 @@ public:
 
     uint256 GetBlockPoWHash() const
     {
+        if (nStatus & BLOCK_HAVE_POW_HASH)
+            return hashPoW;
         return GetBlockHeader().GetPoWHash();
     }
 
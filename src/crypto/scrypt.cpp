@@ -327,3 +327,188 @@ void scrypt_1024_1_1_256(const char *input, char *output)
 	char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
     scrypt_1024_1_1_256_sp(input, output, scratchpad);
 }
+
+#if defined(__GNUC__)
+/*
+ * Multi-buffer scrypt: SCRYPT_MULTI_LANES independent hashes run in lockstep,
+ * word k of every lane packed into one vector, so each Salsa20/8 operation
+ * works on all lanes at once and the random V lookups of the lanes overlap.
+ * With the GCC vector extensions the 4 lane version compiles to SSE2 on
+ * x86-64 (NEON on ARM), and an 8 lane AVX2 version is picked at runtime.
+ */
+typedef uint32_t scrypt_lanes4 __attribute__((vector_size(16)));
+#if defined(__x86_64__) || defined(__i386__)
+#define USE_SCRYPT_AVX2 1
+typedef uint32_t scrypt_lanes8 __attribute__((vector_size(32)));
+#endif
+
+template<typename T>
+static inline __attribute__((always_inline)) void xor_salsa8_lanes(T B[16], const T Bx[16])
+{
+	T x00,x01,x02,x03,x04,x05,x06,x07,x08,x09,x10,x11,x12,x13,x14,x15;
+	int i;
+
+	x00 = (B[ 0] ^= Bx[ 0]);
+	x01 = (B[ 1] ^= Bx[ 1]);
+	x02 = (B[ 2] ^= Bx[ 2]);
+	x03 = (B[ 3] ^= Bx[ 3]);
+	x04 = (B[ 4] ^= Bx[ 4]);
+	x05 = (B[ 5] ^= Bx[ 5]);
+	x06 = (B[ 6] ^= Bx[ 6]);
+	x07 = (B[ 7] ^= Bx[ 7]);
+	x08 = (B[ 8] ^= Bx[ 8]);
+	x09 = (B[ 9] ^= Bx[ 9]);
+	x10 = (B[10] ^= Bx[10]);
+	x11 = (B[11] ^= Bx[11]);
+	x12 = (B[12] ^= Bx[12]);
+	x13 = (B[13] ^= Bx[13]);
+	x14 = (B[14] ^= Bx[14]);
+	x15 = (B[15] ^= Bx[15]);
+	for (i = 0; i < 8; i += 2) {
+		/* Operate on columns. */
+		x04 ^= ROTL(x00 + x12,  7);  x09 ^= ROTL(x05 + x01,  7);
+		x14 ^= ROTL(x10 + x06,  7);  x03 ^= ROTL(x15 + x11,  7);
+
+		x08 ^= ROTL(x04 + x00,  9);  x13 ^= ROTL(x09 + x05,  9);
+		x02 ^= ROTL(x14 + x10,  9);  x07 ^= ROTL(x03 + x15,  9);
+
+		x12 ^= ROTL(x08 + x04, 13);  x01 ^= ROTL(x13 + x09, 13);
+		x06 ^= ROTL(x02 + x14, 13);  x11 ^= ROTL(x07 + x03, 13);
+
+		x00 ^= ROTL(x12 + x08, 18);  x05 ^= ROTL(x01 + x13, 18);
+		x10 ^= ROTL(x06 + x02, 18);  x15 ^= ROTL(x11 + x07, 18);
+
+		/* Operate on rows. */
+		x01 ^= ROTL(x00 + x03,  7);  x06 ^= ROTL(x05 + x04,  7);
+		x11 ^= ROTL(x10 + x09,  7);  x12 ^= ROTL(x15 + x14,  7);
+
+		x02 ^= ROTL(x01 + x00,  9);  x07 ^= ROTL(x06 + x05,  9);
+		x08 ^= ROTL(x11 + x10,  9);  x13 ^= ROTL(x12 + x15,  9);
+
+		x03 ^= ROTL(x02 + x01, 13);  x04 ^= ROTL(x07 + x06, 13);
+		x09 ^= ROTL(x08 + x11, 13);  x14 ^= ROTL(x13 + x12, 13);
+
+		x00 ^= ROTL(x03 + x02, 18);  x05 ^= ROTL(x04 + x07, 18);
+		x10 ^= ROTL(x09 + x08, 18);  x15 ^= ROTL(x14 + x13, 18);
+	}
+	B[ 0] += x00;
+	B[ 1] += x01;
+	B[ 2] += x02;
+	B[ 3] += x03;
+	B[ 4] += x04;
+	B[ 5] += x05;
+	B[ 6] += x06;
+	B[ 7] += x07;
+	B[ 8] += x08;
+	B[ 9] += x09;
+	B[10] += x10;
+	B[11] += x11;
+	B[12] += x12;
+	B[13] += x13;
+	B[14] += x14;
+	B[15] += x15;
+}
+
+/* Hash n <= N inputs, lanes past n repeat the last input. */
+template<typename T, int N>
+static inline __attribute__((always_inline)) void scrypt_1024_1_1_256_sp_lanes(const char *input, char *output, int n, char *scratchpad)
+{
+	uint8_t B[N][128];
+	T X[32];
+	T *V;
+	uint32_t i, j[N], k;
+	int w;
+
+	V = (T *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+
+	for (w = 0; w < N; w++) {
+		const char *in = input + 80 * (w < n ? w : n - 1);
+		PBKDF2_SHA256((const uint8_t *)in, 80, (const uint8_t *)in, 80, 1, B[w], 128);
+	}
+
+	for (k = 0; k < 32; k++)
+		for (w = 0; w < N; w++)
+			X[k][w] = le32dec(&B[w][4 * k]);
+
+	for (i = 0; i < 1024; i++) {
+		memcpy(&V[i * 32], X, sizeof(X));
+		xor_salsa8_lanes(&X[0], &X[16]);
+		xor_salsa8_lanes(&X[16], &X[0]);
+	}
+	for (i = 0; i < 1024; i++) {
+		for (w = 0; w < N; w++)
+			j[w] = 32 * (X[16][w] & 1023);
+		for (k = 0; k < 32; k++)
+			for (w = 0; w < N; w++)
+				X[k][w] ^= V[j[w] + k][w];
+		xor_salsa8_lanes(&X[0], &X[16]);
+		xor_salsa8_lanes(&X[16], &X[0]);
+	}
+
+	for (w = 0; w < n; w++) {
+		for (k = 0; k < 32; k++)
+			le32enc(&B[w][4 * k], X[k][w]);
+		PBKDF2_SHA256((const uint8_t *)input + 80 * w, 80, B[w], 128, 1, (uint8_t *)output + 32 * w, 32);
+	}
+}
+
+static void scrypt_1024_1_1_256_sp_4way(const char *input, char *output, int n, char *scratchpad)
+{
+	scrypt_1024_1_1_256_sp_lanes<scrypt_lanes4, 4>(input, output, n, scratchpad);
+}
+
+#if defined(USE_SCRYPT_AVX2)
+__attribute__((target("avx2")))
+static void scrypt_1024_1_1_256_sp_8way(const char *input, char *output, int n, char *scratchpad)
+{
+	scrypt_1024_1_1_256_sp_lanes<scrypt_lanes8, 8>(input, output, n, scratchpad);
+}
+#endif
+
+int scrypt_multi_lanes()
+{
+#if defined(USE_SCRYPT_AVX2)
+	static const bool fAVX2 = __builtin_cpu_supports("avx2");
+	if (fAVX2)
+		return 8;
+#endif
+	return 4;
+}
+
+void scrypt_1024_1_1_256_multi(const char *input, char *output, size_t nCount)
+{
+	const int nLanes = scrypt_multi_lanes();
+	if (nCount < 2) {
+		if (nCount)
+			scrypt_1024_1_1_256(input, output);
+		return;
+	}
+
+	char *scratchpad = (char *)malloc(nLanes * 131072 + 63);
+	if (!scratchpad)
+		abort();
+	for (size_t i = 0; i < nCount; i += nLanes) {
+		int n = nCount - i < (size_t)nLanes ? nCount - i : nLanes;
+		if (n == 1)
+			scrypt_1024_1_1_256_sp(input + 80 * i, output + 32 * i, scratchpad);
+#if defined(USE_SCRYPT_AVX2)
+		else if (nLanes == 8)
+			scrypt_1024_1_1_256_sp_8way(input + 80 * i, output + 32 * i, n, scratchpad);
+#endif
+		else
+			scrypt_1024_1_1_256_sp_4way(input + 80 * i, output + 32 * i, n, scratchpad);
+	}
+	free(scratchpad);
+}
+#else
+int scrypt_multi_lanes()
+{
+	return 1;
+}
+
+void scrypt_1024_1_1_256_multi(const char *input, char *output, size_t nCount)
+{
+	for (size_t i = 0; i < nCount; i++)
+		scrypt_1024_1_1_256(input + 80 * i, output + 32 * i);
+}
+#endif
@@ -8,6 +8,14 @@ static const int SCRYPT_SCRATCHPAD_SIZE = 131072 + 63;
 void scrypt_1024_1_1_256(const char *input, char *output);
 void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scratchpad);
 
+/** Number of hashes scrypt_1024_1_1_256_multi runs side by side on this CPU */
+int scrypt_multi_lanes();
+/**
+ * Hash nCount consecutive 80 byte inputs into nCount consecutive 32 byte
+ * outputs, several at a time in interleaved lanes.
+ */
+void scrypt_1024_1_1_256_multi(const char *input, char *output, size_t nCount);
+
 #if defined(USE_SSE2)
 #if defined(_M_X64) || defined(__x86_64__) || defined(_M_AMD64) || (defined(MAC_OSX) && defined(__i386__))
 #define USE_SSE2_ALWAYS 1
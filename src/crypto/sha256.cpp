@@ -6,6 +6,7 @@
 
 #include "crypto/common.h"
 
+#include <assert.h>
 #include <string.h>
 
 // Internal implementation code.
@@ -127,6 +128,67 @@ void Transform(uint32_t* s, const unsigned char* chunk)
     s[7] += h;
 }
 
+/** Number of independent chunks processed in lock step by TransformLanes. */
+static const int LANES = 8;
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+/** Initialize LANES SHA-256 states. */
+void inline InitializeLanes(uint32_t s[8][LANES])
+{
+    uint32_t init[8];
+    Initialize(init);
+    for (int i = 0; i < 8; i++)
+        for (int l = 0; l < LANES; l++)
+            s[i][l] = init[i];
+}
+
+/**
+ * Perform one SHA-256 transformation on LANES states at once, each with its
+ * own chunk given as 16 message words in w[0..15]. Every step is the same
+ * operation looped over the lanes, which the compiler can map onto vector
+ * registers when built with -O3 or -ftree-vectorize; at the default -O2 the
+ * lanes run one after another.
+ */
+void TransformLanes(uint32_t s[8][LANES], uint32_t w[64][LANES])
+{
+    for (int t = 16; t < 64; t++)
+        for (int l = 0; l < LANES; l++)
+            w[t][l] = sigma1(w[t - 2][l]) + w[t - 7][l] + sigma0(w[t - 15][l]) + w[t - 16][l];
+
+    uint32_t a[LANES], b[LANES], c[LANES], d[LANES], e[LANES], f[LANES], g[LANES], h[LANES];
+    for (int l = 0; l < LANES; l++) {
+        a[l] = s[0][l]; b[l] = s[1][l]; c[l] = s[2][l]; d[l] = s[3][l];
+        e[l] = s[4][l]; f[l] = s[5][l]; g[l] = s[6][l]; h[l] = s[7][l];
+    }
+    for (int t = 0; t < 64; t++) {
+        for (int l = 0; l < LANES; l++) {
+            uint32_t t1 = h[l] + Sigma1(e[l]) + Ch(e[l], f[l], g[l]) + K[t] + w[t][l];
+            uint32_t t2 = Sigma0(a[l]) + Maj(a[l], b[l], c[l]);
+            h[l] = g[l];
+            g[l] = f[l];
+            f[l] = e[l];
+            e[l] = d[l] + t1;
+            d[l] = c[l];
+            c[l] = b[l];
+            b[l] = a[l];
+            a[l] = t1 + t2;
+        }
+    }
+    for (int l = 0; l < LANES; l++) {
+        s[0][l] += a[l]; s[1][l] += b[l]; s[2][l] += c[l]; s[3][l] += d[l];
+        s[4][l] += e[l]; s[5][l] += f[l]; s[6][l] += g[l]; s[7][l] += h[l];
+    }
+}
+
 } // namespace sha256
 } // namespace
 
@@ -187,3 +249,43 @@ CSHA256& CSHA256::Reset()
     sha256::Initialize(s);
     return *this;
 }
+
+void SHA256DShort(unsigned char* out, const unsigned char* in, size_t len, size_t count)
+{
+    using sha256::LANES;
+    assert(len <= 55);
+    for (size_t i = 0; i < count; i += LANES) {
+        size_t n = count - i < (size_t)LANES ? count - i : LANES;
+        uint32_t s[8][LANES];
+        uint32_t w[64][LANES];
+
+        // First hash: each message fits one chunk together with its padding
+        for (int l = 0; l < LANES; l++) {
+            unsigned char chunk[64] = {0};
+            if ((size_t)l < n)
+                memcpy(chunk, in + (i + l) * len, len);
+            chunk[len] = 0x80;
+            WriteBE64(chunk + 56, (uint64_t)len << 3);
+            for (int t = 0; t < 16; t++)
+                w[t][l] = ReadBE32(chunk + 4 * t);
+        }
+        sha256::InitializeLanes(s);
+        sha256::TransformLanes(s, w);
+
+        // Second hash: the 32-byte digest of the first, padded
+        for (int l = 0; l < LANES; l++) {
+            for (int t = 0; t < 8; t++)
+                w[t][l] = s[t][l];
+            w[8][l] = 0x80000000ul;
+            for (int t = 9; t < 15; t++)
+                w[t][l] = 0;
+            w[15][l] = 256;
+        }
+        sha256::InitializeLanes(s);
+        sha256::TransformLanes(s, w);
+
+        for (size_t l = 0; l < n; l++)
+            for (int t = 0; t < 8; t++)
+                WriteBE32(out + (i + l) * 32 + 4 * t, s[t][l]);
+    }
+}
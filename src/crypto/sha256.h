@@ -25,4 +25,12 @@ public:
     CSHA256& Reset();
 };
 
+/**
+ * Compute the double SHA-256 of count messages of len bytes each, stored back
+ * to back in in, and write the count 32-byte hashes to out. Messages must fit
+ * a single chunk with their padding (len at most 55); they are hashed several
+ * at a time in lanes.
+ */
+void SHA256DShort(unsigned char* out, const unsigned char* in, size_t len, size_t count);
+
 #endif // BITCOIN_CRYPTO_SHA256_H
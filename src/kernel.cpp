@@ -4,9 +4,15 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/assign/list_of.hpp>
+#include <limits>
 #include <math.h>
 #include "chainparams.h"
+#include "checkqueue.h"
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "hash.h"
 #include "kernel.h"
+#include "random.h"
 #include "script/script.h"
 #include "txdb.h"
 #include "validation.h"
@@ -102,7 +108,7 @@ static int64_t GetStakeModifierSelectionIntervalSection(int nSection)
 }
 
 // Get stake modifier selection interval (in seconds)
-static int64_t GetStakeModifierSelectionInterval()
+static int64_t ComputeStakeModifierSelectionInterval()
 {
     int64_t nSelectionInterval = 0;
     for (int nSection=0; nSection<64; nSection++)
@@ -114,48 +120,91 @@ static int64_t GetStakeModifierSelectionInterval()
     return nSelectionInterval;
 }
 
-// select a block from the candidate blocks in vSortedByTimestamp, excluding
-// already selected blocks in vSelectedBlocks, and with timestamp up to
+int64_t GetStakeModifierSelectionInterval()
+{
+    // only depends on nModifierInterval, which is fixed at compile time
+    static const int64_t nSelectionInterval = ComputeStakeModifierSelectionInterval();
+    return nSelectionInterval;
+}
+
+// A block of the modifier selection interval, with its selection hash
+struct CStakeModifierCandidate
+{
+    const CBlockIndex* pindex;
+    arith_uint256 hashSelection;
+};
+
+// Order of candidates in the selection interval: by timestamp, then by hash
+static bool CandidateBefore(const CBlockIndex* pindexA, const CBlockIndex* pindexB)
+{
+    if (pindexA->GetBlockTime() != pindexB->GetBlockTime())
+        return pindexA->GetBlockTime() < pindexB->GetBlockTime();
+    return pindexA->GetBlockHash() < pindexB->GetBlockHash();
+}
+
+// Collect the candidate blocks of the selection interval ending at pindexPrev,
+// ordered by timestamp. Blocks are inserted as the chain goes, so a chain
+// with increasing timestamps is ordered without moving anything. Returns the
+// height of the first candidate.
+static int GetStakeModifierCandidates(const CBlockIndex* pindexPrev, int64_t nSelectionIntervalStart, vector<CStakeModifierCandidate>& vCandidates)
+{
+    const CBlockIndex* pindex = pindexPrev;
+    while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart)
+        pindex = pindex->pprev;
+    int nHeightFirstCandidate = pindex ? (pindex->nHeight + 1) : 0;
+
+    vCandidates.resize(pindexPrev->nHeight - nHeightFirstCandidate + 1);
+    size_t nCandidates = vCandidates.size();
+    pindex = pindexPrev;
+    for (size_t i = nCandidates; i > 0; i--, pindex = pindex->pprev)
+        vCandidates[i - 1].pindex = pindex;
+    for (size_t i = 1; i < nCandidates; i++) {
+        const CBlockIndex* pindexInsert = vCandidates[i].pindex;
+        size_t j = i;
+        for (; j > 0 && CandidateBefore(pindexInsert, vCandidates[j - 1].pindex); j--)
+            vCandidates[j].pindex = vCandidates[j - 1].pindex;
+        vCandidates[j].pindex = pindexInsert;
+    }
+    return nHeightFirstCandidate;
+}
+
+// compute the selection hash of a candidate by hashing its proof-hash and the
+// previous proof-of-stake modifier
+static arith_uint256 GetStakeModifierSelectionHash(const CBlockIndex* pindex, uint64_t nStakeModifierPrev)
+{
+    CDataStream ss(SER_GETHASH, 0);
+    ss << pindex->hashProof << nStakeModifierPrev;
+    arith_uint256 hashSelection = UintToArith256(Hash(ss.begin(), ss.end()));
+    // the selection hash is divided by 2**32 so that proof-of-stake block
+    // is always favored over proof-of-work block. this is to preserve
+    // the energy efficiency property
+    if (pindex->IsProofOfStake())
+        hashSelection >>= 32;
+    return hashSelection;
+}
+
+// select a block from the candidate blocks in vCandidates, excluding
+// already selected blocks marked in vSelected, and with timestamp up to
 // nSelectionIntervalStop.
-static bool SelectBlockFromCandidates(vector<pair<int64_t, uint256> >& vSortedByTimestamp, map<uint256, const CBlockIndex*>& mapSelectedBlocks,
-    int64_t nSelectionIntervalStop, uint64_t nStakeModifierPrev, const CBlockIndex** pindexSelected)
+static bool SelectBlockFromCandidates(const vector<CStakeModifierCandidate>& vCandidates, const vector<bool>& vSelected,
+    int64_t nSelectionIntervalStop, size_t& nSelected)
 {
     bool fSelected = false;
-    uint256 hashBest = uint256();
-    *pindexSelected = (const CBlockIndex*) 0;
-    BOOST_FOREACH(const PAIRTYPE(int64_t, uint256)& item, vSortedByTimestamp)
+    for (size_t i = 0; i < vCandidates.size(); i++)
     {
-        if (!mapBlockIndex.count(item.second))
-            return error("SelectBlockFromCandidates: failed to find block index for candidate block %s", item.second.ToString().c_str());
-        const CBlockIndex* pindex = mapBlockIndex[item.second];
-        if (fSelected && pindex->GetBlockTime() > nSelectionIntervalStop)
+        const CStakeModifierCandidate& candidate = vCandidates[i];
+        if (fSelected && candidate.pindex->GetBlockTime() > nSelectionIntervalStop)
             break;
-        if (mapSelectedBlocks.count(pindex->GetBlockHash()) > 0)
+        if (vSelected[i])
             continue;
-        // compute the selection hash by hashing its proof-hash and the
-        // previous proof-of-stake modifier
-        CDataStream ss(SER_GETHASH, 0);
-        ss << pindex->hashProof << nStakeModifierPrev;
-        arith_uint256 hashSelection_arith = UintToArith256(Hash(ss.begin(), ss.end()));
-        // the selection hash is divided by 2**32 so that proof-of-stake block
-        // is always favored over proof-of-work block. this is to preserve
-        // the energy efficiency property
-        if (pindex->IsProofOfStake())
-            hashSelection_arith >>= 32;
-        if (fSelected && hashSelection_arith < UintToArith256(hashBest))
-        {
-            hashBest = ArithToUint256(hashSelection_arith);
-            *pindexSelected = (const CBlockIndex*) pindex;
-        }
-        else if (!fSelected)
+        if (!fSelected || candidate.hashSelection < vCandidates[nSelected].hashSelection)
         {
             fSelected = true;
-            hashBest = ArithToUint256(hashSelection_arith);
-            *pindexSelected = (const CBlockIndex*) pindex;
+            nSelected = i;
         }
     }
-    if (GetBoolArg("-printstakemodifier", false))
-        LogPrintf("SelectBlockFromCandidates: selection hash=%s\n", hashBest.ToString().c_str());
+    if (fSelected && GetBoolArg("-printstakemodifier", false))
+        LogPrintf("SelectBlockFromCandidates: selection hash=%s\n", ArithToUint256(vCandidates[nSelected].hashSelection).ToString().c_str());
     return fSelected;
 }
 
@@ -193,40 +242,39 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     if (nModifierTime / nModifierInterval >= pindexPrev->GetBlockTime() / nModifierInterval)
         return true;
 
-    // Sort candidate blocks by timestamp
-    vector<pair<int64_t, uint256> > vSortedByTimestamp;
-    vSortedByTimestamp.reserve(64 * nModifierInterval / nTargetSpacing);
+    // Candidate blocks ordered by timestamp, each hashed once against the
+    // previous modifier for all selection rounds
+    vector<CStakeModifierCandidate> vCandidates;
+    vCandidates.reserve(64 * nModifierInterval / nTargetSpacing);
     int64_t nSelectionInterval = GetStakeModifierSelectionInterval();
     int64_t nSelectionIntervalStart = (pindexPrev->GetBlockTime() / nModifierInterval) * nModifierInterval - nSelectionInterval;
-    const CBlockIndex* pindex = pindexPrev;
-    while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart)
-    {
-        vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
-        pindex = pindex->pprev;
-    }
-    int nHeightFirstCandidate = pindex ? (pindex->nHeight + 1) : 0;
-    reverse(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
-    sort(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
+    int nHeightFirstCandidate = GetStakeModifierCandidates(pindexPrev, nSelectionIntervalStart, vCandidates);
+    for (CStakeModifierCandidate& candidate : vCandidates)
+        candidate.hashSelection = GetStakeModifierSelectionHash(candidate.pindex, nStakeModifier);
 
     // Select 64 blocks from candidate blocks to generate stake modifier
     uint64_t nStakeModifierNew = 0;
     int64_t nSelectionIntervalStop = nSelectionIntervalStart;
-    map<uint256, const CBlockIndex*> mapSelectedBlocks;
-    
+    vector<bool> vSelected(vCandidates.size(), false);
+    vector<const CBlockIndex*> vSelectedBlocks;
+
     if (GetBoolArg("-printstakemodifier", false))
-        LogPrintf("ComputeNextStakeModifier: nSelectionIntervalStart=%u vSortedByTimestamp.size()=%u\n", nSelectionIntervalStart, (int)vSortedByTimestamp.size());
+        LogPrintf("ComputeNextStakeModifier: nSelectionIntervalStart=%u vCandidates.size()=%u\n", nSelectionIntervalStart, (int)vCandidates.size());
 
-    for (int nRound=0; nRound<min(64, (int)vSortedByTimestamp.size()); nRound++)
+    for (int nRound=0; nRound<min(64, (int)vCandidates.size()); nRound++)
     {
         // add an interval section to the current selection round
         nSelectionIntervalStop += GetStakeModifierSelectionIntervalSection(nRound);
         // select a block from the candidates of current round
-        if (!SelectBlockFromCandidates(vSortedByTimestamp, mapSelectedBlocks, nSelectionIntervalStop, nStakeModifier, &pindex))
+        size_t nSelected = 0;
+        if (!SelectBlockFromCandidates(vCandidates, vSelected, nSelectionIntervalStop, nSelected))
             return error("ComputeNextStakeModifier: unable to select block at round %d", nRound);
+        const CBlockIndex* pindex = vCandidates[nSelected].pindex;
         // write the entropy bit of the selected block
         nStakeModifierNew |= (((uint64_t)pindex->GetStakeEntropyBit()) << nRound);
-        // add the selected block from candidates to selected list
-        mapSelectedBlocks.insert(make_pair(pindex->GetBlockHash(), pindex));
+        // mark the selected block so later rounds skip it
+        vSelected[nSelected] = true;
+        vSelectedBlocks.push_back(pindex);
         if (GetBoolArg("-printstakemodifier", false))
             LogPrintf("ComputeNextStakeModifier: selected round %d stop=%s height=%d bit=%d\n", nRound, DateTimeStrFormat(nSelectionIntervalStop).c_str(), pindex->nHeight, pindex->GetStakeEntropyBit());
     }
@@ -237,7 +285,7 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
         string strSelectionMap = "";
         // '-' indicates proof-of-work blocks not selected
         strSelectionMap.insert(0, pindexPrev->nHeight - nHeightFirstCandidate + 1, '-');
-        pindex = pindexPrev;
+        const CBlockIndex* pindex = pindexPrev;
         while (pindex && pindex->nHeight >= nHeightFirstCandidate)
         {
             // '=' indicates proof-of-stake blocks not selected
@@ -245,11 +293,11 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
                 strSelectionMap.replace(pindex->nHeight - nHeightFirstCandidate, 1, "=");
             pindex = pindex->pprev;
         }
-        BOOST_FOREACH(const PAIRTYPE(uint256, const CBlockIndex*)& item, mapSelectedBlocks)
+        BOOST_FOREACH(const CBlockIndex* pindexSelected, vSelectedBlocks)
         {
             // 'S' indicates selected proof-of-stake blocks
             // 'W' indicates selected proof-of-work blocks
-            strSelectionMap.replace(item.second->nHeight - nHeightFirstCandidate, 1, item.second->IsProofOfStake()? "S" : "W");
+            strSelectionMap.replace(pindexSelected->nHeight - nHeightFirstCandidate, 1, pindexSelected->IsProofOfStake()? "S" : "W");
         }
         LogPrintf("ComputeNextStakeModifier: selection height [%d, %d] map %s\n", nHeightFirstCandidate, pindexPrev->nHeight, strSelectionMap.c_str());
     }
@@ -265,35 +313,66 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
 
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
-static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
+static bool GetKernelStakeModifier(const CBlockIndex* pindexFrom, uint64_t& nStakeModifier, const CBlockIndex*& pindexModifier, bool fPrintProofOfStake)
 {
     nStakeModifier = 0;
-    if (!mapBlockIndex.count(hashBlockFrom))
-        return error("GetKernelStakeModifier() : block not indexed");
-    const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
-    nStakeModifierHeight = pindexFrom->nHeight;
-    nStakeModifierTime = pindexFrom->GetBlockTime();
+    pindexModifier = NULL;
     int64_t nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
+    int64_t nStakeModifierTime = pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval;
     const CBlockIndex* pindex = pindexFrom;
-    // loop to find the stake modifier later by a selection interval
-    //LogPrintf("GetKernelStakeModifier() - nStakeModifierHeight: %u, nStakeModifierTime:%u\n", nStakeModifierHeight, nStakeModifierTime);
-    while (nStakeModifierTime < pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval)
+    if (chainActive.Contains(pindexFrom) && pindexFrom->GetBlockTimeMax() < nStakeModifierTime)
     {
-        if (!chainActive.Next(pindex))
-        {   // reached best block; may happen if node is behind on block chain
-            if (fPrintProofOfStake || (pindex->GetBlockTime() + Params().StakeMinAge() - nStakeModifierSelectionInterval > GetAdjustedTime())) {
-                return error("GetKernelStakeModifier() : reached best block at height %d (%u) from block at height %d, StakeMinAge %u, GetAdjustedTime %u, ActiveHeight %u",
-                    pindex->nHeight, pindex->GetBlockTime(), pindexFrom->nHeight, Params().StakeMinAge(), GetAdjustedTime(), chainActive.Height());
-            } else {
-                return false;
-            }
+        // No block up to pindexFrom reaches the modifier time, so the first
+        // block whose running maximum time reaches it is also the first block
+        // after pindexFrom that does: binary search the active chain for it
+        const CBlockIndex* pindexFound = chainActive.FindEarliestAtLeast(nStakeModifierTime);
+        pindex = pindexFound ? pindexFound : chainActive.Tip();
+    }
+    else
+    {
+        // loop to find the stake modifier later by a selection interval
+        while (pindex->GetBlockTime() < nStakeModifierTime && chainActive.Next(pindex))
+            pindex = chainActive.Next(pindex);
+    }
+    if (pindex->GetBlockTime() < nStakeModifierTime)
+    {   // reached best block; may happen if node is behind on block chain
+        if (fPrintProofOfStake || (pindex->GetBlockTime() + Params().StakeMinAge() - nStakeModifierSelectionInterval > GetAdjustedTime())) {
+            return error("GetKernelStakeModifier() : reached best block at height %d (%u) from block at height %d, StakeMinAge %u, GetAdjustedTime %u, ActiveHeight %u",
+                pindex->nHeight, pindex->GetBlockTime(), pindexFrom->nHeight, Params().StakeMinAge(), GetAdjustedTime(), chainActive.Height());
+        } else {
+            return false;
         }
-        pindex = chainActive.Next(pindex);
-        nStakeModifierHeight = pindex->nHeight;
-        nStakeModifierTime = pindex->GetBlockTime();
-        //LogPrintf("GetKernelStakeModifier() - nStakeModifierHeight: %u, nStakeModifierTime:%u\n", nStakeModifierHeight, nStakeModifierTime);
     }
     nStakeModifier = pindex->nStakeModifier;
+    pindexModifier = pindex;
+    return true;
+}
+
+bool ResolveKernelStakeModifier(CStakeKernelContext& kernel, bool fPrintProofOfStake)
+{
+    AssertLockHeld(cs_main);
+    if (!kernel.pindexFrom)
+        return error("ResolveKernelStakeModifier() : null pindexFrom");
+
+    // the modifier block descends from the block-from, so while it is in the
+    // active chain the walk in GetKernelStakeModifier would stop at it again
+    if (kernel.pindexModifier && chainActive.Contains(kernel.pindexModifier))
+        return true;
+
+    return GetKernelStakeModifier(kernel.pindexFrom, kernel.nStakeModifier, kernel.pindexModifier, fPrintProofOfStake);
+}
+
+// Timestamp rules of the kernel protocol
+static bool CheckStakeKernelTime(unsigned int nTimeBlockFrom, unsigned int nTimeTxPrev, unsigned int nTimeTx)
+{
+    if (nTimeTx < nTimeTxPrev)  { // Transaction timestamp violation
+        return error("CheckStakeKernelHash() : nTime violation: nTimeTx < txPrev.nTime, %u < %u", nTimeTx, nTimeTxPrev);
+    }
+
+    if (nTimeBlockFrom + Params().StakeMinAge() > nTimeTx) { // Min age requirement
+        return error("CheckStakeKernelHash() : min age violation");
+    }
+
     return true;
 }
 
@@ -318,6 +397,135 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifi
 //   quantities so as to generate blocks faster, degrading the system back into
 //   a proof-of-work situation.
 //
+bool CheckStakeKernelHash(unsigned int nBits, const CStakeKernelContext& kernel, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake)
+{
+    if (!kernel.pindexModifier)
+        return error("CheckStakeKernelHash() : stake modifier not resolved");
+
+    if (!CheckStakeKernelTime(kernel.nTimeBlockFrom, kernel.nTimeTxPrev, nTimeTx))
+        return false;
+
+    arith_uint256 bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    int64_t nCoinAgeWeight = GetCoinAgeWeight((int64_t)kernel.nTimeTxPrev, (int64_t)nTimeTx);
+    arith_uint256 bnCoinDayWeight = arith_uint256(kernel.nValue) * nCoinAgeWeight / COIN / (24 * 60 * 60);
+
+    //High: nBits, nValue, coinAgeWeight (older transaction)
+    targetProofOfStake = ArithToUint256(bnCoinDayWeight * bnTargetPerCoinDay);
+
+    // Calculate hash
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << kernel.nStakeModifier;
+    ss << kernel.nTimeBlockFrom << kernel.nTxPrevOffset << kernel.nTimeTxPrev << prevout.n << nTimeTx;
+    hashProofOfStake = ss.GetHash();
+
+    // Now check if proof-of-stake hash meets target protocol
+    return UintToArith256(hashProofOfStake) <= UintToArith256(targetProofOfStake);
+}
+
+// Size of the kernel hash preimage: modifier, block time, offset, tx time, output and time
+static const size_t KERNEL_PREIMAGE_SIZE = 28;
+
+int CheckStakeKernelHashes(unsigned int nBits, const std::vector<std::pair<COutPoint, CStakeKernelContext> >& vCandidates, size_t nBegin, size_t nEnd, unsigned int nTimeTx)
+{
+    // Serialize the preimages the way CheckStakeKernelHash streams them
+    std::vector<unsigned char> vPreimages;
+    std::vector<size_t> vIndices;
+    vPreimages.reserve((nEnd - nBegin) * KERNEL_PREIMAGE_SIZE);
+    vIndices.reserve(nEnd - nBegin);
+    for (size_t i = nBegin; i < nEnd; i++)
+    {
+        const CStakeKernelContext& kernel = vCandidates[i].second;
+        if (!kernel.pindexModifier || nTimeTx < kernel.nTimeTxPrev || kernel.nTimeBlockFrom + Params().StakeMinAge() > nTimeTx)
+            continue;
+        unsigned char preimage[KERNEL_PREIMAGE_SIZE];
+        WriteLE64(preimage, kernel.nStakeModifier);
+        WriteLE32(preimage + 8, kernel.nTimeBlockFrom);
+        WriteLE32(preimage + 12, kernel.nTxPrevOffset);
+        WriteLE32(preimage + 16, kernel.nTimeTxPrev);
+        WriteLE32(preimage + 20, vCandidates[i].first.n);
+        WriteLE32(preimage + 24, nTimeTx);
+        vPreimages.insert(vPreimages.end(), preimage, preimage + KERNEL_PREIMAGE_SIZE);
+        vIndices.push_back(i);
+    }
+    if (vIndices.empty())
+        return -1;
+
+    std::vector<unsigned char> vHashes(vIndices.size() * 32);
+    SHA256DShort(&vHashes[0], &vPreimages[0], KERNEL_PREIMAGE_SIZE, vIndices.size());
+
+    arith_uint256 bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    for (size_t j = 0; j < vIndices.size(); j++)
+    {
+        const CStakeKernelContext& kernel = vCandidates[vIndices[j]].second;
+        int64_t nCoinAgeWeight = GetCoinAgeWeight((int64_t)kernel.nTimeTxPrev, (int64_t)nTimeTx);
+        arith_uint256 bnCoinDayWeight = arith_uint256(kernel.nValue) * nCoinAgeWeight / COIN / (24 * 60 * 60);
+        uint256 hashProofOfStake;
+        memcpy(hashProofOfStake.begin(), &vHashes[j * 32], 32);
+        if (UintToArith256(hashProofOfStake) <= bnCoinDayWeight * bnTargetPerCoinDay)
+            return vIndices[j];
+    }
+    return -1;
+}
+
+static CCheckQueue<CStakeKernelSearch> stakesearchqueue(1);
+
+void ThreadStakeSearch()
+{
+    RenameThread("coin-stakesearch");
+    stakesearchqueue.Thread();
+}
+
+// No kernel found yet by a stake search
+static const uint64_t STAKE_SEARCH_NONE = std::numeric_limits<uint64_t>::max();
+
+bool CStakeKernelSearch::operator()()
+{
+    for (unsigned int nTimeTx = nTimeBegin; nTimeTx <= nTimeEnd; nTimeTx++)
+    {
+        // the tip moved on, or another slice found an earlier kernel
+        if (pfCancel && *pfCancel)
+            return false;
+        if (*pnFound != STAKE_SEARCH_NONE && (*pnFound >> 32) < nTimeTx - nTimeBegin)
+            return true;
+
+        int nKernel = CheckStakeKernelHashes(nBits, *pvCandidates, nBegin, nEnd, nTimeTx);
+        if (nKernel < 0)
+            continue;
+
+        // keep the earliest kernel, the lowest index among those at once
+        uint64_t nKernelFound = ((uint64_t)(nTimeTx - nTimeBegin) << 32) | (uint32_t)nKernel;
+        uint64_t nFound = *pnFound;
+        while (nKernelFound < nFound && !pnFound->compare_exchange_weak(nFound, nKernelFound)) {}
+        return true;
+    }
+    return true;
+}
+
+int SearchStakeKernels(const std::vector<std::pair<COutPoint, CStakeKernelContext> >& vCandidates, unsigned int nBits, unsigned int nTimeBegin, unsigned int nTimeEnd, unsigned int& nTimeFound, const std::atomic<bool>* pfCancel)
+{
+    std::atomic<uint64_t> nFound(STAKE_SEARCH_NONE);
+    std::vector<CStakeKernelSearch> vChecks;
+    vChecks.reserve(vCandidates.size() / STAKE_SEARCH_SLICE + 1);
+    for (size_t nBegin = 0; nBegin < vCandidates.size(); nBegin += STAKE_SEARCH_SLICE)
+        vChecks.push_back(CStakeKernelSearch(&vCandidates, nBegin, min(nBegin + STAKE_SEARCH_SLICE, vCandidates.size()), nBits, nTimeBegin, nTimeEnd, &nFound, pfCancel));
+
+    // the calling thread joins the workers, so this also works without any
+    CCheckQueueControl<CStakeKernelSearch> control(&stakesearchqueue);
+    control.Add(vChecks);
+    if (!control.Wait() || nFound == STAKE_SEARCH_NONE)
+        return -1;
+    nTimeFound = nTimeBegin + (uint32_t)(nFound >> 32);
+    return (int)(nFound & 0xffffffff);
+}
+
+int SearchStakeKernels(const std::vector<std::pair<COutPoint, CStakeKernelContext> >& vCandidates, unsigned int nBits, unsigned int nTimeTx, const std::atomic<bool>* pfCancel)
+{
+    unsigned int nTimeFound;
+    return SearchStakeKernels(vCandidates, nBits, nTimeTx, nTimeTx, nTimeFound, pfCancel);
+}
+
 bool CheckStakeKernelHash(unsigned int nBits, const CBlockHeader& blockFrom, unsigned int nTxPrevOffset, const CTransactionRef& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
     const CTransaction& tx_prev = *txPrev;
@@ -328,69 +536,88 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlockHeader& blockFrom, uns
     if (nTimeTxPrev == 0)
         nTimeTxPrev = nTimeBlockFrom;
 
-    if (nTimeTx < nTimeTxPrev)  { // Transaction timestamp violation
-        return error("CheckStakeKernelHash() : nTime violation: nTimeTx < txPrev.nTime, %u < %u", nTimeTx, nTimeTxPrev);
-    }
+    if (!CheckStakeKernelTime(nTimeBlockFrom, nTimeTxPrev, nTimeTx))
+        return false;
 
-    if (nTimeBlockFrom + Params().StakeMinAge() > nTimeTx) { // Min age requirement
-        return error("CheckStakeKernelHash() : min age violation");
-    }
+    BlockMap::iterator mi = mapBlockIndex.find(blockFrom.GetHash());
+    if (mi == mapBlockIndex.end())
+        return error("GetKernelStakeModifier() : block not indexed");
 
-    arith_uint256 bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
-    int64_t nValueIn = tx_prev.vout[prevout.n].nValue;
-    int64_t nCoinAgeWeight = GetCoinAgeWeight((int64_t)nTimeTxPrev, (int64_t)nTimeTx);
-    uint256 hashBlockFrom = blockFrom.GetHash();
-    arith_uint256 bnCoinDayWeight = arith_uint256(nValueIn) * nCoinAgeWeight / COIN / (24 * 60 * 60);
-    
-    //High: nBits, nValue, coinAgeWeight (older transaction)
-    targetProofOfStake = ArithToUint256(bnCoinDayWeight * bnTargetPerCoinDay);
+    CStakeKernelContext kernel(mi->second, nTxPrevOffset, tx_prev.nTime, tx_prev.vout[prevout.n].nValue);
+    if (!ResolveKernelStakeModifier(kernel, fPrintProofOfStake))
+        return false;
 
-    // Calculate hash
-    uint64_t nStakeModifier = 0;
-    int nStakeModifierHeight = 0;
-    int64_t nStakeModifierTime = 0;
+    return CheckStakeKernelHash(nBits, kernel, prevout, nTimeTx, hashProofOfStake, targetProofOfStake);
+}
 
-    if (!GetKernelStakeModifier(hashBlockFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake))
+// Get a spent output and the block index entry of its transaction from the
+// UTXO set, which keeps the block fields needed by the kernel and coin age
+// rules. Fails if the output is already spent or its record predates those
+// fields; callers then look up the previous transaction instead.
+static bool GetKernelCoins(const COutPoint& prevout, const Coin*& coin, const CBlockIndex*& pindexFrom)
+{
+    AssertLockHeld(cs_main);
+    coin = &pcoinsTip->AccessCoin(prevout);
+    if (coin->IsSpent() || !coin->HasBlockInfo())
         return false;
+    pindexFrom = chainActive[coin->nHeight];
+    return pindexFrom && pindexFrom->GetBlockTime() == (int64_t)coin->nBlockTime;
+}
 
-    CHashWriter ss(SER_GETHASH, 0);
-    ss << nStakeModifier;
-    ss << nTimeBlockFrom << nTxPrevOffset << nTimeTxPrev << prevout.n << nTimeTx;
-    hashProofOfStake = ss.GetHash();
+// Find the output spent by a kernel and set up its kernel context, from the
+// UTXO set when possible and from the previous transaction otherwise
+static bool GetKernelInput(const COutPoint& prevout, CTxOut& txoutPrev, CStakeKernelContext& kernel)
+{
+    const Coin* coin = NULL;
+    const CBlockIndex* pindexFrom = NULL;
+    if (GetKernelCoins(prevout, coin, pindexFrom))
+    {
+        txoutPrev = coin->out;
+        kernel = CStakeKernelContext(pindexFrom, prevout.n, coin->nTime, txoutPrev.nValue);
+        return true;
+    }
 
-    // Now check if proof-of-stake hash meets target protocol
-    if (UintToArith256(hashProofOfStake) > UintToArith256(targetProofOfStake)) {
-        
-        /*if (fPrintProofOfStake)
-        {
-            LogPrintf("CheckStakeKernelHash() : using modifier 0x%016x at height=%d timestamp=%s for block from height=%d timestamp=%s txid=%s\n",
-                nStakeModifier, nStakeModifierHeight,
-                DateTimeStrFormat(nStakeModifierTime).c_str(),
-                mapBlockIndex[hashBlockFrom]->nHeight,
-                DateTimeStrFormat(blockFrom.GetBlockTime()).c_str(),
-                tx_prev.GetHash().ToString());
-            LogPrintf("CheckStakeKernelHash() : check modifier=0x%016x nTimeBlockFrom=%u nTxPrevOffset=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s(0x%x) targetProof=%s(0x%x)\n",
-                nStakeModifier,
-                nTimeBlockFrom, nTxPrevOffset, nTimeTxPrev, prevout.n, nTimeTx,
-                hashProofOfStake.ToString(), UintToArith256(hashProofOfStake).getdouble(), 
-                targetProofOfStake.ToString(), UintToArith256(targetProofOfStake).getdouble());
-            LogPrintf("CheckStakeKernelHash() : check nBits=0x%016x nValueIn=%u nCoinAgeWeight=%u bnCoinDayWeight=0x%x bnTargetPerCoinDay=0x%x\n",
-                nBits,
-                nValueIn, nCoinAgeWeight,
-                bnCoinDayWeight.getdouble(),
-                bnTargetPerCoinDay.getdouble());
-        }*/
+    // Otherwise try finding the previous transaction in database
+    CTransactionRef txPrev;
+    uint256 hashBlock;
+    if (!GetTransaction(prevout.hash, txPrev, Params().GetConsensus(), hashBlock, true))
+        return error("GetKernelInput() : INFO: read txPrev failed");  // previous transaction not in main chain, may occur during initial download
+    if (prevout.n >= txPrev->vout.size())
+        return error("GetKernelInput() : prevout out of range");
+
+    // Block header fields of the previous transaction come from the index
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+    if (mi == mapBlockIndex.end())
+        return error("GetKernelInput() : block not indexed"); // unable to read block of previous transaction
+
+    txoutPrev = txPrev->vout[prevout.n];
+    kernel = CStakeKernelContext(mi->second, prevout.n, txPrev->nTime, txoutPrev.nValue);
+    return true;
+}
 
+bool CStakeCheck::operator()()
+{
+    if (pblock)
+        return CheckBlockSignature(*pblock);
+    return VerifySignature(txoutPrev, ptxTo, 0);
+}
+
+bool GetProofOfStakeCheck(const CTransactionRef& tx, CStakeCheck& check)
+{
+    if (!tx->IsCoinStake())
+        return error("GetProofOfStakeCheck() : called on non-coinstake %s", tx->GetHash().ToString().c_str());
+
+    CTxOut txoutPrev;
+    CStakeKernelContext kernel;
+    if (!GetKernelInput(tx->vin[0].prevout, txoutPrev, kernel))
         return false;
-    } else {
-        //LogPrintf("CheckStakeKernelHash() : OK\n");
-        return true;
-    }
+
+    check = CStakeCheck(txoutPrev, tx);
+    return true;
 }
 
 // Check kernel hash target and coinstake signature
-bool CheckProofOfStake(const CTransactionRef& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake)
+bool CheckProofOfStake(const CTransactionRef& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fCheckSignature)
 {
     const CTransaction& ctx = *tx;
 
@@ -400,26 +627,19 @@ bool CheckProofOfStake(const CTransactionRef& tx, unsigned int nBits, uint256& h
     // Kernel (input 0) must match the stake hash target per coin age (nBits)
     const CTxIn& txin = ctx.vin[0];
 
-    // First try finding the previous transaction in database
-    CTransactionRef txPrev;
-    uint256 hashTxPrev = txin.prevout.hash;
-    uint256 hashBlock;
-    if (!GetTransaction(hashTxPrev, txPrev, Params().GetConsensus(), hashBlock, true))
-        return error("CheckProofOfStake() : INFO: read txPrev failed");  // previous transaction not in main chain, may occur during initial download
+    // The UTXO set carries everything the kernel needs; the previous
+    // transaction is only read for records that predate that
+    CTxOut txoutPrev;
+    CStakeKernelContext kernel;
+    if (!GetKernelInput(txin.prevout, txoutPrev, kernel))
+        return error("CheckProofOfStake() : INFO: kernel input of coinstake %s not found", ctx.GetHash().ToString().c_str());
 
     // Verify signature
-    if (!VerifySignature(txPrev, tx, 0))
+    if (fCheckSignature && !CStakeCheck(txoutPrev, tx)())
         return error("CheckProofOfStake() : VerifySignature failed on coinstake %s", ctx.GetHash().ToString().c_str());
 
-    // Read block header
-    if (!mapBlockIndex.count(hashBlock))
-        return error("CheckProofOfStake() : block not indexed"); // unable to read block of previous transaction
-
-    CBlock block;
-    if (!ReadBlockFromDisk(block, mapBlockIndex[hashBlock], Params().GetConsensus()))
-        return error("CheckProofOfStake() : read block failed"); // unable to read block of previous transaction
-
-    if (!CheckStakeKernelHash(nBits, block, txin.prevout.n, txPrev, txin.prevout, ctx.nTime, hashProofOfStake, targetProofOfStake, fDebug))
+    if (!ResolveKernelStakeModifier(kernel, fDebug) ||
+        !CheckStakeKernelHash(nBits, kernel, txin.prevout, ctx.nTime, hashProofOfStake, targetProofOfStake))
         return error("CheckProofOfStake() : INFO: check kernel failed on coinstake %s, hashProof=%s", ctx.GetHash().ToString().c_str(), hashProofOfStake.ToString().c_str()); // may occur during initial download or if behind on block chain sync
 
     return true;
@@ -447,37 +667,53 @@ uint64_t GetCoinAge(const CTransaction& tx)
     if (tx.IsCoinBase())
         return 0;
 
+    LOCK(cs_main);
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
         const CTxIn& txin = tx.vin[i];
-        // First try finding the previous transaction in database
-        CTransactionRef txPrev;
-        uint256 hashTxPrev = txin.prevout.hash;
-        uint256 hashBlock;
-        if (!GetTransaction(hashTxPrev, txPrev, Params().GetConsensus(), hashBlock, true))
-            continue;  // previous transaction not in main chain
-
-        // Read block header
-        CBlock block;
-        if (!mapBlockIndex.count(hashBlock))
-            return 0; // unable to read block of previous transaction
-        if (!ReadBlockFromDisk(block, mapBlockIndex[hashBlock], Params().GetConsensus()))
-            return 0; // unable to read block of previous transaction
-        if (block.nTime + Params().StakeMinAge() > tx.nTime)
-            continue; // only count coins meeting min age requirement
-
-        const CTransaction& ctxPrev = *txPrev;
-        
-        int64_t nTime = ctxPrev.nTime;
-        // deal with missing timestamps in PoW blocks
-        if (block.IsProofOfWork()) {
-            nTime = block.nTime;
+        int64_t nTime;
+        int64_t nValueIn;
+
+        // First try the UTXO set, which keeps the block fields of the output
+        const Coin* coin = NULL;
+        const CBlockIndex* pindexPrev = NULL;
+        if (GetKernelCoins(txin.prevout, coin, pindexPrev))
+        {
+            if (coin->nBlockTime + Params().StakeMinAge() > tx.nTime)
+                continue; // only count coins meeting min age requirement
+
+            nTime = coin->nTime;
+            // deal with missing timestamps in PoW blocks
+            if (!coin->fBlockProofOfStake)
+                nTime = coin->nBlockTime;
+            nValueIn = coin->out.nValue;
+        }
+        else
+        {
+            // Otherwise find the previous transaction in database
+            CTransactionRef txPrev;
+            uint256 hashBlock;
+            if (!GetTransaction(txin.prevout.hash, txPrev, Params().GetConsensus(), hashBlock, true))
+                continue;  // previous transaction not in main chain
+
+            // Block header fields of the previous transaction come from the index
+            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+            if (mi == mapBlockIndex.end())
+                return 0; // unable to find block of previous transaction
+            pindexPrev = mi->second;
+            if (pindexPrev->nTime + Params().StakeMinAge() > tx.nTime)
+                continue; // only count coins meeting min age requirement
+
+            nTime = txPrev->nTime;
+            // deal with missing timestamps in PoW blocks
+            if (pindexPrev->IsProofOfWork())
+                nTime = pindexPrev->nTime;
+            nValueIn = txPrev->vout[txin.prevout.n].nValue;
         }
 
         if (tx.nTime < nTime)
             return 0;  // Transaction timestamp violation
 
-        int64_t nValueIn = ctxPrev.vout[txin.prevout.n].nValue;
         int64_t nTimeWeight = GetCoinAgeWeight(nTime, tx.nTime);
         bnCentSecond += arith_uint256(nValueIn) * nTimeWeight / CENT;
 
@@ -515,4 +751,70 @@ uint64_t GetCoinAge(const CBlock& block)
     return nCoinAge;
 }
 
+// Smallest table of a non-empty CStakeSeenSet, which is kept at most three
+// quarters full
+static const size_t STAKE_SEEN_MIN_SLOTS = 1024;
 
+CStakeSeenSet::CStakeSeenSet() : nSize(0), k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
+
+size_t CStakeSeenSet::Find(const std::pair<COutPoint, unsigned int>& stake) const
+{
+    const size_t nMask = vTable.size() - 1;
+    size_t i = SipHashUint256(k0, k1 ^ (((uint64_t)stake.first.n << 32) | stake.second), stake.first.hash) & nMask;
+    while (vTable[i].nTime && (vTable[i].nTime != stake.second || vTable[i].prevout != stake.first))
+        i = (i + 1) & nMask;
+    return i;
+}
+
+void CStakeSeenSet::Rehash(size_t nSlots, unsigned int nTimeAfter)
+{
+    std::vector<Entry> vOld(nSlots);
+    vOld.swap(vTable);
+    nSize = 0;
+    for (const Entry& entry : vOld) {
+        if (entry.nTime <= nTimeAfter)
+            continue;
+        vTable[Find(std::make_pair(entry.prevout, entry.nTime))] = entry;
+        nSize++;
+    }
+}
+
+size_t CStakeSeenSet::count(const std::pair<COutPoint, unsigned int>& stake) const
+{
+    if (!nSize || !stake.second)
+        return 0;
+    return vTable[Find(stake)].nTime ? 1 : 0;
+}
+
+void CStakeSeenSet::insert(const std::pair<COutPoint, unsigned int>& stake)
+{
+    if (!stake.second)
+        return; // no valid stake has a time of 0
+    if ((nSize + 1) * 4 > vTable.size() * 3)
+        Rehash(std::max(STAKE_SEEN_MIN_SLOTS, vTable.size() * 2), 0);
+    Entry& entry = vTable[Find(stake)];
+    if (entry.nTime)
+        return;
+    entry.prevout = stake.first;
+    entry.nTime = stake.second;
+    nSize++;
+}
+
+void CStakeSeenSet::clear()
+{
+    std::vector<Entry>().swap(vTable);
+    nSize = 0;
+}
+
+void CStakeSeenSet::EraseUpTo(unsigned int nTime)
+{
+    if (!nSize)
+        return;
+    size_t nKept = 0;
+    for (const Entry& entry : vTable)
+        nKept += entry.nTime > nTime;
+    size_t nSlots = STAKE_SEEN_MIN_SLOTS;
+    while (nKept * 4 > nSlots * 3)
+        nSlots *= 2;
+    Rehash(nSlots, nTime);
+}
@@ -5,8 +5,13 @@
 #ifndef R3VCOIN_KERNEL_H
 #define R3VCOIN_KERNEL_H
 
+#include "amount.h"
 #include "chain.h"
 
+#include <atomic>
+#include <memory>
+#include <vector>
+
 // MODIFIER_INTERVAL: time to elapse before new modifier is computed
 extern unsigned int nModifierInterval;
 
@@ -14,16 +19,163 @@ extern unsigned int nModifierInterval;
 // ratio of group interval length between the last group and the first group
 static const int MODIFIER_INTERVAL_RATIO = 3;
 
+// Get stake modifier selection interval (in seconds)
+int64_t GetStakeModifierSelectionInterval();
+
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 
+/**
+ * Kernel inputs of a staked output. Everything but the stake modifier is
+ * fixed once the output is confirmed; the modifier becomes known once the
+ * chain has advanced a selection interval past the confirming block.
+ */
+struct CStakeKernelContext
+{
+    const CBlockIndex* pindexFrom;      //!< block containing the staked output
+    unsigned int nTimeBlockFrom;
+    unsigned int nTxPrevOffset;
+    unsigned int nTimeTxPrev;           //!< tx timestamp, block timestamp if the tx has none
+    CAmount nValue;
+    const CBlockIndex* pindexModifier;  //!< block providing the stake modifier, NULL until resolved
+    uint64_t nStakeModifier;
+
+    CStakeKernelContext()
+    {
+        SetNull();
+    }
+
+    CStakeKernelContext(const CBlockIndex* pindexFromIn, unsigned int nTxPrevOffsetIn, unsigned int nTimeTxPrevIn, CAmount nValueIn)
+    {
+        SetNull();
+        pindexFrom = pindexFromIn;
+        nTimeBlockFrom = pindexFromIn->GetBlockTime();
+        nTxPrevOffset = nTxPrevOffsetIn;
+        // deal with missing timestamps in PoW blocks
+        nTimeTxPrev = nTimeTxPrevIn ? nTimeTxPrevIn : nTimeBlockFrom;
+        nValue = nValueIn;
+    }
+
+    void SetNull()
+    {
+        pindexFrom = NULL;
+        nTimeBlockFrom = 0;
+        nTxPrevOffset = 0;
+        nTimeTxPrev = 0;
+        nValue = 0;
+        pindexModifier = NULL;
+        nStakeModifier = 0;
+    }
+};
+
+// Resolve the stake modifier of a kernel context against the active chain.
+// A previously resolved modifier is kept while its block stays in the active
+// chain. Requires cs_main.
+bool ResolveKernelStakeModifier(CStakeKernelContext& kernel, bool fPrintProofOfStake=false);
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(unsigned int nBits, const CBlockHeader& blockFrom, unsigned int nTxPrevOffset, const CTransactionRef& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
 
+// Check whether stake kernel meets hash target using a resolved kernel context
+// Only hashes; does not touch the block index. Sets hashProofOfStake on success return
+bool CheckStakeKernelHash(unsigned int nBits, const CStakeKernelContext& kernel, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake);
+
+// Check kernel candidates [nBegin, nEnd) at nTimeTx against their hash
+// targets, hashing several kernels at a time. Candidates must be resolved;
+// those breaking the timestamp rules are skipped. Returns the index of the
+// first candidate meeting its target, or -1
+int CheckStakeKernelHashes(unsigned int nBits, const std::vector<std::pair<COutPoint, CStakeKernelContext> >& vCandidates, size_t nBegin, size_t nEnd, unsigned int nTimeTx);
+
+/**
+ * Hashes a slice of stake kernel candidates at each timestamp of a window, in
+ * order. Records the earliest kernel meeting the target in *pnFound, as its
+ * offset into the window in the high 32 bits and its index in the low ones,
+ * and stops at timestamps past a kernel another slice already found.
+ * Returns false only if the search is cancelled, so the other CCheckQueue
+ * workers skip their remaining slices.
+ */
+class CStakeKernelSearch
+{
+private:
+    const std::vector<std::pair<COutPoint, CStakeKernelContext> >* pvCandidates;
+    size_t nBegin;
+    size_t nEnd;
+    unsigned int nBits;
+    unsigned int nTimeBegin;
+    unsigned int nTimeEnd;
+    std::atomic<uint64_t>* pnFound;
+    const std::atomic<bool>* pfCancel;
+
+public:
+    CStakeKernelSearch() : pvCandidates(NULL), nBegin(0), nEnd(0), nBits(0), nTimeBegin(0), nTimeEnd(0), pnFound(NULL), pfCancel(NULL) {}
+    CStakeKernelSearch(const std::vector<std::pair<COutPoint, CStakeKernelContext> >* pvCandidatesIn, size_t nBeginIn, size_t nEndIn,
+                       unsigned int nBitsIn, unsigned int nTimeBeginIn, unsigned int nTimeEndIn, std::atomic<uint64_t>* pnFoundIn, const std::atomic<bool>* pfCancelIn) :
+        pvCandidates(pvCandidatesIn), nBegin(nBeginIn), nEnd(nEndIn), nBits(nBitsIn), nTimeBegin(nTimeBeginIn), nTimeEnd(nTimeEndIn), pnFound(pnFoundIn), pfCancel(pfCancelIn) {}
+
+    bool operator()();
+
+    void swap(CStakeKernelSearch &check) {
+        std::swap(pvCandidates, check.pvCandidates);
+        std::swap(nBegin, check.nBegin);
+        std::swap(nEnd, check.nEnd);
+        std::swap(nBits, check.nBits);
+        std::swap(nTimeBegin, check.nTimeBegin);
+        std::swap(nTimeEnd, check.nTimeEnd);
+        std::swap(pnFound, check.pnFound);
+        std::swap(pfCancel, check.pfCancel);
+    }
+};
+
+// Number of kernel candidates hashed by one stake search job
+static const size_t STAKE_SEARCH_SLICE = 64;
+
+// Search resolved kernel candidates for the earliest timestamp in
+// [nTimeBegin, nTimeEnd] at which one meets nBits, spread over the stake
+// search threads. Returns the index of the kernel found and sets nTimeFound,
+// or returns -1 if there is none or the search was cancelled through pfCancel
+int SearchStakeKernels(const std::vector<std::pair<COutPoint, CStakeKernelContext> >& vCandidates, unsigned int nBits, unsigned int nTimeBegin, unsigned int nTimeEnd, unsigned int& nTimeFound, const std::atomic<bool>* pfCancel=NULL);
+
+// Search resolved kernel candidates for one meeting nBits at nTimeTx
+int SearchStakeKernels(const std::vector<std::pair<COutPoint, CStakeKernelContext> >& vCandidates, unsigned int nBits, unsigned int nTimeTx, const std::atomic<bool>* pfCancel=NULL);
+
+// Run an instance of the stake kernel search thread
+void ThreadStakeSearch();
+
+/**
+ * Signature check of a proof-of-stake block: either the kernel input of its
+ * coinstake, or the block signature. Holds a copy of the spent output or a
+ * reference to the block so it can run on a CCheckQueue without cs_main.
+ */
+class CStakeCheck
+{
+private:
+    CTxOut txoutPrev;
+    CTransactionRef ptxTo;
+    std::shared_ptr<const CBlock> pblock;
+
+public:
+    CStakeCheck() {}
+    CStakeCheck(const CTxOut& txoutPrevIn, const CTransactionRef& ptxToIn) : txoutPrev(txoutPrevIn), ptxTo(ptxToIn) {}
+    explicit CStakeCheck(const std::shared_ptr<const CBlock>& pblockIn) : pblock(pblockIn) {}
+
+    bool operator()();
+
+    void swap(CStakeCheck &check) {
+        std::swap(txoutPrev, check.txoutPrev);
+        ptxTo.swap(check.ptxTo);
+        pblock.swap(check.pblock);
+    }
+};
+
+// Look up the kernel input of a coinstake and set up its signature check
+// Requires cs_main
+bool GetProofOfStakeCheck(const CTransactionRef& tx, CStakeCheck& check);
+
 // Check kernel hash target and coinstake signature
+// The signature check can be skipped if it already passed through GetProofOfStakeCheck
 // Sets hashProofOfStake on success return
-bool CheckProofOfStake(const CTransactionRef& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake);
+bool CheckProofOfStake(const CTransactionRef& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fCheckSignature=true);
 
 // Check whether the coinstake timestamp meets protocol
 bool CheckCoinStakeTimestamp(int64_t nTimeBlock, int64_t nTimeTx);
@@ -38,5 +190,42 @@ uint64_t GetCoinAge(const CTransactionRef& tx);
 // Calculate total coin age spent in block
 uint64_t GetCoinAge(const CBlock& block);
 
+/**
+ * The (kernel prevout, stake time) pairs of proof-of-stake blocks, against
+ * which duplicate stakes are rejected. An open addressing hash table of the
+ * pairs themselves under a salted hash, probed linearly, so an entry takes
+ * a fraction of a std::set node. A stake time of 0 marks an empty slot.
+ */
+class CStakeSeenSet
+{
+private:
+    struct Entry
+    {
+        COutPoint prevout;
+        unsigned int nTime;
+        Entry() : nTime(0) {}
+    };
+
+    std::vector<Entry> vTable;
+    size_t nSize;
+    const uint64_t k0, k1;
+
+    //! Slot holding stake, or the empty slot it would go into
+    size_t Find(const std::pair<COutPoint, unsigned int>& stake) const;
+    //! Rehash into nSlots slots, a power of two, keeping entries newer than nTimeAfter
+    void Rehash(size_t nSlots, unsigned int nTimeAfter);
+
+public:
+    CStakeSeenSet();
+
+    size_t count(const std::pair<COutPoint, unsigned int>& stake) const;
+    void insert(const std::pair<COutPoint, unsigned int>& stake);
+    void clear();
+    size_t size() const { return nSize; }
+
+    //! Drop the stakes with a time at or before nTime
+    void EraseUpTo(unsigned int nTime);
+};
+
 
 #endif // R3VCOIN_KERNEL_H
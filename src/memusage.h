@@ -6,6 +6,7 @@
 #define BITCOIN_MEMUSAGE_H
 
 #include "indirectmap.h"
+#include "support/allocators/pool.h"
 
 #include <stdlib.h>
 
@@ -167,6 +168,19 @@ static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z>& m)
     return MallocUsage(sizeof(boost_unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
 }
 
+template<typename X, typename Y, typename Z, typename P, std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z, P, PoolAllocator<std::pair<const X, Y>, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> >& m)
+{
+    // Nodes live in the chunks of the pool, free ones included, and are not
+    // counted one by one. The pool itself is held by a shared_ptr, and its
+    // chunks by a vector.
+    const PoolResource<MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>* pool = m.get_allocator().Resource();
+    return MallocUsage(pool->ChunkSizeBytes()) * pool->NumAllocatedChunks() +
+           MallocUsage(sizeof(void*) * pool->NumAllocatedChunks()) +
+           MallocUsage(sizeof(*pool)) + MallocUsage(sizeof(stl_shared_counter)) +
+           MallocUsage(sizeof(void*) * m.bucket_count());
+}
+
 }
 
 #endif // BITCOIN_MEMUSAGE_H
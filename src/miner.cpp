@@ -13,6 +13,7 @@
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
 #include "hash.h"
+#include "kernel.h"
 #include "crypto/scrypt.h"
 #include "validation.h"
 #include "net.h"
@@ -33,6 +34,8 @@
 #include <queue>
 #include <utility>
 
+#include <univalue.h>
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // BitcoinMiner
@@ -688,6 +691,68 @@ void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned
     pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
 }
 
+CCriticalSection cs_stakerStats;
+CStakerStats stakerStats;
+
+CStakerTimer::CStakerTimer() : nCount(0), nTotal(0), nMax(0)
+{
+    std::fill(vBuckets, vBuckets + BUCKETS, 0);
+}
+
+void CStakerTimer::Add(int64_t nMicros)
+{
+    int nBucket = 0;
+    while (nBucket < BUCKETS - 1 && (nMicros >> (nBucket + 1)) > 0)
+        nBucket++;
+    vBuckets[nBucket]++;
+    nCount++;
+    nTotal += nMicros;
+    nMax = std::max(nMax, nMicros);
+}
+
+CStakerStats::CStakerStats() : nSearches(0), nKernels(0), nCandidates(0), nLastCandidates(0), nTipChanged(0), nStakesFound(0), nStakesStale(0), nStakesAccepted(0) {}
+
+static UniValue StakerTimerToJSON(const CStakerTimer& timer)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("count", timer.nCount));
+    obj.push_back(Pair("total_us", timer.nTotal));
+    obj.push_back(Pair("avg_us", timer.nCount ? timer.nTotal / (int64_t)timer.nCount : 0));
+    obj.push_back(Pair("max_us", timer.nMax));
+    UniValue histogram(UniValue::VARR);
+    for (int i = 0; i < CStakerTimer::BUCKETS; i++)
+        histogram.push_back(timer.vBuckets[i]);
+    obj.push_back(Pair("histogram", histogram));
+    return obj;
+}
+
+UniValue StakerStatsToJSON()
+{
+    LOCK(cs_stakerStats);
+    const CStakerStats& stats = stakerStats;
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("searches", stats.nSearches));
+    obj.push_back(Pair("kernels", stats.nKernels));
+    obj.push_back(Pair("kernelspersecond", stats.search.nTotal ? (double)stats.nKernels * 1000000 / stats.search.nTotal : 0.0));
+    obj.push_back(Pair("candidates", stats.nLastCandidates));
+    obj.push_back(Pair("averagecandidates", stats.nSearches ? (double)stats.nCandidates / stats.nSearches : 0.0));
+    obj.push_back(Pair("tipchanged", stats.nTipChanged));
+    obj.push_back(Pair("stakesfound", stats.nStakesFound));
+    obj.push_back(Pair("stakesstale", stats.nStakesStale));
+    obj.push_back(Pair("stakesaccepted", stats.nStakesAccepted));
+
+    UniValue timings(UniValue::VOBJ);
+    timings.push_back(Pair("createblock", StakerTimerToJSON(stats.createBlock)));
+    timings.push_back(Pair("search", StakerTimerToJSON(stats.search)));
+    timings.push_back(Pair("signcoinstake", StakerTimerToJSON(stats.signCoinStake)));
+    timings.push_back(Pair("signblock", StakerTimerToJSON(stats.signBlock)));
+    timings.push_back(Pair("testblockvalidity", StakerTimerToJSON(stats.testBlockValidity)));
+    timings.push_back(Pair("lockwait", StakerTimerToJSON(stats.lockWait)));
+    obj.push_back(Pair("timings", timings));
+    return obj;
+}
+
 #ifdef ENABLE_WALLET
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -747,6 +812,57 @@ bool CheckStake(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
     return true;
 }
 
+/**
+ * Wakes the staking thread when the chain tip or the mempool changes, so it
+ * does not have to poll. A tip change also cancels a kernel search that is
+ * still running against the old tip.
+ */
+class CStakerNotifier : public CValidationInterface
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    bool fUpdated;
+
+    void Notify()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fUpdated = true;
+        }
+        cond.notify_all();
+    }
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload)
+    {
+        fTipChanged = true;
+        Notify();
+    }
+
+    void SyncTransaction(const CTransaction &tx, const CBlockIndex *pindex, int posInBlock)
+    {
+        // new mempool transactions may add fees to the next block
+        if (posInBlock == CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK)
+            Notify();
+    }
+
+public:
+    //! Set on every tip change, cleared by the staker before it starts a search
+    std::atomic<bool> fTipChanged;
+
+    CStakerNotifier() : fUpdated(false), fTipChanged(false) {}
+
+    //! Wait until an update comes in or nMilliseconds have passed. Interruptible.
+    void Wait(int64_t nMilliseconds)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (!fUpdated)
+            cond.timed_wait(lock, boost::posix_time::milliseconds(nMilliseconds));
+        fUpdated = false;
+    }
+};
+
 void CoinStaker(CWallet *pwallet)
 {
     LogPrintf("CoinStaker started\n");
@@ -755,97 +871,192 @@ void CoinStaker(CWallet *pwallet)
     RenameThread("coin-staker");
     CReserveKey reservekey(pwallet);
 
+    CStakerNotifier notifier;
+    RegisterValidationInterface(&notifier);
+
+    // Template of the last tick and the mempool update count it was built at
+    std::unique_ptr<CBlockTemplate> pblocktemplate;
+    unsigned int nTemplateTransactionsUpdated = 0;
+
+    // Kernel timestamps up to nSearchedTo already searched on hashSearchedTip,
+    // with the stakeable outputs of wallet stake generation nSearchedGeneration
+    uint256 hashSearchedTip;
+    unsigned int nSearchedGeneration = 0;
+    unsigned int nSearchedTo = 0;
+
     std::string chain = ChainNameFromCommandLine();
 
     try { while (true) {
         if (chain != CBaseChainParams::REGTEST) {
-            // Busy-wait for the network to come online so we don't waste time mining
+            // Wait for the network to come online so we don't waste time mining
             // on an obsolete chain. In regtest mode we expect to fly solo.
             while (!g_connman || g_connman->GetNodeCount(CConnman::CONNECTIONS_OUT) == 0)
             {
-                // Busy-wait for the network to come online.
                 LogPrintf("CoinStaker : Waiting for network online.\n");
                 nLastCoinStakeSearchInterval = 0;
-                MilliSleep(1000);
+                notifier.Wait(1000);
             }
         }
 
-        while (IsInitialBlockDownload()) 
+        if (IsInitialBlockDownload())
         {
-            // Busy-wait for the download of the blockchain to complete
+            // Wait for the download of the blockchain to complete
             LogPrintf("CoinStaker : Waiting... Blockchain Downloading.\n");
-            MilliSleep(60000);
+            while (IsInitialBlockDownload())
+                notifier.Wait(60000);
         }
 
         while (pwallet->IsLocked())
         {
             LogPrintf("CoinStaker : Wallet is locked.\n");
             nLastCoinStakeSearchInterval = 0;
-            MilliSleep(1000);
+            notifier.Wait(1000);
         }
 
         //Skip if next block is PoW
-        while (chainActive.Tip()->nHeight + 1 <= Params().LastProofOfWorkHeight())
+        if (chainActive.Tip()->nHeight + 1 <= Params().LastProofOfWorkHeight())
         {
             LogPrintf("CoinStaker : Chaintip < Last POW, %u < %u.\n", chainActive.Tip()->nHeight + 1, Params().LastProofOfWorkHeight());
-            MilliSleep(60000);
+            while (chainActive.Tip()->nHeight + 1 <= Params().LastProofOfWorkHeight())
+                notifier.Wait(60000);
         }
 
         //
-        // Create a new block
+        // Create a new block, or reuse the template while neither the tip
+        // nor the mempool changed
         //
-        
-        std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(Params()).CreateNewBlockWithKey(reservekey));
-        if (!pblocktemplate.get())
-            return;
-        CBlock *pblock = &pblocktemplate->block;
+
+        notifier.fTipChanged = false;
+        unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+        uint256 hashTip;
+        int64_t nTimeStart = GetTimeMicros();
+        {
+            LOCK(cs_main);
+            hashTip = chainActive.Tip()->GetBlockHash();
+        }
+        {
+            LOCK(cs_stakerStats);
+            stakerStats.lockWait.Add(GetTimeMicros() - nTimeStart);
+        }
+        if (!pblocktemplate || pblocktemplate->block.hashPrevBlock != hashTip || nTransactionsUpdated != nTemplateTransactionsUpdated)
+        {
+            nTimeStart = GetTimeMicros();
+            pblocktemplate = BlockAssembler(Params()).CreateNewBlockWithKey(reservekey);
+            if (!pblocktemplate.get())
+                break;
+            nTemplateTransactionsUpdated = nTransactionsUpdated;
+            LOCK(cs_stakerStats);
+            stakerStats.createBlock.Add(GetTimeMicros() - nTimeStart);
+        }
+        // only the coinstake, block time and signature differ between ticks
+        CBlock block(pblocktemplate->block);
+        CBlock *pblock = &block;
         int64_t nFees = pblocktemplate->vTxFees[0] * -1;
 
+        // Search every kernel timestamp up to STAKE_SEARCH_WINDOW seconds
+        // ahead in one pass, skipping those already searched on this tip
+        // while no more outputs became stakeable
+        unsigned int nGeneration = pwallet->GetStakeGeneration();
+        if (hashSearchedTip != hashTip || nSearchedGeneration != nGeneration) {
+            hashSearchedTip = hashTip;
+            nSearchedGeneration = nGeneration;
+            nSearchedTo = 0;
+        }
+        unsigned int nSearchTimeBegin = std::max((unsigned int)GetAdjustedTime(), nSearchedTo + 1);
+        unsigned int nSearchTimeEnd = GetAdjustedTime() + STAKE_SEARCH_WINDOW;
+        if (nSearchTimeBegin > nSearchTimeEnd) {
+            notifier.Wait(1000 * (nSearchTimeBegin - nSearchTimeEnd));
+            continue;
+        }
+
+        // Until the earliest maturing of our outputs passes the min age
+        // there is nothing to search; wait for it to enter the window
+        unsigned int nMaturity = pwallet->GetStakeMaturityTime();
+        if (!nMaturity || nMaturity > nSearchTimeEnd) {
+            nSearchedTo = nMaturity ? nMaturity - 1 : nSearchTimeEnd;
+            if (!nMaturity)
+                notifier.Wait(1000 * STAKE_SEARCH_WINDOW / 2);
+            continue;
+        }
+
         // Trying to sign the PoSV block
-        if (pwallet->SignBlock(pblock, nFees)) 
+        if (pwallet->SignBlock(pblock, nFees, nSearchTimeBegin, nSearchTimeEnd, &notifier.fTipChanged))
         {
+            // the kernel may be for a future second; hold the signed block
+            // until then, dropping it if the tip moves on meanwhile
+            nSearchedTo = pblock->nTime;
+            while (!notifier.fTipChanged && GetAdjustedTime() < pblock->GetBlockTime())
+                notifier.Wait(1000 * (pblock->GetBlockTime() - GetAdjustedTime()));
+            {
+                LOCK(cs_stakerStats);
+                stakerStats.nStakesFound++;
+                if (notifier.fTipChanged)
+                    stakerStats.nTipChanged++;
+            }
+            if (notifier.fTipChanged)
+                continue;
+
             CValidationState state;
-            if (!TestBlockValidity(state, Params(), pblocktemplate->block, chainActive.Tip(), false, false)) {
+            bool fValid;
+            int64_t nTimeLocked;
+            nTimeStart = GetTimeMicros();
+            {
+                LOCK(cs_main);
+                nTimeLocked = GetTimeMicros();
+                fValid = TestBlockValidity(state, Params(), block, chainActive.Tip(), false, false);
+            }
+            {
+                LOCK(cs_stakerStats);
+                stakerStats.lockWait.Add(nTimeLocked - nTimeStart);
+                stakerStats.testBlockValidity.Add(GetTimeMicros() - nTimeLocked);
+            }
+            if (!fValid) {
                 if (fDebug) {
                     LogPrintf("CoinStaker : TestBlockValidity failed: %s\n", FormatStateMessage(state));
                 }
-                MilliSleep(6000);
+                {
+                    LOCK(cs_stakerStats);
+                    stakerStats.nStakesStale++;
+                }
+                // retry on a new tip, or after a while with a fresh template
+                pblocktemplate.reset();
+                notifier.Wait(6000);
                 //throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
-            } else {
-                if (CheckStake(pblock, *pwallet, reservekey)) {
-                    if (chainActive.Tip()->nHeight > Params().StakeMinAge() * 2) {
-                        MilliSleep(1000);
-                    } else if (chainActive.Tip()->nHeight > Params().StakeMinAge()) {
-                        MilliSleep(2000);
-                    } else if (chainActive.Tip()->nHeight > Params().StakeMinAge() / 2) {
-                        MilliSleep(5000);
-                    } else if (chainActive.Tip()->nHeight > Params().StakeMinAge() / 5) {
-                        MilliSleep(10000);
-                    } else if (chainActive.Tip()->nHeight > Params().StakeMinAge() / 10) {
-                        MilliSleep(15000);
-                    } else if (chainActive.Tip()->nHeight > Params().StakeMinAge() / 20) {
-                        MilliSleep(30000);
-                    } else  {
-                        MilliSleep(60000);
-                    }
-                } else {
-                    MilliSleep(1000);
+            } else if (!CheckStake(pblock, *pwallet, reservekey)) {
+                {
+                    LOCK(cs_stakerStats);
+                    stakerStats.nStakesStale++;
                 }
+                notifier.Wait(1000);
+            } else {
+                // our own block has become the tip; start over on it
+                LOCK(cs_stakerStats);
+                stakerStats.nStakesAccepted++;
             }
         }
         else
         {
-            if (fDebug) {
+            if (fDebug && !notifier.fTipChanged) {
                 LogPrintf("CoinStaker : Failed to sign the new block.\n");
             }
-            MilliSleep(1000);
+            if (notifier.fTipChanged) {
+                LOCK(cs_stakerStats);
+                stakerStats.nTipChanged++;
+            }
+            // no kernel in the window; search the seconds that enter it later
+            // on, or start over once the tip changes
+            if (!notifier.fTipChanged)
+                nSearchedTo = nSearchTimeEnd;
+            notifier.Wait(1000 * STAKE_SEARCH_WINDOW / 2);
         }
     } }
     catch (boost::thread_interrupted)
     {
         LogPrintf("CoinStaker terminated\n");
+        UnregisterValidationInterface(&notifier);
         throw;
     }
+    UnregisterValidationInterface(&notifier);
 }
 
 void GenerateCoins(bool fGenerate, CWallet* pwallet, int nThreads)
@@ -855,6 +1066,7 @@ void GenerateCoins(bool fGenerate, CWallet* pwallet, int nThreads)
     if (minerThreads != NULL)
     {
         minerThreads->interrupt_all();
+        minerThreads->join_all();
         delete minerThreads;
         minerThreads = NULL;
     }
@@ -862,10 +1074,16 @@ void GenerateCoins(bool fGenerate, CWallet* pwallet, int nThreads)
     if (nThreads == 0 || !fGenerate)
         return;
 
+    if (nThreads < 0)
+        nThreads = GetNumCores();
+
     minerThreads = new boost::thread_group();
 
-    // start one thread for PoSV minting
+    // start one thread for PoSV minting, which searches kernels together
+    // with the remaining threads
     minerThreads->create_thread(boost::bind(&CoinStaker, pwallet));
+    for (int i = 1; i < nThreads; i++)
+        minerThreads->create_thread(&ThreadStakeSearch);
 }
 
 #endif
\ No newline at end of file
@@ -19,10 +19,13 @@ class CChainParams;
 class CReserveKey;
 class CScript;
 class CWallet;
+class UniValue;
 
 namespace Consensus { struct Params; };
 
 static const bool DEFAULT_PRINTPRIORITY = false;
+/** Seconds of future kernel timestamps the staker searches ahead of the clock */
+static const unsigned int STAKE_SEARCH_WINDOW = 60;
 
 struct CBlockTemplate
 {
@@ -220,4 +223,47 @@ int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParam
 /** Run the miner threads */
 void GenerateCoins(bool fGenerate, CWallet* pwallet, int nThreads);
 
+/** Latency histogram in power of two buckets of microseconds */
+struct CStakerTimer
+{
+    //! Bucket i counts latencies below 2^(i+1) us, the last one everything above
+    static const int BUCKETS = 25;
+
+    uint64_t vBuckets[BUCKETS];
+    uint64_t nCount;
+    int64_t nTotal;
+    int64_t nMax;
+
+    CStakerTimer();
+    void Add(int64_t nMicros);
+};
+
+/** PoSV: what the staking thread spends its time on */
+struct CStakerStats
+{
+    uint64_t nSearches;         //!< kernel searches run
+    uint64_t nKernels;          //!< kernels hashed, each candidate at each timestamp searched
+    uint64_t nCandidates;       //!< candidate coins summed over all searches
+    uint64_t nLastCandidates;   //!< candidate coins of the last search
+    uint64_t nTipChanged;       //!< searches or signed blocks dropped because the tip moved
+    uint64_t nStakesFound;      //!< blocks signed
+    uint64_t nStakesStale;      //!< signed blocks rejected by TestBlockValidity or CheckStake
+    uint64_t nStakesAccepted;   //!< signed blocks accepted as the new tip
+
+    CStakerTimer createBlock;       //!< block template creation
+    CStakerTimer search;            //!< kernel searches
+    CStakerTimer signCoinStake;     //!< signing the coinstake inputs
+    CStakerTimer signBlock;         //!< assembling and signing the block
+    CStakerTimer testBlockValidity; //!< TestBlockValidity of signed blocks
+    CStakerTimer lockWait;          //!< waits for cs_main
+
+    CStakerStats();
+};
+
+extern CCriticalSection cs_stakerStats;
+extern CStakerStats stakerStats;
+
+/** Snapshot of stakerStats, as returned by getstakerstats */
+UniValue StakerStatsToJSON();
+
 #endif // BITCOIN_MINER_H
@@ -662,6 +662,8 @@ public:
     // Block and TXN accept times
     std::atomic<int64_t> nLastBlockTime;
     std::atomic<int64_t> nLastTXTime;
+    // Requested blocks received back to back, waiting to be processed as a run
+    std::atomic<int> nBlocksReceived;
 
     // Ping time measurement:
     // The pong reply we're expecting, or 0 if no pong expected.
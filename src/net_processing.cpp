@@ -176,6 +176,8 @@ struct CNodeState {
     int64_t nDownloadingSince;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! Requested blocks received back to back during initial block download, not yet processed.
+    std::vector<std::shared_ptr<const CBlock> > vBlocksReceived;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
     //! Whether this peer wants invs or headers (when possible) for block announcements.
@@ -905,12 +907,14 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
                 recentRejects->reset();
             }
 
-            // Use pcoinsTip->HaveCoinsInCache as a quick approximation to exclude
-            // requesting or processing some txs which have already been included in a block
+            // Use pcoinsTip->HaveCoinInCache as a quick approximation to exclude
+            // requesting or processing some txs which have already been included in a block.
+            // Outputs 0 and 1 cover nearly every transaction
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
                    mapOrphanTransactions.count(inv.hash) ||
-                   pcoinsTip->HaveCoinsInCache(inv.hash);
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) ||
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
         }
     case MSG_BLOCK:
     case MSG_WITNESS_BLOCK:
@@ -1170,6 +1174,31 @@ inline void static SendBlockTransactions(const CBlock& block, const BlockTransac
     connman.PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCKTXN, resp));
 }
 
+// Hand the run of blocks received from a peer to ProcessNewBlocks, which
+// checks their stake signatures in parallel
+void static ProcessReceivedBlocks(CNode* pfrom, const CChainParams& chainparams)
+{
+    std::vector<std::shared_ptr<const CBlock> > vpblock;
+    {
+        LOCK(cs_main);
+        vpblock.swap(State(pfrom->GetId())->vBlocksReceived);
+        pfrom->nBlocksReceived = 0;
+        BOOST_FOREACH(const std::shared_ptr<const CBlock>& pblock, vpblock) {
+            const uint256 hash(pblock->GetHash());
+            MarkBlockAsReceived(hash);
+            mapBlockSource.emplace(hash, std::make_pair(pfrom->GetId(), true));
+        }
+    }
+    if (vpblock.empty())
+        return;
+
+    // Every block of the run was requested
+    bool fNewBlock = false;
+    ProcessNewBlocks(chainparams, vpblock, true, &fNewBlock);
+    if (fNewBlock)
+        pfrom->nLastBlockTime = GetTime();
+}
+
 bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman& connman, const std::atomic<bool>& interruptMsgProc)
 {
     LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->id);
@@ -2405,6 +2434,31 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
             block.hashMerkleRoot = BlockMerkleRoot(block);
         }
 
+        // During initial block download the blocks requested from this peer
+        // arrive back to back. They are collected into a run, which
+        // ProcessMessages hands over once no block message follows.
+        bool fQueued = false;
+        bool fRunFull = false;
+        if (IsInitialBlockDownload()) {
+            LOCK(cs_main);
+            std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(pblock->GetHash());
+            if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == pfrom->GetId()) {
+                CNodeState *nodestate = State(pfrom->GetId());
+                nodestate->vBlocksReceived.push_back(pblock);
+                pfrom->nBlocksReceived = nodestate->vBlocksReceived.size();
+                fQueued = true;
+                fRunFull = nodestate->vBlocksReceived.size() >= (size_t)MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+            }
+        }
+        // Other blocks are processed alone, after the run before them
+        if (fQueued) {
+            if (fRunFull)
+                ProcessReceivedBlocks(pfrom, chainparams);
+            return true;
+        }
+        if (pfrom->nBlocksReceived > 0)
+            ProcessReceivedBlocks(pfrom, chainparams);
+
         // Process all blocks from whitelisted peers, even if not requested,
         // unless we're still syncing with the network.
         // Such an unrequested block may still be processed, subject to the
@@ -2779,6 +2833,17 @@ bool ProcessMessages(CNode* pfrom, CConnman& connman, const std::atomic<bool>& i
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
 
+        // A run of blocks ends where no block message follows
+        if (pfrom->nBlocksReceived > 0 && !interruptMsgProc) {
+            bool fMoreBlocks;
+            {
+                LOCK(pfrom->cs_vProcessMsg);
+                fMoreBlocks = !pfrom->vProcessMsg.empty() && pfrom->vProcessMsg.front().hdr.GetCommand() == NetMsgType::BLOCK;
+            }
+            if (!fMoreBlocks)
+                ProcessReceivedBlocks(pfrom, chainparams);
+        }
+
         if (!fRet) {
             LogPrintf("%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->id);
         }
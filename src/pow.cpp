@@ -9,10 +9,74 @@
 #include "chain.h"
 #include "chainparams.h"
 #include "primitives/block.h"
+#include "sync.h"
 #include "uint256.h"
 #include "util.h"
 #include "validation.h"
 
+#include <math.h>
+#include <vector>
+
+/**
+ * Past block mass at or beyond which the event horizon deviation is read
+ * from a table instead of computed with pow(). The table covers the whole
+ * PastBlocksMax window of the main chain.
+ */
+static const uint64_t EVENT_HORIZON_TABLE_SIZE = 604800 / 60 + 1;
+
+/** Number of recent retarget results kept by CalculateNextWorkRequired */
+static const int NEXT_WORK_CACHE_SIZE = 64;
+
+static double EventHorizonDeviationCompute(uint64_t PastBlocksMass)
+{
+    return 1 + (0.7084 * pow((double(PastBlocksMass)/double(144)), -1.228));
+}
+
+static std::vector<double> EventHorizonDeviationTable()
+{
+    std::vector<double> vDeviation(EVENT_HORIZON_TABLE_SIZE);
+    for (uint64_t m = 1; m < vDeviation.size(); m++)
+        vDeviation[m] = EventHorizonDeviationCompute(m);
+    return vDeviation;
+}
+
+static double GetEventHorizonDeviation(uint64_t PastBlocksMass)
+{
+    static const std::vector<double> vDeviation = EventHorizonDeviationTable();
+    if (PastBlocksMass > 0 && PastBlocksMass < vDeviation.size())
+        return vDeviation[PastBlocksMass];
+    return EventHorizonDeviationCompute(PastBlocksMass);
+}
+
+/**
+ * Direct-mapped cache of KimotoGravityWell results by the block they
+ * retarget after. The same tip is retargeted for every block template, every
+ * staker wakeup and every header or block connected on top of it, and each
+ * of those walks up to a week of blocks.
+ */
+struct CNextWorkCacheEntry
+{
+    const CBlockIndex* pindexLast;
+    uint256 hashLast;
+    unsigned int nTimeLast;
+    unsigned int nBits;
+};
+
+static CCriticalSection cs_nextWorkCache;
+static CNextWorkCacheEntry nextWorkCache[NEXT_WORK_CACHE_SIZE];
+
+static CNextWorkCacheEntry& NextWorkCacheEntry(const CBlockIndex* pindexLast)
+{
+    return nextWorkCache[pindexLast->nHeight % NEXT_WORK_CACHE_SIZE];
+}
+
+void ClearNextWorkCache()
+{
+    LOCK(cs_nextWorkCache);
+    for (CNextWorkCacheEntry& entry : nextWorkCache)
+        entry.pindexLast = NULL;
+}
+
 unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast, uint64_t TargetBlocksSpacingSeconds, uint64_t PastBlocksMin, uint64_t PastBlocksMax, const Consensus::Params& params)
 {
     const CBlockIndex  *BlockLastSolved = pindexLast;
@@ -66,10 +130,10 @@ unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast, uint64_t Ta
         {
             BlockDifficulty.SetCompact(BlockReading->nBits);
             //LogPrintf("KimotoGravityWell() - i: %u,       BlockDifficulty:  %08x  %s %u %u %u\n", i, BlockDifficulty.GetCompact(), ArithToUint256(BlockDifficulty).ToString(), BlockDifficulty.getdouble(), (int64_t)(1-1/i), (int64_t)(1/i));
-            BlockDifficultyAverage = BlockDifficulty / (int64_t)i;
+            BlockDifficultyAverage = BlockDifficulty / (uint32_t)i;
             //LogPrintf("KimotoGravityWell() - i: %u,    BlockDifficultyAvg:  %08x  %s %u\n", i, BlockDifficultyAverage.GetCompact(), ArithToUint256(BlockDifficultyAverage).ToString(), BlockDifficultyAverage.getdouble());
             PastDifficultyAverage = PastDifficultyAveragePrev * (int64_t)(i-1);
-            PastDifficultyAverage = PastDifficultyAverage / (int64_t)i;
+            PastDifficultyAverage = PastDifficultyAverage / (uint32_t)i;
             //LogPrintf("KimotoGravityWell() - i: %u, PastDifficultyAverage:  %08x  %s %u\n", i, PastDifficultyAverage.GetCompact(), ArithToUint256(PastDifficultyAverage).ToString(), PastDifficultyAverage.getdouble());
             PastDifficultyAverage = BlockDifficultyAverage + PastDifficultyAverage;
             //LogPrintf("KimotoGravityWell() - i: %u, PastDifficultyAverage:  %08x  %s %u\n", i, PastDifficultyAverage.GetCompact(), ArithToUint256(PastDifficultyAverage).ToString(), PastDifficultyAverage.getdouble());
@@ -86,7 +150,7 @@ unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast, uint64_t Ta
         if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0)
             PastRateAdjustmentRatio = double(PastRateTargetSeconds) / double(PastRateActualSeconds);
 
-        EventHorizonDeviation = 1 + (0.7084 * pow((double(PastBlocksMass)/double(144)), -1.228));
+        EventHorizonDeviation = GetEventHorizonDeviation(PastBlocksMass);
         EventHorizonDeviationFast = EventHorizonDeviation;
         EventHorizonDeviationSlow = 1 / EventHorizonDeviation;
 
@@ -166,8 +230,28 @@ unsigned int CalculateNextWorkRequired(const CBlockIndex* pindexLast, int64_t nF
 
     uint64_t PastBlocksMin = PastSecondsMin / nTargetSpacing;
     uint64_t PastBlocksMax = PastSecondsMax / nTargetSpacing;
-    
-    return KimotoGravityWell(pindexLast, nTargetSpacing, PastBlocksMin, PastBlocksMax, params);
+
+    // Only entries of the block index are cached, a block without a hash may
+    // be a temporary whose address gets reused
+    if (!pindexLast->phashBlock)
+        return KimotoGravityWell(pindexLast, nTargetSpacing, PastBlocksMin, PastBlocksMax, params);
+
+    {
+        LOCK(cs_nextWorkCache);
+        const CNextWorkCacheEntry& entry = NextWorkCacheEntry(pindexLast);
+        if (entry.pindexLast == pindexLast && entry.hashLast == *pindexLast->phashBlock && entry.nTimeLast == pindexLast->nTime)
+            return entry.nBits;
+    }
+
+    unsigned int nBits = KimotoGravityWell(pindexLast, nTargetSpacing, PastBlocksMin, PastBlocksMax, params);
+
+    LOCK(cs_nextWorkCache);
+    CNextWorkCacheEntry& entry = NextWorkCacheEntry(pindexLast);
+    entry.pindexLast = pindexLast;
+    entry.hashLast = *pindexLast->phashBlock;
+    entry.nTimeLast = pindexLast->nTime;
+    entry.nBits = nBits;
+    return nBits;
 }
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params& params)
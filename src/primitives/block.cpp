@@ -23,6 +23,20 @@ uint256 CBlockHeader::GetPoWHash() const
     return thash;
 }
 
+std::vector<uint256> GetPoWHashes(const std::vector<CBlockHeader>& vHeaders)
+{
+    std::vector<char> vInput(80 * vHeaders.size());
+    for (size_t i = 0; i < vHeaders.size(); i++)
+        memcpy(&vInput[80 * i], BEGIN(vHeaders[i].nVersion), 80);
+    std::vector<char> vOutput(32 * vHeaders.size());
+    scrypt_1024_1_1_256_multi(vInput.data(), vOutput.data(), vHeaders.size());
+
+    std::vector<uint256> vHashes(vHeaders.size());
+    for (size_t i = 0; i < vHeaders.size(); i++)
+        memcpy(BEGIN(vHashes[i]), &vOutput[32 * i], 32);
+    return vHashes;
+}
+
 std::string CBlock::ToString() const
 {
     std::stringstream s;
@@ -174,6 +174,9 @@ public:
     std::string ToString() const;
 };
 
+/** The PoW hashes of a batch of headers, computed several at a time */
+std::vector<uint256> GetPoWHashes(const std::vector<CBlockHeader>& vHeaders);
+
 /** Describes a place in the block chain to another node such that if the
  * other node doesn't have the same branch, it can find a recent common trunk.
  * The further back it is, the further before the fork it may be.
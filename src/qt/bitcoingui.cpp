@@ -1146,10 +1146,6 @@ void BitcoinGUI::updateWeight()
     if (!pwalletMain)
         return;
 
-    TRY_LOCK(cs_main, lockMain);
-    if (!lockMain)
-        return;
-
     TRY_LOCK(pwalletMain->cs_wallet, lockWallet);
     if (!lockWallet)
         return;
@@ -320,6 +320,42 @@ UniValue getstakinginfo(const JSONRPCRequest& request)
 }
 #endif
 
+UniValue getstakerstats(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 0)
+        throw runtime_error(
+            "getstakerstats\n"
+            "\nReturns counters and timings of the staking thread since startup.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"searches\": n,             (numeric) Kernel searches run\n"
+            "  \"kernels\": n,              (numeric) Kernels hashed, each candidate coin at each timestamp searched\n"
+            "  \"kernelspersecond\": x.x,   (numeric) Kernels hashed per second of search\n"
+            "  \"candidates\": n,           (numeric) Candidate coins of the last search\n"
+            "  \"averagecandidates\": x.x,  (numeric) Candidate coins per search\n"
+            "  \"tipchanged\": n,           (numeric) Searches or signed blocks dropped because the tip moved\n"
+            "  \"stakesfound\": n,          (numeric) Blocks signed\n"
+            "  \"stakesstale\": n,          (numeric) Signed blocks rejected by TestBlockValidity or CheckStake\n"
+            "  \"stakesaccepted\": n,       (numeric) Signed blocks accepted as the new tip\n"
+            "  \"timings\": {               (json object) Latencies of createblock, search, signcoinstake,\n"
+            "                               signblock, testblockvalidity and lockwait (waiting for cs_main)\n"
+            "    \"xxxx\": {\n"
+            "      \"count\": n,            (numeric) Number of samples\n"
+            "      \"total_us\": n,         (numeric) Total time in microseconds\n"
+            "      \"avg_us\": n,           (numeric) Average time in microseconds\n"
+            "      \"max_us\": n,           (numeric) Longest time in microseconds\n"
+            "      \"histogram\": [n,...]   (array) Samples below 2, 4, 8, ... microseconds, the last entry those above\n"
+            "    }, ...\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getstakerstats", "")
+            + HelpExampleRpc("getstakerstats", "")
+        );
+
+    return StakerStatsToJSON();
+}
+
 
 // NOTE: Unlike wallet RPC (which use BTC values), mining RPCs follow GBT (BIP 22) in using satoshi amounts
 UniValue prioritisetransaction(const JSONRPCRequest& request)
@@ -1019,6 +1055,7 @@ static const CRPCCommand commands[] =
     { "mining",             "getnetworkhashps",       &getnetworkhashps,       true,  {"nblocks","height"} },
     { "mining",             "getmininginfo",          &getmininginfo,          true,  {} },
     { "mining",             "getstakinginfo",         &getstakinginfo,          true,  {} },
+    { "mining",             "getstakerstats",         &getstakerstats,         true,  {} },
     { "mining",             "prioritisetransaction",  &prioritisetransaction,  true,  {"txid","priority_delta","fee_delta"} },
     { "mining",             "getblocktemplate",       &getblocktemplate,       true,  {"template_request"} },
     { "mining",             "submitblock",            &submitblock,            true,  {"hexdata","parameters"} },
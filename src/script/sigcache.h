@@ -32,4 +32,11 @@ public:
 
 void InitSignatureCache();
 
+/**
+ * Verify an ECDSA signature of hash by pubkey, skipping the verification when
+ * the signature cache already holds it. Valid signatures are added to the
+ * cache if store is set.
+ */
+bool CachedVerifySignature(const CPubKey& pubkey, const uint256& hash, const std::vector<unsigned char>& vchSig, bool store);
+
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
@@ -0,0 +1,212 @@
+// Copyright (c) 2018 The R3VCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "snapshot.h"
+
+#include "chain.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "coins.h"
+#include "hash.h"
+#include "streams.h"
+#include "txdb.h"
+#include "util.h"
+#include "validation.h"
+
+#include <memory>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+//! Coins are written in chunks of up to this many
+static const size_t SNAPSHOT_COINS_CHUNK = 10000;
+//! Block index entries are loaded into the database in batches of this many
+static const size_t SNAPSHOT_INDEX_BATCH = 10000;
+
+// A snapshot does not refer to the block files of the node that wrote it
+static void StripBlockFiles(CDiskBlockIndex& index)
+{
+    // The PoW hash is stored apart from the index record, so it does not travel either
+    index.nStatus &= ~(BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO | BLOCK_HAVE_POW_HASH);
+    index.nFile = 0;
+    index.nDataPos = 0;
+    index.nUndoPos = 0;
+}
+
+bool DumpUTXOSnapshot(const boost::filesystem::path& path, CSnapshotHeader& header, uint64_t& nCoins, uint256& hashSnapshot)
+{
+    boost::filesystem::path pathTmp = path;
+    pathTmp += ".incomplete";
+    CAutoFile fileout(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s: failed to open %s", __func__, pathTmp.string());
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+
+    std::unique_ptr<CCoinsViewCursor> pcursor;
+    // Time and proof-of-stake flag of each block up to the base
+    std::vector<std::pair<unsigned int, bool> > vChain;
+    {
+        LOCK(cs_main);
+        // Once flushed, the database is at the tip, and the cursor goes on
+        // seeing it like that however the chainstate changes later
+        FlushStateToDisk();
+        pcursor.reset(pcoinsTip->Cursor());
+        const CBlockIndex* pindexBase = chainActive.Tip();
+        if (pcursor->GetBestBlock() != pindexBase->GetBlockHash())
+            return error("%s: coin database is not at the tip", __func__);
+
+        header = CSnapshotHeader(Params().MessageStart(), pindexBase->GetBlockHash(), pindexBase->nHeight);
+        fileout << header;
+        hasher << header;
+        vChain.reserve(pindexBase->nHeight + 1);
+        for (int nHeight = 0; nHeight <= pindexBase->nHeight; nHeight++) {
+            vChain.push_back(std::make_pair(chainActive[nHeight]->nTime, chainActive[nHeight]->IsProofOfStake()));
+            CDiskBlockIndex index(chainActive[nHeight]);
+            StripBlockFiles(index);
+            fileout << index;
+            hasher << index;
+        }
+    }
+
+    nCoins = 0;
+    std::vector<std::pair<COutPoint, Coin> > vCoins;
+    vCoins.reserve(SNAPSHOT_COINS_CHUNK);
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        COutPoint key;
+        Coin coin;
+        if (!pcursor->GetKey(key) || !pcursor->GetValue(coin))
+            return error("%s: unable to read value", __func__);
+        if (coin.nHeight >= vChain.size())
+            return error("%s: coin %s above the base block", __func__, key.ToString());
+        // Coins upgraded from the per transaction format, or restored from
+        // older undo data, lack the block fields of their block. A node
+        // loading the snapshot has no blocks to find them in, so they are
+        // taken from the block index here.
+        if (!coin.HasBlockInfo()) {
+            coin.nBlockTime = vChain[coin.nHeight].first;
+            coin.fBlockProofOfStake = vChain[coin.nHeight].second;
+        }
+        vCoins.push_back(std::make_pair(key, std::move(coin)));
+        if (vCoins.size() == SNAPSHOT_COINS_CHUNK) {
+            fileout << vCoins;
+            hasher << vCoins;
+            nCoins += vCoins.size();
+            vCoins.clear();
+        }
+        pcursor->Next();
+    }
+    if (!vCoins.empty()) {
+        fileout << vCoins;
+        hasher << vCoins;
+        nCoins += vCoins.size();
+        vCoins.clear();
+    }
+    // An empty chunk ends the coins
+    fileout << vCoins;
+    hasher << vCoins;
+
+    fileout << nCoins;
+    hasher << nCoins;
+    hashSnapshot = hasher.GetHash();
+    fileout << hashSnapshot;
+
+    FileCommit(fileout.Get());
+    fileout.fclose();
+    if (!RenameOver(pathTmp, path))
+        return error("%s: failed to rename %s to %s", __func__, pathTmp.string(), path.string());
+    LogPrintf("Wrote UTXO snapshot of block %s at height %d with %u coins to %s\n", header.hashBase.ToString(), header.nHeight, nCoins, path.string());
+    return true;
+}
+
+bool LoadUTXOSnapshot(const CChainParams& chainparams, const boost::filesystem::path& path, CBlockTreeDB& blocktree, CCoinsViewDB& coinsdb)
+{
+    CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: failed to open %s", __func__, path.string());
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+
+    try {
+        CSnapshotHeader header;
+        filein >> header;
+        hasher << header;
+        if (memcmp(header.pchMessageStart, chainparams.MessageStart(), sizeof(header.pchMessageStart)) != 0)
+            return error("%s: snapshot is for a different network", __func__);
+        if (header.nVersion != UTXO_SNAPSHOT_VERSION)
+            return error("%s: unsupported snapshot version %d", __func__, header.nVersion);
+        LogPrintf("Loading UTXO snapshot of block %s at height %d from %s\n", header.hashBase.ToString(), header.nHeight, path.string());
+
+        // The databases are only usable once everything is written; the
+        // best block of the coin database is set last, then this is cleared
+        if (!blocktree.WriteFlag("snapshotloading", true))
+            return error("%s: failed to write to the block index database", __func__);
+
+        std::vector<CDiskBlockIndex> vIndex;
+        vIndex.reserve(SNAPSHOT_INDEX_BATCH);
+        std::vector<std::pair<unsigned int, bool> > vChain;
+        uint256 hashPrev;
+        for (int nHeight = 0; nHeight <= header.nHeight; nHeight++) {
+            CDiskBlockIndex index;
+            filein >> index;
+            hasher << index;
+            uint256 hash = index.GetBlockHash();
+            if (index.nHeight != nHeight || index.hashPrev != hashPrev ||
+                (nHeight == 0 && hash != chainparams.GetConsensus().hashGenesisBlock))
+                return error("%s: block index does not connect at height %d", __func__, nHeight);
+            StripBlockFiles(index);
+            vIndex.push_back(index);
+            vChain.push_back(std::make_pair(index.nTime, index.IsProofOfStake()));
+            hashPrev = hash;
+            if (vIndex.size() == SNAPSHOT_INDEX_BATCH || nHeight == header.nHeight) {
+                if (!blocktree.WriteBlockIndex(vIndex))
+                    return error("%s: failed to write to the block index database", __func__);
+                vIndex.clear();
+            }
+        }
+        if (hashPrev != header.hashBase)
+            return error("%s: block index does not end at the base block", __func__);
+
+        uint64_t nCoins = 0;
+        std::vector<std::pair<COutPoint, Coin> > vCoins;
+        do {
+            filein >> vCoins;
+            hasher << vCoins;
+            CCoinsMap mapCoins;
+            for (std::pair<COutPoint, Coin>& entry : vCoins) {
+                if (entry.second.IsSpent())
+                    return error("%s: spent coin %s in snapshot", __func__, entry.first.ToString());
+                // Without blocks, the kernel and coin age rules can only
+                // take the block fields of a coin from the coin itself
+                if (entry.second.nHeight >= vChain.size() || entry.second.nBlockTime != vChain[entry.second.nHeight].first ||
+                    (bool)entry.second.fBlockProofOfStake != vChain[entry.second.nHeight].second)
+                    return error("%s: coin %s does not match its block", __func__, entry.first.ToString());
+                CCoinsCacheEntry& cacheEntry = mapCoins[entry.first];
+                cacheEntry.coin = std::move(entry.second);
+                cacheEntry.flags = CCoinsCacheEntry::DIRTY;
+            }
+            nCoins += vCoins.size();
+            if (!coinsdb.BatchWrite(mapCoins, uint256()))
+                return error("%s: failed to write to the coin database", __func__);
+        } while (!vCoins.empty());
+
+        uint64_t nCoinsWritten;
+        filein >> nCoinsWritten;
+        hasher << nCoinsWritten;
+        uint256 hashSnapshot;
+        filein >> hashSnapshot;
+        if (nCoins != nCoinsWritten || hashSnapshot != hasher.GetHash())
+            return error("%s: checksum mismatch", __func__);
+
+        // Like after pruning, the blocks below the base are not on disk
+        CCoinsMap mapEmpty;
+        if (!coinsdb.BatchWrite(mapEmpty, header.hashBase) ||
+            !blocktree.WriteFlag("prunedblockfiles", true) ||
+            !blocktree.WriteFlag("snapshotloading", false))
+            return error("%s: failed to write to the databases", __func__);
+        LogPrintf("Loaded UTXO snapshot %s with %u coins\n", hashSnapshot.ToString(), nCoins);
+    } catch (const std::exception& e) {
+        return error("%s: deserialize or I/O error - %s", __func__, e.what());
+    }
+    return true;
+}
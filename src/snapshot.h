@@ -0,0 +1,77 @@
+// Copyright (c) 2018 The R3VCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SNAPSHOT_H
+#define BITCOIN_SNAPSHOT_H
+
+#include "protocol.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <string.h>
+
+#include <boost/filesystem/path.hpp>
+
+class CBlockTreeDB;
+class CChainParams;
+class CCoinsViewDB;
+
+/** Version of the UTXO snapshot file format */
+static const int UTXO_SNAPSHOT_VERSION = 1;
+
+/**
+ * Header of a UTXO snapshot file.
+ *
+ * It is followed by the block index of the chain from the genesis block up
+ * to the base block, with the stake modifiers, proof hashes and flags that
+ * later PoSV validation needs. Then come the coins of the chainstate at the
+ * base block, each with the time and proof-of-stake flag of its block, in
+ * chunks ended by an empty one, the number of coins, and the hash of all of
+ * the above.
+ */
+class CSnapshotHeader
+{
+public:
+    CMessageHeader::MessageStartChars pchMessageStart;
+    int nVersion;
+    uint256 hashBase;
+    int nHeight;
+
+    CSnapshotHeader() : nVersion(0), nHeight(-1)
+    {
+        memset(pchMessageStart, 0, sizeof(pchMessageStart));
+    }
+
+    CSnapshotHeader(const CMessageHeader::MessageStartChars& pchMessageStartIn, const uint256& hashBaseIn, int nHeightIn) :
+        nVersion(UTXO_SNAPSHOT_VERSION), hashBase(hashBaseIn), nHeight(nHeightIn)
+    {
+        memcpy(pchMessageStart, pchMessageStartIn, sizeof(pchMessageStart));
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(FLATDATA(pchMessageStart));
+        READWRITE(nVersion);
+        READWRITE(hashBase);
+        READWRITE(nHeight);
+    }
+};
+
+/**
+ * Write a snapshot of the chainstate at the tip to path. The block index is
+ * read under cs_main, the coins from a database snapshot taken after a full
+ * flush, so the chain can move on while they are written.
+ */
+bool DumpUTXOSnapshot(const boost::filesystem::path& path, CSnapshotHeader& header, uint64_t& nCoins, uint256& hashSnapshot);
+
+/**
+ * Load a snapshot into the block index and coin databases of a new node,
+ * before the block index is loaded. The node then starts at the base block,
+ * without any of the blocks below it, as if it had pruned them.
+ */
+bool LoadUTXOSnapshot(const CChainParams& chainparams, const boost::filesystem::path& path, CBlockTreeDB& blocktree, CCoinsViewDB& coinsdb);
+
+#endif // BITCOIN_SNAPSHOT_H
@@ -0,0 +1,205 @@
+// Copyright (c) 2018 The R3VCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+#define BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+
+#include <algorithm>
+#include <assert.h>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+/**
+ * Memory resource handing out blocks of up to MAX_BLOCK_SIZE_BYTES from
+ * large chunks, for node based containers that allocate many small objects
+ * of a few sizes.
+ *
+ * Block sizes are rounded up to a multiple of the alignment, and a freed
+ * block goes into a free list for its size, from which the next allocation
+ * of that size is served. Chunks are only given back when the resource is
+ * destroyed, which releases everything allocated from it at once. Larger or
+ * more aligned requests fall through to operator new.
+ *
+ * Not thread safe; a resource is used by one container at a time.
+ */
+template <std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+class PoolResource
+{
+private:
+    //! A free block, linked into the free list of its size
+    struct ListNode {
+        ListNode* next;
+    };
+
+    //! Blocks are aligned to this, and have a size that is a multiple of it
+    static constexpr std::size_t ELEM_ALIGN_BYTES = ALIGN_BYTES > alignof(ListNode) ? ALIGN_BYTES : alignof(ListNode);
+    static_assert((ELEM_ALIGN_BYTES & (ELEM_ALIGN_BYTES - 1)) == 0, "ELEM_ALIGN_BYTES must be a power of two");
+    static_assert(sizeof(ListNode) <= ELEM_ALIGN_BYTES, "Units of ELEM_ALIGN_BYTES must hold a ListNode");
+    static_assert(ALIGN_BYTES <= alignof(std::max_align_t), "Chunks from operator new are not aligned enough");
+    static_assert(MAX_BLOCK_SIZE_BYTES >= ELEM_ALIGN_BYTES, "MAX_BLOCK_SIZE_BYTES below the alignment");
+
+    static constexpr std::size_t NUM_FREE_LISTS = MAX_BLOCK_SIZE_BYTES / ELEM_ALIGN_BYTES + 1;
+
+    const std::size_t nChunkSizeBytes;
+    std::vector<char*> vChunks;
+    //! Free lists, indexed by block size in units of ELEM_ALIGN_BYTES
+    ListNode* vFreeLists[NUM_FREE_LISTS];
+    //! Part of the newest chunk that was never handed out
+    char* pAvailableBegin;
+    char* pAvailableEnd;
+
+    static std::size_t NumElemAlignBytes(std::size_t bytes)
+    {
+        return (bytes + ELEM_ALIGN_BYTES - 1) / ELEM_ALIGN_BYTES + (bytes == 0);
+    }
+
+    static bool IsFreeListUsable(std::size_t bytes, std::size_t alignment)
+    {
+        return alignment <= ELEM_ALIGN_BYTES && bytes <= MAX_BLOCK_SIZE_BYTES;
+    }
+
+    void PlaceIntoFreeList(void* p, std::size_t nFreeList)
+    {
+        ListNode* node = new (p) ListNode;
+        node->next = vFreeLists[nFreeList];
+        vFreeLists[nFreeList] = node;
+    }
+
+    void AllocateChunk()
+    {
+        // The rest of the current chunk is a multiple of ELEM_ALIGN_BYTES
+        // and smaller than the block that did not fit, so it can still be
+        // used for smaller blocks
+        const std::size_t nRemaining = pAvailableEnd - pAvailableBegin;
+        if (nRemaining)
+            PlaceIntoFreeList(pAvailableBegin, nRemaining / ELEM_ALIGN_BYTES);
+
+        char* pChunk = static_cast<char*>(::operator new(nChunkSizeBytes));
+        vChunks.push_back(pChunk);
+        pAvailableBegin = pChunk;
+        pAvailableEnd = pChunk + nChunkSizeBytes;
+    }
+
+public:
+    //! Chunk size rounded up to a multiple of the alignment
+    explicit PoolResource(std::size_t nChunkSizeBytesIn = 262144) :
+        nChunkSizeBytes(NumElemAlignBytes(std::max(nChunkSizeBytesIn, MAX_BLOCK_SIZE_BYTES)) * ELEM_ALIGN_BYTES),
+        pAvailableBegin(NULL), pAvailableEnd(NULL)
+    {
+        std::fill(vFreeLists, vFreeLists + NUM_FREE_LISTS, (ListNode*)NULL);
+    }
+
+    ~PoolResource()
+    {
+        for (char* pChunk : vChunks)
+            ::operator delete(pChunk);
+    }
+
+    PoolResource(const PoolResource&) = delete;
+    PoolResource& operator=(const PoolResource&) = delete;
+
+    void* Allocate(std::size_t bytes, std::size_t alignment)
+    {
+        if (!IsFreeListUsable(bytes, alignment))
+            return ::operator new(bytes);
+
+        const std::size_t nFreeList = NumElemAlignBytes(bytes);
+        if (vFreeLists[nFreeList]) {
+            ListNode* node = vFreeLists[nFreeList];
+            vFreeLists[nFreeList] = node->next;
+            node->~ListNode();
+            return node;
+        }
+
+        const std::size_t nRoundBytes = nFreeList * ELEM_ALIGN_BYTES;
+        if ((std::size_t)(pAvailableEnd - pAvailableBegin) < nRoundBytes)
+            AllocateChunk();
+        void* p = pAvailableBegin;
+        pAvailableBegin += nRoundBytes;
+        return p;
+    }
+
+    void Deallocate(void* p, std::size_t bytes, std::size_t alignment) noexcept
+    {
+        if (!IsFreeListUsable(bytes, alignment)) {
+            ::operator delete(p);
+            return;
+        }
+        PlaceIntoFreeList(p, NumElemAlignBytes(bytes));
+    }
+
+    std::size_t ChunkSizeBytes() const { return nChunkSizeBytes; }
+    std::size_t NumAllocatedChunks() const { return vChunks.size(); }
+};
+
+/**
+ * Allocator backed by a PoolResource, for node based containers like
+ * boost::unordered_map. A default constructed allocator creates a resource
+ * of its own, which is shared with its copies and with the allocators they
+ * are rebound to, and lives as long as any of them. The allocator travels
+ * with the nodes when containers are swapped or moved, so the whole pool
+ * goes away with the last container using it.
+ */
+template <class T, std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES = alignof(T)>
+class PoolAllocator
+{
+public:
+    typedef PoolResource<MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> ResourceType;
+
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    template <typename U>
+    struct rebind {
+        typedef PoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> other;
+    };
+
+    PoolAllocator() : resource(std::make_shared<ResourceType>()) {}
+
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& other) noexcept : resource(other.resource) {}
+
+    T* allocate(std::size_t n)
+    {
+        return static_cast<T*>(resource->Allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept
+    {
+        resource->Deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    //! A copied container gets a pool of its own
+    PoolAllocator select_on_container_copy_construction() const
+    {
+        return PoolAllocator();
+    }
+
+    const ResourceType* Resource() const { return resource.get(); }
+
+private:
+    std::shared_ptr<ResourceType> resource;
+
+    template <class U, std::size_t M, std::size_t A>
+    friend class PoolAllocator;
+};
+
+template <class T, class U, std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+bool operator==(const PoolAllocator<T, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& a, const PoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& b) noexcept
+{
+    return a.Resource() == b.Resource();
+}
+
+template <class T, class U, std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+bool operator!=(const PoolAllocator<T, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& a, const PoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& b) noexcept
+{
+    return !(a == b);
+}
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_POOL_H
@@ -4,10 +4,12 @@
 
 #include "util.h"
 
+#include "support/allocators/pool.h"
 #include "support/allocators/secure.h"
 #include "test/test_bitcoin.h"
 
 #include <boost/test/unit_test.hpp>
+#include <boost/unordered_map.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(allocator_tests, BasicTestingSetup)
 
@@ -231,4 +233,66 @@ BOOST_AUTO_TEST_CASE(lockedpool_tests_live)
     BOOST_CHECK(pool.stats().used == initial.used);
 }
 
+BOOST_AUTO_TEST_CASE(poolresource_tests)
+{
+    PoolResource<64, 8> resource(1024);
+    BOOST_CHECK_EQUAL(resource.ChunkSizeBytes(), 1024U);
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 0U);
+
+    // Blocks are carved from one chunk, rounded up to the alignment
+    void *a = resource.Allocate(12, 8);
+    void *b = resource.Allocate(16, 8);
+    BOOST_CHECK_EQUAL((char*)b - (char*)a, 16);
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 1U);
+
+    // A freed block is reused for the next allocation of its size only
+    resource.Deallocate(a, 12, 8);
+    void *c = resource.Allocate(24, 8);
+    BOOST_CHECK(c != a);
+    void *d = resource.Allocate(16, 8);
+    BOOST_CHECK(d == a);
+
+    // Larger or more aligned blocks do not come from the pool
+    void *e = resource.Allocate(65, 8);
+    void *f = resource.Allocate(8, 16);
+    resource.Deallocate(e, 65, 8);
+    resource.Deallocate(f, 8, 16);
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 1U);
+
+    // A new chunk is taken when the current one runs out, and the rest of
+    // the old one serves smaller blocks
+    std::vector<void*> vBlocks;
+    for (int i = 0; i < 16; i++)
+        vBlocks.push_back(resource.Allocate(64, 8));
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 2U);
+    void *g = resource.Allocate(8, 8);
+    BOOST_CHECK((char*)g > (char*)a && (char*)g < (char*)a + 1024);
+    for (void* p : vBlocks)
+        resource.Deallocate(p, 64, 8);
+}
+
+BOOST_AUTO_TEST_CASE(poolallocator_tests)
+{
+    typedef std::pair<const int, int> Value;
+    typedef boost::unordered_map<int, int, boost::hash<int>, std::equal_to<int>, PoolAllocator<Value, sizeof(Value) + sizeof(void*) * 4> > Map;
+
+    Map map1, map2;
+    BOOST_CHECK(map1.get_allocator() != map2.get_allocator());
+    for (int i = 0; i < 1000; i++)
+        map1[i] = i;
+    BOOST_CHECK(map1.get_allocator().Resource()->NumAllocatedChunks() > 0);
+
+    // The pool goes along with the nodes on a swap
+    const Map::allocator_type::ResourceType* resource = map1.get_allocator().Resource();
+    map1.swap(map2);
+    BOOST_CHECK(map2.get_allocator().Resource() == resource);
+    BOOST_CHECK_EQUAL(map2.size(), 1000U);
+    BOOST_CHECK_EQUAL(map2[999], 999);
+
+    // A copy gets a pool of its own
+    Map map3(map2);
+    BOOST_CHECK(map3.get_allocator() != map2.get_allocator());
+    BOOST_CHECK(map3 == map2);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -366,6 +366,16 @@ BOOST_AUTO_TEST_CASE( divide )
     BOOST_CHECK(R2L / MaxL == ZeroL);
     BOOST_CHECK(MaxL / R2L == 1);
     BOOST_CHECK_THROW(R2L / ZeroL, uint_error);
+
+    BOOST_CHECK(R1L / 1 == R1L);
+    BOOST_CHECK(R1L / 0xECD75171UL == R1L / arith_uint256(0xECD75171UL));
+    BOOST_CHECK(R2L / 0xECD75171UL == R2L / arith_uint256(0xECD75171UL));
+    BOOST_CHECK(MaxL / 0xffffffffUL == MaxL / arith_uint256(0xffffffffUL));
+    for (uint32_t n = 1; n < 20000; n += 7) {
+        BOOST_CHECK(R1L / n == R1L / arith_uint256(n));
+        BOOST_CHECK(R2L / n == R2L / arith_uint256(n));
+    }
+    BOOST_CHECK_THROW(R1L / 0, uint_error);
 }
 
 
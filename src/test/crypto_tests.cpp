@@ -9,6 +9,7 @@
 #include "crypto/sha512.h"
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
+#include "hash.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 #include "test/test_random.h"
@@ -255,6 +256,25 @@ BOOST_AUTO_TEST_CASE(sha256_testvectors) {
     TestSHA256(test1, "a316d55510b49662420f49d145d42fb83f31ef8dc016aa4e32df049991a91e26");
 }
 
+BOOST_AUTO_TEST_CASE(sha256d_short_batch) {
+    // Every length a single padded block holds, in batches that do and do
+    // not fill the last group of lanes
+    for (size_t len = 0; len <= 55; len++) {
+        for (size_t count : {0, 1, 7, 8, 9, 23}) {
+            std::vector<unsigned char> in(len * count + 1);
+            for (size_t i = 0; i < in.size(); i++)
+                in[i] = insecure_rand();
+            std::vector<unsigned char> out(32 * count + 1);
+            SHA256DShort(out.data(), in.data(), len, count);
+            for (size_t i = 0; i < count; i++) {
+                unsigned char expected[CHash256::OUTPUT_SIZE];
+                CHash256().Write(in.data() + i * len, len).Finalize(expected);
+                BOOST_CHECK(memcmp(out.data() + i * 32, expected, 32) == 0);
+            }
+        }
+    }
+}
+
 BOOST_AUTO_TEST_CASE(sha512_testvectors) {
     TestSHA512("",
                "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
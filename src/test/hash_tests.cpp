@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "crypto/common.h"
 #include "hash.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
@@ -128,6 +129,18 @@ BOOST_AUTO_TEST_CASE(siphash)
     tx.nVersion = 1;
     ss << tx;
     BOOST_CHECK_EQUAL(SipHashUint256(1, 2, ss.GetHash()), 0x79751e980c2a0a35ULL);
+
+    // Check SipHashUint256Extra against the general hasher with the extra
+    // 32 bits appended to the 256 bit value
+    for (uint32_t n = 0; n < 4; n++) {
+        uint256 hash = ss.GetHash();
+        CSipHasher hasher4(1, 2);
+        hasher4.Write(hash.begin(), 32);
+        unsigned char extra[4];
+        WriteLE32(extra, n);
+        hasher4.Write(extra, 4);
+        BOOST_CHECK_EQUAL(SipHashUint256Extra(1, 2, hash, n), hasher4.Finalize());
+    }
 }
 
 BOOST_AUTO_TEST_SUITE_END()
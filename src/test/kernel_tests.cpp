@@ -0,0 +1,397 @@
+// Copyright (c) 2018 The R3VCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "consensus/merkle.h"
+#include "consensus/validation.h"
+#include "hash.h"
+#include "kernel.h"
+#include "keystore.h"
+#include "pow.h"
+#include "random.h"
+#include "script/sign.h"
+#include "validation.h"
+#include "versionbits.h"
+#include "test/test_bitcoin.h"
+#include "test/test_random.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+// The stake modifier selection as done before candidates were kept as block
+// index pointers: sorted (time, hash) pairs, looked up and rehashed each round
+static uint64_t ReferenceStakeModifier(const CBlockIndex* pindexPrev, uint64_t nStakeModifierPrev)
+{
+    int64_t nSelectionIntervalStart = (pindexPrev->GetBlockTime() / nModifierInterval) * nModifierInterval - GetStakeModifierSelectionInterval();
+    std::vector<std::pair<int64_t, uint256> > vSortedByTimestamp;
+    std::map<uint256, const CBlockIndex*> mapIndex;
+    for (const CBlockIndex* pindex = pindexPrev; pindex && pindex->GetBlockTime() >= nSelectionIntervalStart; pindex = pindex->pprev) {
+        vSortedByTimestamp.push_back(std::make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
+        mapIndex[pindex->GetBlockHash()] = pindex;
+    }
+    std::sort(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
+
+    uint64_t nStakeModifier = 0;
+    int64_t nSelectionIntervalStop = nSelectionIntervalStart;
+    std::set<uint256> setSelected;
+    for (int nRound = 0; nRound < std::min(64, (int)vSortedByTimestamp.size()); nRound++) {
+        nSelectionIntervalStop += nModifierInterval * 63 / (63 + ((63 - nRound) * (MODIFIER_INTERVAL_RATIO - 1)));
+        const CBlockIndex* pindexBest = NULL;
+        arith_uint256 hashBest;
+        for (const std::pair<int64_t, uint256>& item : vSortedByTimestamp) {
+            const CBlockIndex* pindex = mapIndex[item.second];
+            if (pindexBest && pindex->GetBlockTime() > nSelectionIntervalStop)
+                break;
+            if (setSelected.count(item.second))
+                continue;
+            CDataStream ss(SER_GETHASH, 0);
+            ss << pindex->hashProof << nStakeModifierPrev;
+            arith_uint256 hashSelection = UintToArith256(Hash(ss.begin(), ss.end()));
+            if (pindex->IsProofOfStake())
+                hashSelection >>= 32;
+            if (!pindexBest || hashSelection < hashBest) {
+                pindexBest = pindex;
+                hashBest = hashSelection;
+            }
+        }
+        nStakeModifier |= ((uint64_t)pindexBest->GetStakeEntropyBit()) << nRound;
+        setSelected.insert(pindexBest->GetBlockHash());
+    }
+    return nStakeModifier;
+}
+
+// A proof-of-stake block on the tip, staking the first output of txPrev
+static std::shared_ptr<CBlock> CreateStakeBlock(const CTransaction& txPrev, const CKey& key)
+{
+    CBasicKeyStore keystore;
+    keystore.AddKey(key);
+    const CBlockIndex* pindexPrev = chainActive.Tip();
+
+    CMutableTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vin[0].scriptSig = CScript() << (pindexPrev->nHeight + 1) << OP_0;
+    txCoinBase.vout.resize(1);
+    txCoinBase.vout[0].SetEmpty();
+
+    CMutableTransaction txCoinStake;
+    txCoinStake.nTime = pindexPrev->GetBlockTime() + 1;
+    txCoinStake.vin.resize(1);
+    txCoinStake.vin[0].prevout = COutPoint(txPrev.GetHash(), 0);
+    txCoinStake.vout.resize(2);
+    txCoinStake.vout[0].SetEmpty();
+    txCoinStake.vout[1] = txPrev.vout[0];
+    BOOST_CHECK(SignSignature(keystore, txPrev, txCoinStake, 0, SIGHASH_ALL));
+
+    std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+    pblock->nVersion = VERSIONBITS_TOP_BITS;
+    pblock->hashPrevBlock = pindexPrev->GetBlockHash();
+    pblock->nTime = txCoinStake.nTime;
+    pblock->nBits = GetNextWorkRequired(pindexPrev, Params().GetConsensus());
+    pblock->vtx.push_back(MakeTransactionRef(txCoinBase));
+    pblock->vtx.push_back(MakeTransactionRef(txCoinStake));
+    pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
+    BOOST_CHECK(key.Sign(pblock->GetHash(), pblock->vchBlockSig));
+    return pblock;
+}
+
+BOOST_FIXTURE_TEST_SUITE(kernel_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(stake_kernel_context)
+{
+    LOCK(cs_main);
+
+    // A chain of one minute blocks, each generating its own modifier
+    TestBlockIndexChain chain(1000, 1500000000);
+    std::vector<CBlockIndex>& vIndex = chain.vIndex;
+
+    const CBlockIndex* pindexFrom = &vIndex[10];
+
+    CMutableTransaction txPrev;
+    txPrev.nTime = pindexFrom->nTime - 30;
+    txPrev.vout.resize(2);
+    txPrev.vout[1].nValue = 1000 * COIN;
+    CTransactionRef ptxPrev = MakeTransactionRef(txPrev);
+    COutPoint prevout(ptxPrev->GetHash(), 1);
+    unsigned int nTimeTx = pindexFrom->nTime + Params().StakeMinAge() + 24 * 60 * 60;
+    unsigned int nBits = 0x1d00ffff;
+
+    // The context resolves to a later block and remembers it
+    CStakeKernelContext kernel(pindexFrom, prevout.n, txPrev.nTime, txPrev.vout[1].nValue);
+    BOOST_CHECK(kernel.pindexModifier == NULL);
+    BOOST_CHECK(ResolveKernelStakeModifier(kernel));
+    BOOST_CHECK(kernel.pindexModifier != NULL);
+    BOOST_CHECK(kernel.pindexModifier->nHeight > pindexFrom->nHeight);
+    BOOST_CHECK_EQUAL(kernel.nStakeModifier, kernel.pindexModifier->nStakeModifier);
+    const CBlockIndex* pindexModifier = kernel.pindexModifier;
+
+    // Hashing from the context matches hashing from the header and transaction
+    uint256 hashProofHeader, targetHeader, hashProofContext, targetContext;
+    bool fHeader = CheckStakeKernelHash(nBits, vIndex[10].GetBlockHeader(), prevout.n, ptxPrev, prevout, nTimeTx, hashProofHeader, targetHeader);
+    bool fContext = CheckStakeKernelHash(nBits, kernel, prevout, nTimeTx, hashProofContext, targetContext);
+    BOOST_CHECK_EQUAL(fHeader, fContext);
+    BOOST_CHECK(!hashProofContext.IsNull());
+    BOOST_CHECK(hashProofHeader == hashProofContext);
+    BOOST_CHECK(targetHeader == targetContext);
+
+    // A missing transaction timestamp falls back to the block timestamp
+    CStakeKernelContext kernelNoTime(pindexFrom, prevout.n, 0, txPrev.vout[1].nValue);
+    BOOST_CHECK_EQUAL(kernelNoTime.nTimeTxPrev, pindexFrom->nTime);
+
+    // Dropping the modifier block from the active chain invalidates it
+    chainActive.SetTip(pindexModifier->pprev);
+    BOOST_CHECK(!ResolveKernelStakeModifier(kernel));
+    BOOST_CHECK(kernel.pindexModifier == NULL);
+    BOOST_CHECK(!CheckStakeKernelHash(nBits, kernel, prevout, nTimeTx, hashProofContext, targetContext));
+
+    // and reconnecting it resolves to the same block again
+    chainActive.SetTip(&vIndex.back());
+    BOOST_CHECK(ResolveKernelStakeModifier(kernel));
+    BOOST_CHECK(kernel.pindexModifier == pindexModifier);
+}
+
+BOOST_AUTO_TEST_CASE(stake_kernel_batch)
+{
+    LOCK(cs_main);
+
+    TestBlockIndexChain chain(1000, 1500000000);
+    std::vector<CBlockIndex>& vIndex = chain.vIndex;
+    for (CBlockIndex& index : vIndex)
+        index.nStakeModifier = ((uint64_t)insecure_rand() << 32) | insecure_rand();
+
+    // Candidates from early blocks with a loose target, so that some of them
+    // hit; a few are left unresolved or too young to stake
+    unsigned int nTimeTx = vIndex[100].nTime + Params().StakeMinAge() + 24 * 60 * 60;
+    unsigned int nBits = 0x1f01ffff;
+    std::vector<std::pair<COutPoint, CStakeKernelContext> > vCandidates;
+    for (int i = 0; i < 200; i++) {
+        const CBlockIndex* pindexFrom = &vIndex[insecure_rand() % 100];
+        COutPoint prevout(GetRandHash(), insecure_rand() % 4);
+        CStakeKernelContext kernel(pindexFrom, prevout.n, pindexFrom->nTime - insecure_rand() % 600, (1 + insecure_rand() % 1000) * COIN);
+        if (insecure_rand() % 10)
+            ResolveKernelStakeModifier(kernel);
+        if (insecure_rand() % 20 == 0)
+            kernel.nTimeBlockFrom = nTimeTx;
+        vCandidates.push_back(std::make_pair(prevout, kernel));
+    }
+
+    // Every slice finds the same first kernel as checking one at a time
+    for (size_t nBegin = 0; nBegin < vCandidates.size(); nBegin += 13) {
+        for (size_t nEnd = nBegin; nEnd <= vCandidates.size(); nEnd += 29) {
+            int nExpected = -1;
+            for (size_t i = nBegin; i < nEnd && nExpected < 0; i++) {
+                const CStakeKernelContext& kernel = vCandidates[i].second;
+                uint256 hashProofOfStake, targetProofOfStake;
+                if (kernel.pindexModifier && CheckStakeKernelHash(nBits, kernel, vCandidates[i].first, nTimeTx, hashProofOfStake, targetProofOfStake))
+                    nExpected = i;
+            }
+            BOOST_CHECK_EQUAL(CheckStakeKernelHashes(nBits, vCandidates, nBegin, nEnd, nTimeTx), nExpected);
+        }
+    }
+
+    // A window search over several slices finds the earliest timestamp with
+    // a kernel, and the first kernel at it, for loose and tight targets
+    const unsigned int vBits[] = {nBits, 0x1f000fff, 0x1e00ffff};
+    for (unsigned int nBitsWindow : vBits) {
+        const unsigned int nTimeEnd = nTimeTx + 30;
+        int nExpected = -1;
+        unsigned int nTimeExpected = 0;
+        for (unsigned int nTime = nTimeTx; nTime <= nTimeEnd && nExpected < 0; nTime++) {
+            for (size_t i = 0; i < vCandidates.size() && nExpected < 0; i++) {
+                const CStakeKernelContext& kernel = vCandidates[i].second;
+                uint256 hashProofOfStake, targetProofOfStake;
+                if (kernel.pindexModifier && CheckStakeKernelHash(nBitsWindow, kernel, vCandidates[i].first, nTime, hashProofOfStake, targetProofOfStake)) {
+                    nExpected = i;
+                    nTimeExpected = nTime;
+                }
+            }
+        }
+        unsigned int nTimeFound = 0;
+        BOOST_CHECK_EQUAL(SearchStakeKernels(vCandidates, nBitsWindow, nTimeTx, nTimeEnd, nTimeFound), nExpected);
+        if (nExpected >= 0)
+            BOOST_CHECK_EQUAL(nTimeFound, nTimeExpected);
+
+        // a cancelled search finds nothing
+        std::atomic<bool> fCancel(true);
+        BOOST_CHECK_EQUAL(SearchStakeKernels(vCandidates, nBitsWindow, nTimeTx, nTimeEnd, nTimeFound, &fCancel), -1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(kernel_stake_modifier_lookup)
+{
+    LOCK(cs_main);
+
+    // Block times jitter around a one minute spacing and are occasionally
+    // far in the future, so the running maximum does not always track them
+    const int nChainLength = 3000;
+    std::vector<int64_t> vTime(nChainLength);
+    for (int i = 0; i < nChainLength; i++) {
+        vTime[i] = 1500000000 + i * 60 + insecure_rand() % 3600;
+        if (insecure_rand() % 200 == 0)
+            vTime[i] += 2 * GetStakeModifierSelectionInterval();
+    }
+    TestBlockIndexChain chain(vTime);
+    std::vector<CBlockIndex>& vIndex = chain.vIndex;
+
+    for (int nFrom = 0; nFrom < nChainLength; nFrom++) {
+        // Reference: the first later block at least a selection interval newer
+        int64_t nTarget = vIndex[nFrom].GetBlockTime() + GetStakeModifierSelectionInterval();
+        const CBlockIndex* pindexExpected = NULL;
+        for (int h = nFrom + 1; h < nChainLength && !pindexExpected; h++) {
+            if (vIndex[h].GetBlockTime() >= nTarget)
+                pindexExpected = &vIndex[h];
+        }
+
+        CStakeKernelContext kernel(&vIndex[nFrom], 0, 0, COIN);
+        BOOST_CHECK_EQUAL(ResolveKernelStakeModifier(kernel), pindexExpected != NULL);
+        BOOST_CHECK(kernel.pindexModifier == pindexExpected);
+        if (pindexExpected)
+            BOOST_CHECK_EQUAL(kernel.nStakeModifier, pindexExpected->nStakeModifier);
+    }
+
+    // Blocks off the active chain never resolve
+    CBlockIndex indexFork;
+    indexFork.nHeight = 1;
+    indexFork.nTime = vIndex[1].nTime;
+    indexFork.nTimeMax = indexFork.nTime;
+    indexFork.pprev = &vIndex[0];
+    CStakeKernelContext kernelFork(&indexFork, 0, 0, COIN);
+    BOOST_CHECK(!ResolveKernelStakeModifier(kernelFork));
+}
+
+BOOST_AUTO_TEST_CASE(stake_modifier_selection)
+{
+    // Block times jitter, repeat and sometimes go backwards, so candidates
+    // are ordered by hash within a timestamp and out of height order
+    const int nChainLength = 2000;
+    std::vector<uint256> vHash(nChainLength);
+    std::vector<CBlockIndex> vIndex(nChainLength);
+    int nGenerated = 0;
+    for (int i = 0; i < nChainLength; i++) {
+        CBlockIndex& index = vIndex[i];
+        vHash[i] = ArithToUint256(arith_uint256(((uint64_t)insecure_rand() << 32) | insecure_rand()) << 64);
+        index.phashBlock = &vHash[i];
+        index.pprev = i ? &vIndex[i - 1] : NULL;
+        index.nHeight = i;
+        index.nTime = 1500000000 + i * 60;
+        if (i && insecure_rand() % 4 == 0)
+            index.nTime = vIndex[i - 1].nTime;
+        else if (i && insecure_rand() % 8 == 0)
+            index.nTime = vIndex[i - 1].nTime - insecure_rand() % 600;
+        if (insecure_rand() % 2)
+            index.SetProofOfStake();
+        index.SetStakeEntropyBit(insecure_rand() & 1);
+        index.hashProof = ArithToUint256(arith_uint256(((uint64_t)insecure_rand() << 32) | insecure_rand()) << 192);
+
+        uint64_t nStakeModifier;
+        bool fGeneratedStakeModifier;
+        BOOST_CHECK(ComputeNextStakeModifier(index.pprev, nStakeModifier, fGeneratedStakeModifier));
+        if (index.pprev && fGeneratedStakeModifier) {
+            BOOST_CHECK_EQUAL(nStakeModifier, ReferenceStakeModifier(index.pprev, index.pprev->nStakeModifier));
+            nGenerated++;
+        }
+        index.SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
+    }
+    BOOST_CHECK(nGenerated > 100);
+}
+
+BOOST_AUTO_TEST_CASE(stake_seen_set)
+{
+    // Stakes reusing prevouts and times of each other, enough to grow the
+    // table several times
+    std::vector<std::pair<COutPoint, unsigned int> > vStakes;
+    for (int i = 0; i < 5000; i++) {
+        COutPoint prevout(i % 3 == 1 ? vStakes.back().first.hash : GetRandHash(), insecure_rand() % 4);
+        vStakes.push_back(std::make_pair(prevout, 1500000000 + insecure_rand() % 100000));
+    }
+
+    CStakeSeenSet setSeen;
+    std::set<std::pair<COutPoint, unsigned int> > setExpected;
+    for (size_t i = 0; i < vStakes.size(); i++) {
+        if (i % 2)
+            continue;
+        setSeen.insert(vStakes[i]);
+        setExpected.insert(vStakes[i]);
+        setSeen.insert(vStakes[i]);
+    }
+    BOOST_CHECK_EQUAL(setSeen.size(), setExpected.size());
+    for (const std::pair<COutPoint, unsigned int>& stake : vStakes) {
+        BOOST_CHECK_EQUAL(setSeen.count(stake), setExpected.count(stake));
+        BOOST_CHECK(!setSeen.count(std::make_pair(stake.first, stake.second + 100000)));
+    }
+
+    // Erasing old stakes keeps the newer ones findable
+    const unsigned int nHorizon = 1500000000 + 50000;
+    setSeen.EraseUpTo(nHorizon);
+    for (std::set<std::pair<COutPoint, unsigned int> >::iterator it = setExpected.begin(); it != setExpected.end(); ) {
+        if (it->second <= nHorizon)
+            it = setExpected.erase(it);
+        else
+            ++it;
+    }
+    BOOST_CHECK_EQUAL(setSeen.size(), setExpected.size());
+    for (const std::pair<COutPoint, unsigned int>& stake : vStakes)
+        BOOST_CHECK_EQUAL(setSeen.count(stake), setExpected.count(stake));
+
+    setSeen.clear();
+    BOOST_CHECK_EQUAL(setSeen.size(), 0);
+    BOOST_CHECK(!setSeen.count(vStakes[0]));
+}
+
+BOOST_FIXTURE_TEST_CASE(stake_signature_batch, TestChain100Setup)
+{
+    // The header of the first block is indexed ahead of it, as in headers
+    // first download; the second block is unknown
+    std::shared_ptr<CBlock> pblockHeader = CreateStakeBlock(coinbaseTxns[0], coinbaseKey);
+    std::shared_ptr<CBlock> pblockNew = CreateStakeBlock(coinbaseTxns[1], coinbaseKey);
+    CValidationState state;
+    BOOST_CHECK(ProcessNewBlockHeaders(std::vector<CBlockHeader>(1, pblockHeader->GetBlockHeader()), state, Params()));
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(pblockHeader->GetHash());
+        BOOST_CHECK(mi != mapBlockIndex.end());
+        BOOST_CHECK(!(mi->second->nStatus & BLOCK_HAVE_DATA));
+    }
+
+    std::vector<std::shared_ptr<const CBlock> > vpblock;
+    vpblock.push_back(pblockHeader);
+    vpblock.push_back(pblockNew);
+    std::vector<bool> vStakeChecked;
+    CheckStakeSignatures(vpblock, vStakeChecked);
+    BOOST_CHECK(vStakeChecked[0]);
+    BOOST_CHECK(vStakeChecked[1]);
+
+    // A coinstake signature that does not match fails the whole run
+    std::shared_ptr<CBlock> pblockBad = std::make_shared<CBlock>(*pblockNew);
+    CMutableTransaction txCoinStake(*pblockBad->vtx[1]);
+    txCoinStake.vout[1].nValue -= 1;
+    pblockBad->vtx[1] = MakeTransactionRef(txCoinStake);
+    pblockBad->hashMerkleRoot = BlockMerkleRoot(*pblockBad);
+    BOOST_CHECK(coinbaseKey.Sign(pblockBad->GetHash(), pblockBad->vchBlockSig));
+    vpblock[1] = pblockBad;
+    CheckStakeSignatures(vpblock, vStakeChecked);
+    BOOST_CHECK(!vStakeChecked[0]);
+    BOOST_CHECK(!vStakeChecked[1]);
+
+    // and so does a block signed by another key
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+    pblockBad = std::make_shared<CBlock>(*pblockNew);
+    BOOST_CHECK(keyOther.Sign(pblockBad->GetHash(), pblockBad->vchBlockSig));
+    vpblock[1] = pblockBad;
+    CheckStakeSignatures(vpblock, vStakeChecked);
+    BOOST_CHECK(!vStakeChecked[0]);
+    BOOST_CHECK(!vStakeChecked[1]);
+
+    // Proof-of-work blocks have no stake signatures to check
+    vpblock.assign(1, std::make_shared<const CBlock>(CreateAndProcessBlock(std::vector<CMutableTransaction>(), CScript() << OP_TRUE)));
+    CheckStakeSignatures(vpblock, vStakeChecked);
+    BOOST_CHECK(!vStakeChecked[0]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
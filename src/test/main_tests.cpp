@@ -3,8 +3,10 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "chainparams.h"
+#include "key.h"
 #include "validation.h"
 #include "net.h"
+#include "script/standard.h"
 
 #include "test/test_bitcoin.h"
 
@@ -73,4 +75,52 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     Test.disconnect(&ReturnTrue);
     BOOST_CHECK(Test());
 }
+
+BOOST_AUTO_TEST_CASE(block_signature_test)
+{
+    CKey key;
+    key.MakeNewKey(true);
+
+    CMutableTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vout.resize(1);
+    txCoinBase.vout[0].SetEmpty();
+
+    CMutableTransaction txCoinStake;
+    txCoinStake.vin.resize(1);
+    txCoinStake.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txCoinStake.vout.resize(2);
+    txCoinStake.vout[0].SetEmpty();
+    txCoinStake.vout[1] = CTxOut(100 * COIN, CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG);
+
+    CBlock block;
+    block.vtx.push_back(MakeTransactionRef(txCoinBase));
+    block.vtx.push_back(MakeTransactionRef(txCoinStake));
+    BOOST_CHECK(block.IsProofOfStake());
+    BOOST_CHECK(!CheckBlockSignature(block));
+
+    BOOST_CHECK(key.Sign(block.GetHash(), block.vchBlockSig));
+    BOOST_CHECK(CheckBlockSignature(block));
+    // a second check is answered from the signature cache
+    BOOST_CHECK(CheckBlockSignature(block));
+
+    // the cached signature does not carry over to another block or key
+    CBlock blockOther = block;
+    blockOther.nNonce++;
+    BOOST_CHECK(!CheckBlockSignature(blockOther));
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+    CMutableTransaction txCoinStakeOther(*block.vtx[1]);
+    txCoinStakeOther.vout[1].scriptPubKey = CScript() << ToByteVector(keyOther.GetPubKey()) << OP_CHECKSIG;
+    blockOther = block;
+    blockOther.vtx[1] = MakeTransactionRef(txCoinStakeOther);
+    BOOST_CHECK(!CheckBlockSignature(blockOther));
+
+    // a proof-of-work block carries no signature
+    block.vtx.pop_back();
+    BOOST_CHECK(!CheckBlockSignature(block));
+    block.vchBlockSig.clear();
+    BOOST_CHECK(CheckBlockSignature(block));
+}
 BOOST_AUTO_TEST_SUITE_END()
@@ -19,10 +19,13 @@
 
 #include "test/test_bitcoin.h"
 
+#include <limits>
 #include <memory>
 
 #include <boost/test/unit_test.hpp>
 
+#include <univalue.h>
+
 BOOST_FIXTURE_TEST_SUITE(miner_tests, TestingSetup)
 
 static CFeeRate blockMinFeeRate = CFeeRate(DEFAULT_BLOCK_MIN_TX_FEE);
@@ -493,4 +496,28 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+BOOST_AUTO_TEST_CASE(staker_timer)
+{
+    CStakerTimer timer;
+    timer.Add(0);
+    timer.Add(1);
+    timer.Add(2);
+    timer.Add(1023);
+    timer.Add(1024);
+    timer.Add(std::numeric_limits<int64_t>::max() / 2);
+
+    BOOST_CHECK_EQUAL(timer.vBuckets[0], 2);
+    BOOST_CHECK_EQUAL(timer.vBuckets[1], 1);
+    BOOST_CHECK_EQUAL(timer.vBuckets[9], 1);
+    BOOST_CHECK_EQUAL(timer.vBuckets[10], 1);
+    BOOST_CHECK_EQUAL(timer.vBuckets[CStakerTimer::BUCKETS - 1], 1);
+    BOOST_CHECK_EQUAL(timer.nCount, 6);
+    BOOST_CHECK_EQUAL(timer.nMax, std::numeric_limits<int64_t>::max() / 2);
+
+    // The snapshot carries every timer
+    UniValue stats = StakerStatsToJSON();
+    BOOST_CHECK(stats["timings"]["search"]["histogram"].size() == CStakerTimer::BUCKETS);
+    BOOST_CHECK(stats["timings"]["lockwait"].isObject());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
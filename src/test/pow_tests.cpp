@@ -2,10 +2,13 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "arith_uint256.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "pow.h"
 #include "random.h"
+#include "streams.h"
+#include "txdb.h"
 #include "util.h"
 #include "test/test_bitcoin.h"
 
@@ -93,4 +96,105 @@ BOOST_AUTO_TEST_CASE(GetBlockProofEquivalentTime_test)
     }
 }
 
+/* Test that cached retarget results match the full KimotoGravityWell walk */
+BOOST_AUTO_TEST_CASE(get_next_work_cache)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    const Consensus::Params& params = Params().GetConsensus();
+
+    const int nBlocks = 3000;
+    std::vector<uint256> hashes(nBlocks);
+    std::vector<CBlockIndex> blocks(nBlocks);
+    int64_t nTime = 1500000000;
+    for (int i = 0; i < nBlocks; i++) {
+        hashes[i] = ArithToUint256(arith_uint256(i + 1));
+        blocks[i].phashBlock = &hashes[i];
+        blocks[i].pprev = i ? &blocks[i - 1] : NULL;
+        blocks[i].nHeight = i;
+        // Block spacing swings between fast and slow runs
+        nTime += 1 + GetRand(i % 500 < 250 ? 60 : 240);
+        blocks[i].nTime = nTime;
+        blocks[i].nBits = GetNextWorkRequired(blocks[i].pprev, params);
+    }
+
+    for (int i = 0; i < nBlocks; i += 7) {
+        unsigned int nBits = GetNextWorkRequired(&blocks[i], params);
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(&blocks[i], params), nBits);
+
+        // A copy without a hash is never cached
+        CBlockIndex indexCopy = blocks[i];
+        indexCopy.phashBlock = NULL;
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(&indexCopy, params), nBits);
+
+        ClearNextWorkCache();
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(&blocks[i], params), nBits);
+    }
+    ClearNextWorkCache();
+}
+
+BOOST_AUTO_TEST_CASE(block_index_pow_hash)
+{
+    CBlockIndex index;
+    index.nVersion = 1;
+    index.nTime = CHECK_POW_FROM_NTIME - 60;
+    index.nBits = 0x1e0ffff0;
+    index.nNonce = 12345;
+    index.nStatus = BLOCK_VALID_TREE;
+    const uint256 hashPoW = index.GetBlockHeader().GetPoWHash();
+
+    // Without the status flag the hash is not used
+    index.hashPoW = GetRandHash();
+    BOOST_CHECK(index.GetBlockPoWHash() == hashPoW);
+
+    // With it the stored hash is trusted
+    index.nStatus |= BLOCK_HAVE_POW_HASH;
+    BOOST_CHECK(index.GetBlockPoWHash() == index.hashPoW);
+
+    // The index record does not carry the hash, so older versions read it whole
+    CDataStream ssWith(SER_DISK, CLIENT_VERSION);
+    ssWith << CDiskBlockIndex(&index);
+    CDiskBlockIndex diskWith;
+    ssWith >> diskWith;
+    BOOST_CHECK(ssWith.empty());
+    BOOST_CHECK(diskWith.hashPoW.IsNull());
+    BOOST_CHECK(diskWith.nStatus & BLOCK_HAVE_POW_HASH);
+}
+
+BOOST_AUTO_TEST_CASE(block_tree_pow_hash)
+{
+    CBlockIndex index;
+    index.nVersion = 1;
+    index.nTime = CHECK_POW_FROM_NTIME - 60;
+    index.nBits = 0x1e0ffff0;
+    index.nStatus = BLOCK_VALID_TREE | BLOCK_HAVE_POW_HASH;
+    index.hashPoW = ArithToUint256(arith_uint256(1));
+    const uint256 hashBlock = index.GetBlockHeader().GetHash();
+    index.phashBlock = &hashBlock;
+    CBlockIndex indexRewritten = index;
+    indexRewritten.phashBlock = NULL;
+    indexRewritten.nNonce = 1;
+
+    // The hash is written under its own key, while an older version that
+    // rewrites an entry keeps the flag but leaves the hash out
+    CBlockTreeDB blocktree(1 << 20, true);
+    std::vector<const CBlockIndex*> vIndex(1, &index);
+    BOOST_CHECK(blocktree.WriteBatchSync(std::vector<std::pair<int, const CBlockFileInfo*> >(), 0, vIndex));
+    BOOST_CHECK(blocktree.WriteBlockIndex(std::vector<CDiskBlockIndex>(1, CDiskBlockIndex(&indexRewritten))));
+
+    std::map<uint256, CBlockIndex> mapIndex;
+    BOOST_CHECK(blocktree.LoadBlockIndexGuts([&mapIndex](const uint256& hash) {
+        return hash.IsNull() ? (CBlockIndex*)NULL : &mapIndex[hash];
+    }));
+    BOOST_CHECK_EQUAL(mapIndex.size(), 2U);
+
+    const CBlockIndex& loaded = mapIndex[index.GetBlockHash()];
+    BOOST_CHECK(loaded.nStatus & BLOCK_HAVE_POW_HASH);
+    BOOST_CHECK(loaded.hashPoW == index.hashPoW);
+
+    // Without its hash the entry goes back to having its PoW checked
+    const CBlockIndex& loadedRewritten = mapIndex[indexRewritten.GetBlockHeader().GetHash()];
+    BOOST_CHECK(!(loadedRewritten.nStatus & BLOCK_HAVE_POW_HASH));
+    BOOST_CHECK(loadedRewritten.GetBlockPoWHash() == indexRewritten.GetBlockHeader().GetPoWHash());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -5,6 +5,8 @@
 #include "utilstrencodings.h"
 #include "crypto/scrypt.h"
 
+#include <algorithm>
+
 BOOST_AUTO_TEST_SUITE(scrypt_tests)
 
 BOOST_AUTO_TEST_CASE(scrypt_hashtest)
@@ -32,4 +34,24 @@ BOOST_AUTO_TEST_CASE(scrypt_hashtest)
     }
 }
 
+BOOST_AUTO_TEST_CASE(scrypt_multi)
+{
+    // Every batch size up to two full groups of lanes, so each lane and a
+    // partly filled last group hash the same as one at a time
+    const size_t nCount = 2 * scrypt_multi_lanes() + 1;
+    std::vector<char> input(80 * nCount);
+    for (size_t i = 0; i < input.size(); i++)
+        input[i] = (char)(i * 131 + 7);
+    std::vector<char> expected(32 * nCount);
+    for (size_t i = 0; i < nCount; i++)
+        scrypt_1024_1_1_256(&input[80 * i], &expected[32 * i]);
+
+    for (size_t n = 0; n <= nCount; n++) {
+        std::vector<char> output(32 * (n + 1), 0);
+        scrypt_1024_1_1_256_multi(input.data(), output.data(), n);
+        BOOST_CHECK(std::equal(output.begin(), output.begin() + 32 * n, expected.begin()));
+        BOOST_CHECK(std::count(output.begin() + 32 * n, output.end(), 0) == 32);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
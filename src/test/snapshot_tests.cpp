@@ -0,0 +1,129 @@
+// Copyright (c) 2018 The R3VCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "coins.h"
+#include "kernel.h"
+#include "keystore.h"
+#include "random.h"
+#include "script/sign.h"
+#include "snapshot.h"
+#include "txdb.h"
+#include "validation.h"
+#include "test/test_bitcoin.h"
+
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(snapshot_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(snapshot_roundtrip)
+{
+    // Give the chainstate at the genesis block a few coins to carry over
+    std::vector<COutPoint> vOutPoints;
+    {
+        LOCK(cs_main);
+        for (uint32_t n = 0; n < 3; n++) {
+            vOutPoints.push_back(COutPoint(GetRandHash(), n));
+            pcoinsTip->AddCoin(vOutPoints.back(), Coin(CTxOut(n * COIN + 1, CScript() << OP_TRUE), 0, false), false);
+        }
+    }
+
+    boost::filesystem::path path = pathTemp / "utxo.dat";
+    CSnapshotHeader header;
+    uint64_t nCoins;
+    uint256 hashSnapshot;
+    BOOST_CHECK(DumpUTXOSnapshot(path, header, nCoins, hashSnapshot));
+    BOOST_CHECK(header.hashBase == chainActive.Tip()->GetBlockHash());
+    BOOST_CHECK_EQUAL(header.nHeight, 0);
+    BOOST_CHECK_EQUAL(nCoins, 3U);
+
+    CBlockTreeDB blocktree(1 << 20, true);
+    CCoinsViewDB coinsdb(1 << 20, true);
+    BOOST_CHECK(LoadUTXOSnapshot(Params(), path, blocktree, coinsdb));
+    BOOST_CHECK(coinsdb.GetBestBlock() == header.hashBase);
+    for (uint32_t n = 0; n < 3; n++) {
+        Coin coin;
+        BOOST_CHECK(coinsdb.GetCoin(vOutPoints[n], coin));
+        BOOST_CHECK_EQUAL(coin.out.nValue, n * COIN + 1);
+    }
+    bool fFlag = false;
+    BOOST_CHECK(blocktree.ReadFlag("prunedblockfiles", fFlag) && fFlag);
+    BOOST_CHECK(blocktree.ReadFlag("snapshotloading", fFlag) && !fFlag);
+
+    // A snapshot that does not match its hash is rejected, and leaves the
+    // databases marked as not usable
+    std::vector<char> vData(boost::filesystem::file_size(path));
+    boost::filesystem::ifstream(path, std::ios::binary).read(vData.data(), vData.size());
+    vData.back() ^= 1;
+    boost::filesystem::path pathCorrupt = pathTemp / "utxo_corrupt.dat";
+    boost::filesystem::ofstream(pathCorrupt, std::ios::binary).write(vData.data(), vData.size());
+    CBlockTreeDB blocktreeCorrupt(1 << 20, true);
+    CCoinsViewDB coinsdbCorrupt(1 << 20, true);
+    BOOST_CHECK(!LoadUTXOSnapshot(Params(), pathCorrupt, blocktreeCorrupt, coinsdbCorrupt));
+    BOOST_CHECK(coinsdbCorrupt.GetBestBlock().IsNull());
+    BOOST_CHECK(blocktreeCorrupt.ReadFlag("snapshotloading", fFlag) && fFlag);
+}
+
+BOOST_FIXTURE_TEST_CASE(snapshot_stake, TestChain100Setup)
+{
+    // A coin as upgraded from the per transaction format, without the block
+    // fields, and of a transaction a node bootstrapped from the snapshot has
+    // no block to read from
+    CBasicKeyStore keystore;
+    keystore.AddKey(coinbaseKey);
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    COutPoint prevout(GetRandHash(), 0);
+    const int nHeightFrom = 10;
+    {
+        LOCK(cs_main);
+        pcoinsTip->AddCoin(prevout, Coin(CTxOut(1000 * COIN, scriptPubKey), nHeightFrom, false), false);
+    }
+
+    boost::filesystem::path path = pathTemp / "utxo.dat";
+    CSnapshotHeader header;
+    uint64_t nCoins;
+    uint256 hashSnapshot;
+    BOOST_CHECK(DumpUTXOSnapshot(path, header, nCoins, hashSnapshot));
+
+    // The loaded coin carries the fields of its block
+    CBlockTreeDB blocktree(1 << 20, true);
+    CCoinsViewDB coinsdb(1 << 20, true);
+    BOOST_CHECK(LoadUTXOSnapshot(Params(), path, blocktree, coinsdb));
+    Coin coin;
+    BOOST_CHECK(coinsdb.GetCoin(prevout, coin));
+    BOOST_CHECK(coin.HasBlockInfo());
+    BOOST_CHECK_EQUAL(coin.nBlockTime, chainActive[nHeightFrom]->nTime);
+    BOOST_CHECK(!coin.fBlockProofOfStake);
+
+    // so a coinstake staking it verifies against the loaded chainstate alone
+    CMutableTransaction txStake;
+    txStake.nTime = chainActive[nHeightFrom]->nTime + Params().StakeMinAge() + 24 * 60 * 60;
+    txStake.vin.push_back(CTxIn(prevout));
+    txStake.vout.push_back(CTxOut(0, CScript()));
+    txStake.vout.push_back(CTxOut(1000 * COIN, scriptPubKey));
+    BOOST_CHECK(SignSignature(keystore, scriptPubKey, txStake, 0, 1000 * COIN, SIGHASH_ALL));
+    CTransactionRef ptxStake = MakeTransactionRef(txStake);
+    BOOST_CHECK(ptxStake->IsCoinStake());
+
+    CCoinsViewCache* pcoinsTipPrev = pcoinsTip;
+    {
+        LOCK(cs_main);
+        pcoinsTip = new CCoinsViewCache(&coinsdb);
+        CStakeCheck check;
+        BOOST_CHECK(GetProofOfStakeCheck(ptxStake, check));
+        BOOST_CHECK(check());
+        // Only the main chain limits the stake age, which coin age needs
+        SelectParams(CBaseChainParams::MAIN);
+        BOOST_CHECK(GetCoinAge(ptxStake) > 0);
+        SelectParams(CBaseChainParams::REGTEST);
+        delete pcoinsTip;
+        pcoinsTip = pcoinsTipPrev;
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -140,6 +140,42 @@ TestChain100Setup::~TestChain100Setup()
 {
 }
 
+static std::vector<int64_t> SpacedBlockTimes(int nLength, int64_t nTimeFirst)
+{
+    std::vector<int64_t> vTime(nLength);
+    for (int i = 0; i < nLength; i++)
+        vTime[i] = nTimeFirst + i * 60;
+    return vTime;
+}
+
+TestBlockIndexChain::TestBlockIndexChain(int nLength, int64_t nTimeFirst) : TestBlockIndexChain(SpacedBlockTimes(nLength, nTimeFirst))
+{
+}
+
+TestBlockIndexChain::TestBlockIndexChain(const std::vector<int64_t>& vTime) : vHash(vTime.size()), vIndex(vTime.size())
+{
+    AssertLockHeld(cs_main);
+    for (size_t i = 0; i < vIndex.size(); i++) {
+        vIndex[i].nHeight = i;
+        vIndex[i].nTime = vTime[i];
+        vIndex[i].nTimeMax = i ? std::max(vIndex[i - 1].nTimeMax, vIndex[i].nTime) : vIndex[i].nTime;
+        vIndex[i].nStakeModifier = 0x1000 + i;
+        vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+        vHash[i] = vIndex[i].GetBlockHeader().GetHash();
+        vIndex[i].phashBlock = &vHash[i];
+        vIndex[i].BuildSkip();
+        mapBlockIndex[vHash[i]] = &vIndex[i];
+    }
+    pindexTipPrev = chainActive.Tip();
+    chainActive.SetTip(&vIndex.back());
+}
+
+TestBlockIndexChain::~TestBlockIndexChain()
+{
+    chainActive.SetTip(pindexTipPrev);
+    for (const uint256& hash : vHash)
+        mapBlockIndex.erase(hash);
+}
 
 CTxMemPoolEntry TestMemPoolEntryHelper::FromTx(const CMutableTransaction &tx, CTxMemPool *pool) {
     CTransaction txn(tx);
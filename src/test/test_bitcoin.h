@@ -60,6 +60,23 @@ struct TestChain100Setup : public TestingSetup {
     CKey coinbaseKey; // private/public key needed to spend coinbase transactions
 };
 
+/**
+ * A chain of block index entries without blocks, for tests of the staking
+ * rules. It is indexed in mapBlockIndex and made the active chain until it
+ * is destroyed, which restores the previous tip. Blocks have their own stake
+ * modifiers and, unless given their times, are one minute apart starting at
+ * nTimeFirst. Requires cs_main.
+ */
+struct TestBlockIndexChain {
+    std::vector<uint256> vHash;
+    std::vector<CBlockIndex> vIndex;
+    CBlockIndex* pindexTipPrev;
+
+    TestBlockIndexChain(int nLength, int64_t nTimeFirst);
+    TestBlockIndexChain(const std::vector<int64_t>& vTime);
+    ~TestBlockIndexChain();
+};
+
 class CTxMemPoolEntry;
 class CTxMemPool;
 
@@ -7,7 +7,9 @@
 
 #include "chainparams.h"
 #include "hash.h"
+#include "init.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
 #include "validation.h"
 
@@ -15,10 +17,12 @@
 
 #include <boost/thread.hpp>
 
+static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
 static const char DB_BLOCK_INDEX = 'b';
+static const char DB_POW_HASH = 'p';
 
 static const char DB_BEST_BLOCK = 'B';
 static const char DB_FLAG = 'F';
@@ -26,16 +30,40 @@ static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
 
 
+namespace {
+
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN)  {}
+
+    template<typename Stream>
+    void Serialize(Stream &s) const {
+        s << key;
+        s << outpoint->hash;
+        s << VARINT(outpoint->n);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        s >> key;
+        s >> outpoint->hash;
+        s >> VARINT(outpoint->n);
+    }
+};
+
+}
+
 CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true) 
 {
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(std::make_pair(DB_COINS, txid), coins);
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    return db.Read(CoinEntry(&outpoint), coin);
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(std::make_pair(DB_COINS, txid));
+bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
+    return db.Exists(CoinEntry(&outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
@@ -45,18 +73,25 @@ uint256 CCoinsViewDB::GetBestBlock() const {
     return hashBestChain;
 }
 
+// Add a cache entry to batch if it is dirty, returns whether it was
+static bool BatchWriteCoin(CDBBatch &batch, const COutPoint &outpoint, const CCoinsCacheEntry &entry)
+{
+    if (!(entry.flags & CCoinsCacheEntry::DIRTY))
+        return false;
+    if (entry.coin.IsSpent())
+        batch.Erase(CoinEntry(&outpoint));
+    else
+        batch.Write(CoinEntry(&outpoint), entry.coin);
+    return true;
+}
+
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
-        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(std::make_pair(DB_COINS, it->first));
-            else
-                batch.Write(std::make_pair(DB_COINS, it->first), it->second.coins);
+        if (BatchWriteCoin(batch, it->first, it->second))
             changed++;
-        }
         count++;
         CCoinsMap::iterator itOld = it++;
         mapCoins.erase(itOld);
@@ -64,10 +99,141 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     if (!hashBlock.IsNull())
         batch.Write(DB_BEST_BLOCK, hashBlock);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    LogPrint("coindb", "Committing %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
     return db.WriteBatch(batch);
 }
 
+bool CCoinsViewDB::WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    CDBBatch batch(db);
+    size_t changed = 0;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (BatchWriteCoin(batch, it->first, it->second))
+            changed++;
+    }
+    if (!hashBlock.IsNull())
+        batch.Write(DB_BEST_BLOCK, hashBlock);
+
+    LogPrint("coindb", "Committing %u changed transaction outputs (out of %u) to coin database in the background...\n", (unsigned int)changed, (unsigned int)mapCoins.size());
+    return db.WriteBatch(batch);
+}
+
+CCoinsViewFlushBuffer::CCoinsViewFlushBuffer(CCoinsView *viewIn, CCoinsViewDB *pdbIn) : CCoinsViewBacked(viewIn), pdb(pdbIn), fFlushing(false), nFlushingUsage(0), fFailed(false)
+{
+}
+
+CCoinsViewFlushBuffer::~CCoinsViewFlushBuffer()
+{
+    Sync();
+}
+
+bool CCoinsViewFlushBuffer::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fFlushing) {
+            CCoinsMap::const_iterator it = mapFlushing.find(outpoint);
+            if (it != mapFlushing.end()) {
+                coin = it->second.coin;
+                return !coin.IsSpent();
+            }
+        }
+    }
+    // Entries not in the flush are the same in the database before and
+    // after it commits, so the database can be read without the lock
+    return base->GetCoin(outpoint, coin);
+}
+
+bool CCoinsViewFlushBuffer::HaveCoin(const COutPoint &outpoint) const {
+    Coin coin;
+    return GetCoin(outpoint, coin);
+}
+
+uint256 CCoinsViewFlushBuffer::GetBestBlock() const {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fFlushing && !hashFlushing.IsNull())
+            return hashFlushing;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewFlushBuffer::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    boost::unique_lock<boost::mutex> lockWrite(mutexWrite);
+    if (!WaitForWrite())
+        return false;
+
+    size_t nUsage = memusage::DynamicUsage(mapCoins);
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
+        nUsage += it->second.coin.DynamicMemoryUsage();
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        mapFlushing.swap(mapCoins);
+        hashFlushing = hashBlock;
+        nFlushingUsage = nUsage;
+        fFlushing = true;
+    }
+    threadWrite = boost::thread(&CCoinsViewFlushBuffer::ThreadWrite, this);
+    return true;
+}
+
+CCoinsViewCursor *CCoinsViewFlushBuffer::Cursor() const {
+    Sync();
+    return base->Cursor();
+}
+
+bool CCoinsViewFlushBuffer::Sync() const {
+    boost::unique_lock<boost::mutex> lockWrite(mutexWrite);
+    return WaitForWrite();
+}
+
+bool CCoinsViewFlushBuffer::WaitForWrite() const {
+    if (threadWrite.joinable())
+        threadWrite.join();
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return !fFailed;
+}
+
+size_t CCoinsViewFlushBuffer::DynamicMemoryUsage() const {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return nFlushingUsage;
+}
+
+void CCoinsViewFlushBuffer::ThreadWrite()
+{
+    RenameThread("bitcoin-coinsflush");
+    int64_t nStart = GetTimeMicros();
+    bool fOk = false;
+    try {
+        // mapFlushing is only changed by BatchWrite, after this thread is
+        // joined, so it can be read here without the lock
+        fOk = pdb->WriteCoins(mapFlushing, hashFlushing);
+    } catch (const std::runtime_error& e) {
+        LogPrintf("Error writing to the coin database: %s\n", e.what());
+    }
+
+    if (!fOk) {
+        // Keep serving the coins that did not make it to disk; no further
+        // flush is taken and the node shuts down
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fFailed = true;
+        }
+        uiInterface.ThreadSafeMessageBox(_("Error writing to the coin database, shutting down."), "", CClientUIInterface::MSG_ERROR);
+        StartShutdown();
+        return;
+    }
+
+    CCoinsMap mapWritten;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        mapWritten.swap(mapFlushing);
+        hashFlushing.SetNull();
+        nFlushingUsage = 0;
+        fFlushing = false;
+    }
+    LogPrint("coindb", "Committed %u transaction outputs to coin database in %.2fms\n", (unsigned int)mapWritten.size(), (GetTimeMicros() - nStart) * 0.001);
+    // mapWritten is freed here, outside of the lock
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
 }
 
@@ -97,25 +263,31 @@ CCoinsViewCursor *CCoinsViewDB::Cursor() const
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
-    i->pcursor->Seek(DB_COINS);
+    i->pcursor->Seek(DB_COIN);
     // Cache key of first record
-    i->pcursor->GetKey(i->keyTmp);
+    if (i->pcursor->Valid()) {
+        CoinEntry entry(&i->keyTmp.second);
+        i->pcursor->GetKey(entry);
+        i->keyTmp.first = entry.key;
+    } else {
+        i->keyTmp.first = 0; // Make sure Valid() and GetKey() return false
+    }
     return i;
 }
 
-bool CCoinsViewDBCursor::GetKey(uint256 &key) const
+bool CCoinsViewDBCursor::GetKey(COutPoint &key) const
 {
     // Return cached key
-    if (keyTmp.first == DB_COINS) {
+    if (keyTmp.first == DB_COIN) {
         key = keyTmp.second;
         return true;
     }
     return false;
 }
 
-bool CCoinsViewDBCursor::GetValue(CCoins &coins) const
+bool CCoinsViewDBCursor::GetValue(Coin &coin) const
 {
-    return pcursor->GetValue(coins);
+    return pcursor->GetValue(coin);
 }
 
 unsigned int CCoinsViewDBCursor::GetValueSize() const
@@ -125,14 +297,18 @@ unsigned int CCoinsViewDBCursor::GetValueSize() const
 
 bool CCoinsViewDBCursor::Valid() const
 {
-    return keyTmp.first == DB_COINS;
+    return keyTmp.first == DB_COIN;
 }
 
 void CCoinsViewDBCursor::Next()
 {
     pcursor->Next();
-    if (!pcursor->Valid() || !pcursor->GetKey(keyTmp))
+    CoinEntry entry(&keyTmp.second);
+    if (!pcursor->Valid() || !pcursor->GetKey(entry)) {
         keyTmp.first = 0; // Invalidate cached key after last record so that Valid() and GetKey() return false
+    } else {
+        keyTmp.first = entry.key;
+    }
 }
 
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
@@ -145,10 +321,19 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
     for (std::vector<const CBlockIndex*>::const_iterator it=blockinfo.begin(); it != blockinfo.end(); it++) {
         CDiskBlockIndex test(*it);
         batch.Write(std::make_pair(DB_BLOCK_INDEX, (*it)->GetBlockHash()), CDiskBlockIndex(*it));
+        if ((*it)->nStatus & BLOCK_HAVE_POW_HASH)
+            batch.Write(std::make_pair(DB_POW_HASH, (*it)->GetBlockHash()), (*it)->hashPoW);
     }
     return WriteBatch(batch, true);
 }
 
+bool CBlockTreeDB::WriteBlockIndex(const std::vector<CDiskBlockIndex>& vIndex) {
+    CDBBatch batch(*this);
+    for (std::vector<CDiskBlockIndex>::const_iterator it = vIndex.begin(); it != vIndex.end(); it++)
+        batch.Write(std::make_pair(DB_BLOCK_INDEX, it->GetBlockHash()), *it);
+    return WriteBatch(batch, true);
+}
+
 bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
     return Read(std::make_pair(DB_TXINDEX, txid), pos);
 }
@@ -178,6 +363,11 @@ bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256
 
     pcursor->Seek(std::make_pair(DB_BLOCK_INDEX, uint256()));
 
+    // PoW hashes are keyed by the same block hash, so their cursor walks
+    // along with the block index one
+    std::unique_ptr<CDBIterator> pcursorPoW(NewIterator());
+    pcursorPoW->Seek(std::make_pair(DB_POW_HASH, uint256()));
+
     // Load mapBlockIndex
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
@@ -200,14 +390,22 @@ bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256
                 pindexNew->nStatus        = diskindex.nStatus;
                 pindexNew->nTx            = diskindex.nTx;
 
-                // R3VCoin: Disable PoW Sanity check while loading block index from disk.
-                // We use the sha256 hash for the block index for performance reasons, which is recorded for later use.
-                // CheckProofOfWork() uses the scrypt hash which is discarded after a block is accepted.
-                // While it is technically feasible to verify the PoW, doing so takes several minutes as it
-                // requires recomputing every PoW hash during every R3VCoin startup.
-                // We opt instead to simply trust the data that is on your local disk.
-                //if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, Params().GetConsensus()))
-                //    return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
+                // R3VCoin: The block index is keyed by the sha256 hash, while CheckProofOfWork() needs the scrypt
+                // hash. Recomputing every scrypt hash at startup takes several minutes, so the scrypt hash stored
+                // when the header was accepted is checked against the target instead, and trusted otherwise
+                // (-reverifypow recomputes them). Entries written before it was stored are not checked, nor are
+                // those whose hash is missing because an older version rewrote them with the flag but not the hash.
+                if (pindexNew->nStatus & BLOCK_HAVE_POW_HASH) {
+                    std::pair<char, uint256> keyPoW;
+                    while (pcursorPoW->Valid() && pcursorPoW->GetKey(keyPoW) && keyPoW.first == DB_POW_HASH && keyPoW.second < key.second)
+                        pcursorPoW->Next();
+                    if (!(pcursorPoW->Valid() && pcursorPoW->GetKey(keyPoW) && keyPoW.first == DB_POW_HASH && keyPoW.second == key.second &&
+                          pcursorPoW->GetValue(pindexNew->hashPoW)))
+                        pindexNew->nStatus &= ~BLOCK_HAVE_POW_HASH;
+                }
+                if ((pindexNew->nStatus & BLOCK_HAVE_POW_HASH) && pindexNew->GetBlockTime() <= CHECK_POW_FROM_NTIME &&
+                    !CheckProofOfWork(pindexNew->hashPoW, pindexNew->nBits, Params().GetConsensus()))
+                    return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
 
                 // PoSV fields
                 pindexNew->nMint          = diskindex.nMint;
@@ -218,11 +416,6 @@ bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256
                 pindexNew->prevoutStake   = diskindex.prevoutStake;
                 pindexNew->nStakeTime     = diskindex.nStakeTime;
 
-                // PoSV: build setStakeSeen
-                if (pindexNew->IsProofOfStake()) {
-                    setStakeSeen.insert(std::make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-                }
-
                 pcursor->Next();
             } else {
                 return error("LoadBlockIndex() : failed to read value");
@@ -234,3 +427,139 @@ bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256
 
     return true;
 }
+
+namespace {
+
+//! Legacy class to deserialize the per-transaction records of older chainstates
+class CCoins
+{
+public:
+    bool fCoinBase;
+    bool fCoinStake;
+    uint32_t nTime;
+    unsigned int nBlockTime;
+    bool fBlockProofOfStake;
+    std::vector<CTxOut> vout;
+    int nHeight;
+
+    CCoins() : fCoinBase(false), fCoinStake(false), nTime(0), nBlockTime(0), fBlockProofOfStake(false), vout(0), nHeight(0) { }
+
+    template<typename Stream>
+    void Unserialize(Stream &s) {
+        unsigned int nCode = 0;
+        // version
+        int nVersionDummy;
+        ::Unserialize(s, VARINT(nVersionDummy));
+        // header code
+        ::Unserialize(s, VARINT(nCode));
+        fCoinBase = nCode & 1;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 2) != 0;
+        vAvail[1] = (nCode & 4) != 0;
+        unsigned int nMaskCode = (nCode / 8) + ((nCode & 6) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])));
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight));
+        // tx timestamp
+        ::Unserialize(s, VARINT(nTime));
+        // coinstake and block metadata flags
+        unsigned char nCoinStake = 0;
+        ::Unserialize(s, nCoinStake);
+        fCoinStake = nCoinStake & 1;
+        fBlockProofOfStake = (nCoinStake & 4) != 0;
+        // block timestamp
+        nBlockTime = 0;
+        if (nCoinStake & 2)
+            ::Unserialize(s, VARINT(nBlockTime));
+    }
+};
+
+}
+
+/** Upgrade the database from older formats.
+ *
+ * Currently implemented: from the per-tx utxo model to per-txout.
+ */
+bool CCoinsViewDB::Upgrade() {
+    std::unique_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(std::make_pair(DB_COINS, uint256()));
+    if (!pcursor->Valid()) {
+        return true;
+    }
+
+    int64_t count = 0;
+    LogPrintf("Upgrading utxo-set database...\n");
+    LogPrintf("[0%%]...");
+    uiInterface.ShowProgress(_("Upgrading UTXO database"), 0);
+    size_t batch_size = 1 << 24;
+    CDBBatch batch(db);
+    int reportDone = 0;
+    std::pair<unsigned char, uint256> key;
+    std::pair<unsigned char, uint256> prev_key = std::make_pair((unsigned char)DB_COINS, uint256());
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested()) {
+            break;
+        }
+        if (pcursor->GetKey(key) && key.first == DB_COINS) {
+            if (count++ % 256 == 0) {
+                uint32_t high = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+                int percentageDone = (int)(high * 100.0 / 65536.0 + 0.5);
+                uiInterface.ShowProgress(_("Upgrading UTXO database"), percentageDone);
+                if (reportDone < percentageDone/10) {
+                    // report max. every 10% step
+                    LogPrintf("[%d%%]...", percentageDone);
+                    reportDone = percentageDone/10;
+                }
+            }
+            CCoins old_coins;
+            if (!pcursor->GetValue(old_coins)) {
+                return error("%s: cannot parse CCoins record", __func__);
+            }
+            COutPoint outpoint(key.second, 0);
+            for (size_t i = 0; i < old_coins.vout.size(); ++i) {
+                if (!old_coins.vout[i].IsNull() && !old_coins.vout[i].scriptPubKey.IsUnspendable()) {
+                    Coin newcoin(old_coins.vout[i], old_coins.nHeight, old_coins.fCoinBase);
+                    newcoin.fCoinStake = old_coins.fCoinStake;
+                    newcoin.nTime = old_coins.nTime;
+                    newcoin.nBlockTime = old_coins.nBlockTime;
+                    newcoin.fBlockProofOfStake = old_coins.fBlockProofOfStake;
+                    outpoint.n = i;
+                    CoinEntry entry(&outpoint);
+                    batch.Write(entry, newcoin);
+                }
+            }
+            batch.Erase(key);
+            if (batch.SizeEstimate() > batch_size) {
+                db.WriteBatch(batch);
+                batch.Clear();
+                db.CompactRange(prev_key, key);
+                prev_key = key;
+            }
+            pcursor->Next();
+        } else {
+            break;
+        }
+    }
+    db.WriteBatch(batch);
+    db.CompactRange(std::make_pair((unsigned char)DB_COINS, uint256()), key);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s].\n", ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
+}
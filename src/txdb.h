@@ -16,6 +16,8 @@
 #include <vector>
 
 #include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 class CBlockIndex;
 class CCoinsViewDBCursor;
@@ -75,11 +77,70 @@ protected:
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     CCoinsViewCursor *Cursor() const;
+
+    //! Write the dirty entries of mapCoins and the best block in one atomic
+    //! batch, leaving mapCoins untouched so it can be read while it commits
+    bool WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock);
+
+    //! Convert per-transaction records of an older database to per-output
+    //! ones. Returns false on a read error or when interrupted by shutdown.
+    bool Upgrade();
+};
+
+/**
+ * CCoinsView that writes flushes to the coin database in the background.
+ *
+ * BatchWrite takes over the whole map of the flushing cache and commits it
+ * from a separate thread, so the cache can go on with an empty map at once.
+ * Until the batch is committed, reads are answered from the map it is being
+ * written from, so the view above sees the same coins as before the flush.
+ * Only one flush is in flight: a new one waits for the previous to commit.
+ * The best block is written in the same batch as the coins, so after a
+ * crash the database is either at the old or the new best block.
+ */
+class CCoinsViewFlushBuffer : public CCoinsViewBacked
+{
+private:
+    CCoinsViewDB *pdb;
+
+    //! Protects the fields below against the writer clearing them
+    mutable boost::mutex mutex;
+    CCoinsMap mapFlushing;
+    uint256 hashFlushing;
+    bool fFlushing;
+    size_t nFlushingUsage;
+    bool fFailed;
+
+    //! Serializes joining and starting the writer thread
+    mutable boost::mutex mutexWrite;
+    mutable boost::thread threadWrite;
+
+    void ThreadWrite();
+    bool WaitForWrite() const;
+
+public:
+    //! Reads go to viewIn, commits to pdbIn, which viewIn must be backed by
+    CCoinsViewFlushBuffer(CCoinsView *viewIn, CCoinsViewDB *pdbIn);
+    ~CCoinsViewFlushBuffer();
+
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
+    uint256 GetBestBlock() const;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    //! Waits for the flush in flight first, the database has no snapshot of it
+    CCoinsViewCursor *Cursor() const;
+
+    //! Wait until the flush in flight, if any, is committed. Returns false if
+    //! a background write failed.
+    bool Sync() const;
+
+    //! Memory used by the map of the flush in flight
+    size_t DynamicMemoryUsage() const;
 };
 
 /** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
@@ -88,8 +149,8 @@ class CCoinsViewDBCursor: public CCoinsViewCursor
 public:
     ~CCoinsViewDBCursor() {}
 
-    bool GetKey(uint256 &key) const;
-    bool GetValue(CCoins &coins) const;
+    bool GetKey(COutPoint &key) const;
+    bool GetValue(Coin &coin) const;
     unsigned int GetValueSize() const;
 
     bool Valid() const;
@@ -99,7 +160,7 @@ private:
     CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn):
         CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn) {}
     std::unique_ptr<CDBIterator> pcursor;
-    std::pair<char, uint256> keyTmp;
+    std::pair<char, COutPoint> keyTmp;
 
     friend class CCoinsViewDB;
 };
@@ -114,6 +175,7 @@ private:
     void operator=(const CBlockTreeDB&);
 public:
     bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
+    bool WriteBlockIndex(const std::vector<CDiskBlockIndex>& vIndex);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
     bool ReadLastBlockFile(int &nFile);
     bool WriteReindexing(bool fReindex);
@@ -12,6 +12,7 @@
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "crypto/scrypt.h"
 #include "hash.h"
 #include "init.h"
 #include "kernel.h"
@@ -39,7 +40,9 @@
 #include "warnings.h"
 
 #include <atomic>
+#include <deque>
 #include <sstream>
+#include <unordered_set>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/algorithm/string/join.hpp>
@@ -93,7 +96,7 @@ CScript COINBASE_FLAGS;
 const std::string strMessageMagic = "R3VCoin Signed Message:\n";
 
 // PoSV
-std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
+CStakeSeenSet setStakeSeen;
 int64_t nReserveBalance = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
 
@@ -214,6 +217,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewFlushBuffer *pcoinsFlushBuffer = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
 enum FlushStateMode {
@@ -402,15 +406,15 @@ bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool
         prevheights.resize(tx.vin.size());
         for (size_t txinIndex = 0; txinIndex < tx.vin.size(); txinIndex++) {
             const CTxIn& txin = tx.vin[txinIndex];
-            CCoins coins;
-            if (!viewMemPool.GetCoins(txin.prevout.hash, coins)) {
+            Coin coin;
+            if (!viewMemPool.GetCoin(txin.prevout, coin)) {
                 return error("%s: Missing input", __func__);
             }
-            if (coins.nHeight == MEMPOOL_HEIGHT) {
+            if (coin.nHeight == MEMPOOL_HEIGHT) {
                 // Assume all mempool transaction confirm in the next block
                 prevheights[txinIndex] = tip->nHeight + 1;
             } else {
-                prevheights[txinIndex] = coins.nHeight;
+                prevheights[txinIndex] = coin.nHeight;
             }
         }
         lockPair = CalculateSequenceLocks(tx, flags, &prevheights, index);
@@ -552,9 +556,9 @@ void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age) {
     if (expired != 0)
         LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
 
-    std::vector<uint256> vNoSpendsRemaining;
+    std::vector<COutPoint> vNoSpendsRemaining;
     pool.TrimToSize(limit, &vNoSpendsRemaining);
-    BOOST_FOREACH(const uint256& removed, vNoSpendsRemaining)
+    BOOST_FOREACH(const COutPoint& removed, vNoSpendsRemaining)
         pcoinsTip->Uncache(removed);
 }
 
@@ -581,7 +585,7 @@ static bool IsCurrentForFeeEstimation()
 
 bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx, bool fLimitFree,
                               bool* pfMissingInputs, int64_t nAcceptTime, std::list<CTransactionRef>* plTxnReplaced,
-                              bool fOverrideMempoolLimit, const CAmount& nAbsurdFee, std::vector<uint256>& vHashTxnToUncache)
+                              bool fOverrideMempoolLimit, const CAmount& nAbsurdFee, std::vector<COutPoint>& coins_to_uncache)
 {
     const CTransaction& tx = *ptx;
     const uint256 hash = tx.GetHash();
@@ -687,34 +691,25 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
         view.SetBackend(viewMemPool);
 
-        // do we already have it?
-        bool fHadTxInCache = pcoinsTip->HaveCoinsInCache(hash);
-        if (view.HaveCoins(hash)) {
-            if (!fHadTxInCache)
-                vHashTxnToUncache.push_back(hash);
-
-            return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
-        }
-
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // and only helps with filling in pfMissingInputs (to determine missing vs spent).
         BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!pcoinsTip->HaveCoinsInCache(txin.prevout.hash))
-                vHashTxnToUncache.push_back(txin.prevout.hash);
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!pcoinsTip->HaveCoinInCache(txin.prevout))
+                coins_to_uncache.push_back(txin.prevout);
+            if (!view.HaveCoin(txin.prevout)) {
+                // Are inputs missing because we already have the tx?
+                for (size_t out = 0; out < tx.vout.size(); out++) {
+                    // Optimistically just do efficient check of cache for outputs
+                    if (pcoinsTip->HaveCoinInCache(COutPoint(hash, out)))
+                        return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
+                }
+                // Otherwise assume this might be an orphan tx for which we just haven't seen parents yet
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
-                    
+
                 return false; // fMissingInputs and !state.IsInvalid() is used to detect this condition, don't set state.Invalid()
             }
         }
 
-        // are the actual inputs available?
-        if (!view.HaveInputs(tx)) {
-            return state.Invalid(false, REJECT_DUPLICATE, "bad-txns-inputs-spent");
-        }
-
         // Bring the best block into scope
         view.GetBestBlock();
 
@@ -759,8 +754,8 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // during reorgs to ensure COINBASE_MATURITY is still met.
         bool fSpendsCoinbase = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            const CCoins *coins = view.AccessCoins(txin.prevout.hash);
-            if (coins->IsCoinBase()) {
+            const Coin &coin = view.AccessCoin(txin.prevout);
+            if (coin.IsCoinBase()) {
                 fSpendsCoinbase = true;
                 break;
             }
@@ -1046,10 +1041,10 @@ bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const
                         bool* pfMissingInputs, int64_t nAcceptTime, std::list<CTransactionRef>* plTxnReplaced,
                         bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
 {
-    std::vector<uint256> vHashTxToUncache;
-    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, nAcceptTime, plTxnReplaced, fOverrideMempoolLimit, nAbsurdFee, vHashTxToUncache);
+    std::vector<COutPoint> coins_to_uncache;
+    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, nAcceptTime, plTxnReplaced, fOverrideMempoolLimit, nAbsurdFee, coins_to_uncache);
     if (!res) {
-        BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
+        BOOST_FOREACH(const COutPoint& hashTx, coins_to_uncache)
             pcoinsTip->Uncache(hashTx);
     }
     // After we've (potentially) uncached entries, ensure our coins cache is still within its size limits
@@ -1107,10 +1102,9 @@ bool GetTransaction(const uint256 &hash, CTransactionRef &txOut, const Consensus
     if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
         int nHeight = -1;
         {
-            const CCoinsViewCache& view = *pcoinsTip;
-            const CCoins* coins = view.AccessCoins(hash);
-            if (coins)
-                nHeight = coins->nHeight;
+            const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+            if (!coin.IsSpent())
+                nHeight = coin.nHeight;
         }
         if (nHeight > 0)
             pindexSlow = chainActive[nHeight];
@@ -1163,7 +1157,7 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHea
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
+static bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams, bool fCheckPOW)
 {
     block.SetNull();
 
@@ -1181,15 +1175,22 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus:
     }
 
     // Check the header
-    if (block.GetBlockTime() <= CHECK_POW_FROM_NTIME && block.IsProofOfWork() && !CheckProofOfWork(block.GetPoWHash(), block.nBits, consensusParams))
+    if (fCheckPOW && block.GetBlockTime() <= CHECK_POW_FROM_NTIME && block.IsProofOfWork() && !CheckProofOfWork(block.GetPoWHash(), block.nBits, consensusParams))
         return error("ReadBlockFromDisk : Errors in block header");
 
     return true;
 }
 
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
+{
+    return ReadBlockFromDisk(block, pos, consensusParams, true);
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
 {
-    if (!ReadBlockFromDisk(block, pindex->GetBlockPos(), consensusParams))
+    // A header whose PoW hash is stored in the index had its PoW verified
+    // when it was accepted, and the hash check below ties the block to it
+    if (!ReadBlockFromDisk(block, pindex->GetBlockPos(), consensusParams, !(pindex->nStatus & BLOCK_HAVE_POW_HASH)))
         return false;
     if (block.GetHash() != pindex->GetBlockHash())
         return error("ReadBlockFromDisk(CBlock&, CBlockIndex*): GetHash() doesn't match index for %s at %s",
@@ -1379,30 +1380,25 @@ void static InvalidBlockFound(CBlockIndex *pindex, const CValidationState &state
     }
 }
 
-void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txundo, int nHeight)
+static void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txundo, int nHeight, unsigned int nBlockTime, bool fBlockProofOfStake)
 {
     // mark inputs spent
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
-            unsigned nPos = txin.prevout.n;
-
-            if (nPos >= coins->vout.size() || coins->vout[nPos].IsNull())
-                assert(false);
-            // mark an outpoint spent, and construct undo information
-            txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
-            coins->Spend(nPos);
-            if (coins->vout.size() == 0) {
-                CTxInUndo& undo = txundo.vprevout.back();
-                undo.nHeight = coins->nHeight;
-                undo.fCoinBase = coins->fCoinBase;
-                undo.nVersion = coins->nVersion;
-            }
+            // mark an outpoint spent, and keep the whole coin as undo information
+            txundo.vprevout.emplace_back();
+            bool is_spent = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
+            assert(is_spent);
         }
     }
     // add outputs
-    inputs.ModifyNewCoins(tx.GetHash(), tx.IsCoinBase())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight, nBlockTime, fBlockProofOfStake);
+}
+
+void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txundo, int nHeight)
+{
+    UpdateCoins(tx, inputs, txundo, nHeight, 0, false);
 }
 
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
@@ -1420,6 +1416,15 @@ bool CScriptCheck::operator()() {
     return true;
 }
 
+bool CCoinsPrefetch::operator()() {
+    // Read errors are handled by the backing view, as for any other lookup
+    for (size_t i = nBegin; i < nEnd; i++) {
+        if (!pview->GetCoin((*pvOutPoints)[i], (*pvCoins)[i]))
+            (*pvCoins)[i].Clear();
+    }
+    return true;
+}
+
 int GetSpendHeight(const CCoinsViewCache& inputs)
 {
     LOCK(cs_main);
@@ -1440,24 +1445,24 @@ namespace Consensus {
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins *coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
             // If prev is coinbase or coinstake, check that it's matured
-            if (coins->IsCoinBase() || coins->IsCoinStake()) {
-                if (nSpendHeight - coins->nHeight < COINBASE_MATURITY)
+            if (coin.IsCoinBase() || coin.IsCoinStake()) {
+                if (nSpendHeight - coin.nHeight < COINBASE_MATURITY)
                     return state.Invalid(false,
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase",
-                        strprintf("tried to spend coinbase at depth %d", nSpendHeight - coins->nHeight));
+                        strprintf("tried to spend coinbase at depth %d", nSpendHeight - coin.nHeight));
             }
 
             // PoSV: check transaction timestamp
-            if ((unsigned int)coins->nTime > tx.nTime)
-                return state.DoS(100, false, REJECT_INVALID, strprintf("transaction timestamp %u earlier than input transaction %s", tx.nTime, coins->nTime));
+            if (coin.nTime > tx.nTime)
+                return state.DoS(100, false, REJECT_INVALID, strprintf("transaction timestamp %u earlier than input transaction %s", tx.nTime, coin.nTime));
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, false, REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
         }
@@ -1503,11 +1508,11 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore, &txdata);
+                CScriptCheck check(coin.out, tx, i, flags, cacheStore, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1519,7 +1524,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check2(*coins, tx, i,
+                        CScriptCheck check2(coin.out, tx, i,
                                 flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
@@ -1617,34 +1622,37 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
 } // anon namespace
 
 /**
- * Apply the undo operation of a CTxInUndo to the given chain state.
- * @param undo The undo object.
+ * Restore the UTXO in a Coin at a given COutPoint.
+ * @param undo The Coin to be restored.
  * @param view The coins view to which to apply the changes.
  * @param out The out point that corresponds to the tx input.
  * @return True on success.
  */
-bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+bool ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
 {
     bool fClean = true;
 
-    CCoinsModifier coins = view.ModifyCoins(out.hash);
-    if (undo.nHeight != 0) {
-        // undo data contains height: this is the last output of the prevout tx being spent
-        if (!coins->IsPruned())
-            fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
-        coins->Clear();
-        coins->fCoinBase = undo.fCoinBase;
-        coins->nHeight = undo.nHeight;
-        coins->nVersion = undo.nVersion;
-    } else {
-        if (coins->IsPruned())
+    if (view.HaveCoin(out))
+        fClean = fClean && error("%s: undo data overwriting existing output", __func__);
+    if (undo.nHeight == 0) {
+        // Missing undo metadata (height, coinbase and the PoSV times). Undo
+        // records written before coins were kept per output included it only
+        // for the last spend of a transaction's outputs. This implies that it
+        // must be present for some other output of the same tx.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (!alternate.IsSpent()) {
+            undo.nHeight = alternate.nHeight;
+            undo.fCoinBase = alternate.fCoinBase;
+            undo.fCoinStake = alternate.fCoinStake;
+            undo.nTime = alternate.nTime;
+            undo.nBlockTime = alternate.nBlockTime;
+            undo.fBlockProofOfStake = alternate.fBlockProofOfStake;
+        } else {
             fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
+        }
     }
-    if (coins->IsAvailable(out.n))
-        fClean = fClean && error("%s: undo data overwriting existing output", __func__);
-    if (coins->vout.size() < out.n+1)
-        coins->vout.resize(out.n+1);
-    coins->vout[out.n] = undo.txout;
+    bool fCoinBase = undo.fCoinBase;
+    view.AddCoin(out, std::move(undo), fCoinBase);
 
     return fClean;
 }
@@ -1675,36 +1683,28 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
         uint256 hash = tx.GetHash();
 
         // Check that all outputs are available and match the outputs in the block itself
-        // exactly.
-        {
-        CCoinsModifier outs = view.ModifyCoins(hash);
-        outs->ClearUnspendable();
-
-        CCoins outsBlock(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs->nVersion = outsBlock.nVersion;
-        // Old tx in orphaned blocks do not have nTime set to block nTime. Set them now.
-        if (outs->nTime == 0 && outsBlock.nTime != 0)
-            outs->nTime = outsBlock.nTime;
-        if (*outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs->Clear();
+        // exactly, and remove them.
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable()) {
+                COutPoint out(hash, o);
+                Coin coin;
+                bool is_spent = view.SpendCoin(out, &coin);
+                // Old tx in orphaned blocks do not have nTime set to block nTime,
+                // so the tx time is not compared.
+                if (!is_spent || tx.vout[o] != coin.out || pindex->nHeight != (int)coin.nHeight ||
+                    tx.IsCoinBase() != (bool)coin.fCoinBase || tx.IsCoinStake() != (bool)coin.fCoinStake)
+                    fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
+            }
         }
 
         // restore inputs
         if (i > 0) { // not coinbases
-            const CTxUndo &txundo = blockUndo.vtxundo[i-1];
+            CTxUndo &txundo = blockUndo.vtxundo[i-1];
             if (txundo.vprevout.size() != tx.vin.size())
                 return error("DisconnectBlock(): transaction and undo data inconsistent");
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
-                if (!ApplyTxInUndo(undo, view, out))
+                if (!ApplyTxInUndo(std::move(txundo.vprevout[j]), view, out))
                     fClean = false;
             }
         }
@@ -1753,6 +1753,20 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+static CCheckQueue<CStakeCheck> stakecheckqueue(16);
+
+void ThreadStakeCheck() {
+    RenameThread("bitcoin-stakech");
+    stakecheckqueue.Thread();
+}
+
+static CCheckQueue<CCoinsPrefetch> prefetchqueue(1);
+
+void ThreadCoinsPrefetch() {
+    RenameThread("bitcoin-prefetch");
+    prefetchqueue.Thread();
+}
+
 // Protected by cs_main
 VersionBitsCache versionbitscache;
 
@@ -1807,6 +1821,66 @@ static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
+// PoSV: stakes at or before this time cannot be reused by a block past the
+// last checkpoint, whose time is above the median time past of the block
+// before the checkpoint, so setStakeSeen does not keep them
+static unsigned int nStakeSeenHorizon = 0;
+static const CBlockIndex* pindexStakeSeenCheckpoint = NULL;
+
+static void UpdateStakeSeenHorizon(const CChainParams& chainparams)
+{
+    AssertLockHeld(cs_main);
+    if (!fCheckpointsEnabled)
+        return;
+    const CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(chainparams.Checkpoints());
+    if (pcheckpoint == pindexStakeSeenCheckpoint || !pcheckpoint || !pcheckpoint->pprev)
+        return;
+    pindexStakeSeenCheckpoint = pcheckpoint;
+    nStakeSeenHorizon = pcheckpoint->pprev->GetMedianTimePast();
+    setStakeSeen.EraseUpTo(nStakeSeenHorizon);
+}
+
+static void AddStakeSeen(const CBlockIndex* pindex)
+{
+    if (pindex->IsProofOfStake() && pindex->nStakeTime > nStakeSeenHorizon)
+        setStakeSeen.insert(std::make_pair(pindex->prevoutStake, pindex->nStakeTime));
+}
+
+/**
+ * Whether pindex is an ancestor of the -assumevalid block, buried deep enough
+ * under the best header that its scripts need not be checked again.
+ * Requires cs_main.
+ */
+static bool IsAssumedValid(const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+{
+    AssertLockHeld(cs_main);
+    if (hashAssumeValid.IsNull())
+        return false;
+    // We've been configured with the hash of a block which has been externally verified to have a valid history.
+    // A suitable default value is included with the software and updated from time to time.  Because validity
+    //  relative to a piece of software is an objective fact these defaults can be easily reviewed.
+    // This setting doesn't force the selection of any particular chain but makes validating some faster by
+    //  effectively caching the result of part of the verification.
+    BlockMap::const_iterator  it = mapBlockIndex.find(hashAssumeValid);
+    if (it == mapBlockIndex.end())
+        return false;
+    if (it->second->GetAncestor(pindex->nHeight) == pindex &&
+        pindexBestHeader->GetAncestor(pindex->nHeight) == pindex &&
+        pindexBestHeader->nChainWork >= UintToArith256(consensusParams.nMinimumChainWork)) {
+        // This block is a member of the assumed verified chain and an ancestor of the best header.
+        // The equivalent time check discourages hashpower from extorting the network via DOS attack
+        //  into accepting an invalid block through telling users they must manually set assumevalid.
+        //  Requiring a software change or burying the invalid block, regardless of the setting, makes
+        //  it hard to hide the implication of the demand.  This also avoids having release candidates
+        //  that are hardly doing any signature verification at all in testing without having to
+        //  artificially set the default assumed verified block further back.
+        // The test against nMinimumChainWork prevents the skipping when denied access to any chain at
+        //  least as good as the expected chain.
+        return GetBlockProofEquivalentTime(*pindexBestHeader, *pindex, *pindexBestHeader, consensusParams) > 60 * 60 * 24 * 7 * 2;
+    }
+    return false;
+}
+
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex,
                   CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck)
 {
@@ -1814,8 +1888,13 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     int64_t nTimeStart = GetTimeMicros();
 
+    // Scripts of ancestors of the assumed valid block are not checked again
+    bool fScriptChecks = !IsAssumedValid(pindex, chainparams.GetConsensus());
+
     // Check it again in case a previous version let a bad block in
-    if (!CheckBlock(block, state, chainparams.GetConsensus(), !fJustCheck, !fJustCheck)) {
+    // The PoW of a header whose PoW hash is stored was verified when it was accepted
+    bool fCheckPOW = !fJustCheck && !(pindex->nStatus & BLOCK_HAVE_POW_HASH);
+    if (!CheckBlock(block, state, chainparams.GetConsensus(), fCheckPOW, !fJustCheck)) {
         return error("%s: Consensus::CheckBlock: %s", __func__, FormatStateMessage(state));
     }
 
@@ -1831,32 +1910,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         return true;
     }
 
-    bool fScriptChecks = true;
-    if (!hashAssumeValid.IsNull()) {
-        // We've been configured with the hash of a block which has been externally verified to have a valid history.
-        // A suitable default value is included with the software and updated from time to time.  Because validity
-        //  relative to a piece of software is an objective fact these defaults can be easily reviewed.
-        // This setting doesn't force the selection of any particular chain but makes validating some faster by
-        //  effectively caching the result of part of the verification.
-        BlockMap::const_iterator  it = mapBlockIndex.find(hashAssumeValid);
-        if (it != mapBlockIndex.end()) {
-            if (it->second->GetAncestor(pindex->nHeight) == pindex &&
-                pindexBestHeader->GetAncestor(pindex->nHeight) == pindex &&
-                pindexBestHeader->nChainWork >= UintToArith256(chainparams.GetConsensus().nMinimumChainWork)) {
-                // This block is a member of the assumed verified chain and an ancestor of the best header.
-                // The equivalent time check discourages hashpower from extorting the network via DOS attack
-                //  into accepting an invalid block through telling users they must manually set assumevalid.
-                //  Requiring a software change or burying the invalid block, regardless of the setting, makes
-                //  it hard to hide the implication of the demand.  This also avoids having release candidates
-                //  that are hardly doing any signature verification at all in testing without having to
-                //  artificially set the default assumed verified block further back.
-                // The test against nMinimumChainWork prevents the skipping when denied access to any chain at
-                //  least as good as the expected chain.
-                fScriptChecks = (GetBlockProofEquivalentTime(*pindexBestHeader, *pindex, *pindexBestHeader, chainparams.GetConsensus()) <= 60 * 60 * 24 * 7 * 2);
-            }
-        }
-    }
-
     int64_t nTime1 = GetTimeMicros(); nTimeCheck += nTime1 - nTimeStart;
     LogPrint("bench", "    - Sanity checks: %.2fms [%.2fs]\n", 0.001 * (nTime1 - nTimeStart), nTimeCheck * 0.000001);
 
@@ -1895,10 +1948,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             if (i == 1 && fProofOfStake) {
                 continue;
             }
-            const CCoins* coins = view.AccessCoins(tx->GetHash());
-            if (coins && !coins->IsPruned())
-                return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
-                                 REJECT_INVALID, "bad-txns-BIP30");
+            for (size_t o = 0; o < tx->vout.size(); o++) {
+                if (view.HaveCoin(COutPoint(tx->GetHash(), o)))
+                    return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
+                                     REJECT_INVALID, "bad-txns-BIP30");
+            }
         }
     }
 
@@ -1971,7 +2025,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             // be in ConnectBlock because they require the UTXO set
             prevheights.resize(tx.vin.size());
             for (size_t j = 0; j < tx.vin.size(); j++) {
-                prevheights[j] = view.AccessCoins(tx.vin[j].prevout.hash)->nHeight;
+                prevheights[j] = view.AccessCoin(tx.vin[j].prevout).nHeight;
             }
 
             if (!SequenceLocks(tx, nLockTimeFlags, &prevheights, *pindex)) {
@@ -2017,7 +2071,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         if (i > 0) {
             blockundo.vtxundo.push_back(CTxUndo());
         }
-        UpdateCoins(tx, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
+        UpdateCoins(tx, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight, block.nTime, block.IsProofOfStake());
 
         vPos.push_back(std::make_pair(tx.GetHash(), pos));
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
@@ -2047,9 +2101,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         pindex->SetProofOfStake();
         pindex->prevoutStake = block.vtx[1]->vin[0].prevout;
         pindex->nStakeTime = block.vtx[1]->nTime;
-        if (!fJustCheck && !setStakeSeen.count(block.GetProofOfStake())) {
-            setStakeSeen.insert(std::make_pair(pindex->prevoutStake, pindex->nStakeTime));
-        }
+        if (!fJustCheck)
+            AddStakeSeen(pindex);
     }
     
     // PoSV: track money supply and mint amount info
@@ -2149,7 +2202,12 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode, int n
         nLastSetChain = nNow;
     }
     int64_t nMempoolSizeMax = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    // A flush still being committed in the background holds on to the map it
+    // is written from; the peak factor for its batch was already counted
+    // when it was decided to flush.
     int64_t cacheSize = pcoinsTip->DynamicMemoryUsage() * DB_PEAK_USAGE_FACTOR;
+    if (pcoinsFlushBuffer)
+        cacheSize += pcoinsFlushBuffer->DynamicMemoryUsage();
     int64_t nTotalSpace = nCoinCacheUsage + std::max<int64_t>(nMempoolSizeMax - nMempoolUsage, 0);
     // The cache is large and we're within 10% and 200 MiB or 50% and 50MiB of the limit, but we have time now (not in the middle of a block processing).
     bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize > std::min(std::max(nTotalSpace / 2, nTotalSpace - MIN_BLOCK_COINSDB_USAGE * 1024 * 1024),
@@ -2194,16 +2252,24 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode, int n
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
     if (fDoFullFlush) {
-        // Typical CCoins structures on disk are around 128 bytes in size.
-        // Pushing a new one to the database can cause it to be written
-        // twice (once in the log, and once in the tables). This is already
-        // an overestimation, as most will delete an existing entry or
-        // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        // Typical Coin structures on disk are around 64 bytes in size,
+        // including the PoSV times. Pushing a new one to the database can
+        // cause it to be written twice (once in the log, and once in the
+        // tables). This is already an overestimation, as most will delete an
+        // existing entry or overwrite one. Still, use a conservative safety
+        // factor of 2.
+        if (!CheckDiskSpace(64 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
+        // With a flush buffer, this hands the cache over to be committed in
+        // the background, after waiting for any previous flush to commit.
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
+        // Callers asking for a full flush, like shutdown and gettxoutsetinfo,
+        // and pruning, which needs the chainstate past the removed blocks,
+        // rely on the coin database being up to date on return.
+        if (pcoinsFlushBuffer && (mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && !pcoinsFlushBuffer->Sync())
+            return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
     }
     if (fDoFullFlush || ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000)) {
@@ -2354,11 +2420,56 @@ bool static DisconnectTip(CValidationState& state, const CChainParams& chainpara
 }
 
 static int64_t nTimeReadFromDisk = 0;
+static int64_t nTimePrefetch = 0;
 static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
 static int64_t nTimeChainState = 0;
 static int64_t nTimePostConnect = 0;
 
+// Number of coins read by one prefetch job
+static const size_t COINS_PREFETCH_SLICE = 16;
+
+/**
+ * Read the coins spent by a block that pcoinsTip does not hold yet from the
+ * view backing it, spread over the prefetch threads, and add them to
+ * pcoinsTip. ConnectBlock then finds its inputs in memory instead of waiting
+ * on one database read after another. Inputs spending outputs of the same
+ * block are skipped, as are blocks with a single miss, which gain nothing.
+ */
+static void PrefetchBlockInputs(const CBlock& block)
+{
+    AssertLockHeld(cs_main);
+    std::vector<COutPoint> vOutPoints;
+    std::unordered_set<uint256, SaltedTxidHasher> setCreated;
+    for (const auto& tx : block.vtx) {
+        if (!tx->IsCoinBase()) {
+            for (const CTxIn& txin : tx->vin) {
+                if (!setCreated.count(txin.prevout.hash) && !pcoinsTip->HaveCoinInCache(txin.prevout))
+                    vOutPoints.push_back(txin.prevout);
+            }
+        }
+        setCreated.insert(tx->GetHash());
+    }
+    if (vOutPoints.size() < 2)
+        return;
+
+    std::vector<Coin> vCoins(vOutPoints.size());
+    std::vector<CCoinsPrefetch> vChecks;
+    vChecks.reserve(vOutPoints.size() / COINS_PREFETCH_SLICE + 1);
+    for (size_t nBegin = 0; nBegin < vOutPoints.size(); nBegin += COINS_PREFETCH_SLICE)
+        vChecks.push_back(CCoinsPrefetch(pcoinsTip->GetBackend(), &vOutPoints, &vCoins, nBegin, std::min(nBegin + COINS_PREFETCH_SLICE, vOutPoints.size())));
+
+    // the calling thread joins the workers, so this also works without any
+    CCheckQueueControl<CCoinsPrefetch> control(&prefetchqueue);
+    control.Add(vChecks);
+    control.Wait();
+
+    for (size_t i = 0; i < vOutPoints.size(); i++) {
+        if (!vCoins[i].IsSpent())
+            pcoinsTip->CacheCoin(vOutPoints[i], std::move(vCoins[i]));
+    }
+}
+
 /**
  * Used to track blocks whose transactions were applied to the UTXO state as a
  * part of a single ActivateBestChainStep call.
@@ -2393,6 +2504,9 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    PrefetchBlockInputs(blockConnecting);
+    int64_t nTime2b = GetTimeMicros(); nTimePrefetch += nTime2b - nTime2;
+    LogPrint("bench", "  - Prefetch inputs: %.2fms [%.2fs]\n", (nTime2b - nTime2) * 0.001, nTimePrefetch * 0.000001);
     {
         CCoinsViewCache view(pcoinsTip);
         bool rv = ConnectBlock(blockConnecting, state, pindexNew, view, chainparams);
@@ -2402,8 +2516,8 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
                 InvalidBlockFound(pindexNew, state);
             return error("ConnectTip(): ConnectBlock %s failed", pindexNew->GetBlockHash().ToString());
         }
-        nTime3 = GetTimeMicros(); nTimeConnectTotal += nTime3 - nTime2;
-        LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
+        nTime3 = GetTimeMicros(); nTimeConnectTotal += nTime3 - nTime2b;
+        LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2b) * 0.001, nTimeConnectTotal * 0.000001);
         bool flushed = view.Flush();
         assert(flushed);
     }
@@ -2908,9 +3022,8 @@ bool AddToBlockIndex(const CBlock& block, CBlockIndex** pindex, const uint256 &h
     setDirtyBlockIndex.insert(pindexNew);
 
     // PoSV
-    if (pindexNew->IsProofOfStake()) {
-        setStakeSeen.insert(std::make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-    }
+    UpdateStakeSeenHorizon(Params());
+    AddStakeSeen(pindexNew);
 
     return true;
 }
@@ -3052,10 +3165,63 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
     return true;
 }
 
+/**
+ * PoW hashes of headers about to be validated, computed ahead in batches and
+ * keyed by block hash, so one scrypt run serves every check of the header.
+ */
+static CCriticalSection cs_PoWHashCache;
+static std::map<uint256, uint256> mapPoWHashCache;
+static std::deque<uint256> dequePoWHashCache; // insertion order, oldest first
+static const size_t MAX_POW_HASH_CACHE_SIZE = 4096;
+
+static void PrecomputePoWHashes(const std::vector<CBlockHeader>& vHeaders)
+{
+    std::vector<uint256> vHashes = GetPoWHashes(vHeaders);
+    LOCK(cs_PoWHashCache);
+    for (size_t i = 0; i < vHeaders.size(); i++) {
+        if (!mapPoWHashCache.emplace(vHeaders[i].GetHash(), vHashes[i]).second)
+            continue;
+        dequePoWHashCache.push_back(vHeaders[i].GetHash());
+        // Evict the oldest entry, rather than dropping the hashes of the
+        // batches still being validated
+        if (dequePoWHashCache.size() > MAX_POW_HASH_CACHE_SIZE) {
+            mapPoWHashCache.erase(dequePoWHashCache.front());
+            dequePoWHashCache.pop_front();
+        }
+    }
+}
+
+static bool HavePoWHash(const uint256& hash)
+{
+    LOCK(cs_PoWHashCache);
+    return mapPoWHashCache.count(hash) > 0;
+}
+
+static uint256 GetBlockPoWHash(const CBlockHeader& block)
+{
+    {
+        LOCK(cs_PoWHashCache);
+        std::map<uint256, uint256>::const_iterator it = mapPoWHashCache.find(block.GetHash());
+        if (it != mapPoWHashCache.end())
+            return it->second;
+    }
+    return block.GetPoWHash();
+}
+
+/** Keep the PoW hash of a header whose PoW CheckBlockHeader verified in the index */
+static void SetBlockPoWHash(CBlockIndex* pindex, const uint256& hashPoW)
+{
+    if (pindex->GetBlockTime() > CHECK_POW_FROM_NTIME || (pindex->nStatus & BLOCK_HAVE_POW_HASH))
+        return;
+    pindex->hashPoW = hashPoW;
+    pindex->nStatus |= BLOCK_HAVE_POW_HASH;
+    setDirtyBlockIndex.insert(pindex);
+}
+
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW)
 {
     // Check proof of work matches claimed amount
-    if (block.GetBlockTime() <= CHECK_POW_FROM_NTIME && fCheckPOW && !CheckProofOfWork(block.GetPoWHash(), block.nBits, consensusParams))
+    if (block.GetBlockTime() <= CHECK_POW_FROM_NTIME && fCheckPOW && !CheckProofOfWork(GetBlockPoWHash(block), block.nBits, consensusParams))
         return state.DoS(50, false, REJECT_INVALID, "high-hash", false, "proof of work failed");
 
     return true;
@@ -3435,13 +3601,15 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
             return error("%s: Consensus::ContextualCheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
     
         
-        hashProof = block.GetPoWHash();
+        hashProof = GetBlockPoWHash(block);
     }
     if (pindex == NULL) {
         pindex = new CBlockIndex(block);
         if (!AddToBlockIndex(block, &pindex, hashProof)) {
             return error("AcceptBlockHeader() : AddToBlockIndex failed");
         }
+        if (hash != chainparams.GetConsensus().hashGenesisBlock)
+            SetBlockPoWHash(pindex, hashProof);
     }
 
     if (ppindex)
@@ -3452,7 +3620,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
     return true;
 }
 
-static bool AcceptBlockHeader(const CBlock& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex)
+static bool AcceptBlockHeader(const CBlock& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fCheckStakeSignature = true)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -3497,7 +3665,7 @@ static bool AcceptBlockHeader(const CBlock& block, CValidationState& state, cons
         if (block.IsProofOfStake())
         {
             uint256 targetProofOfStake;
-            if (!CheckProofOfStake(block.vtx[1], block.nBits, hashProof, targetProofOfStake))
+            if (!CheckProofOfStake(block.vtx[1], block.nBits, hashProof, targetProofOfStake, fCheckStakeSignature))
             {
                 LogPrintf("WARNING: AcceptBlockHeader(): check proof-of-stake failed for block %s\n", hash.ToString().c_str());
                 return false; // do not error here as we expect this during initial block download
@@ -3506,7 +3674,7 @@ static bool AcceptBlockHeader(const CBlock& block, CValidationState& state, cons
         else if (block.IsProofOfWork())
         {
             // PoW is checked in CheckBlock()
-            hashProof = block.GetPoWHash();
+            hashProof = GetBlockPoWHash(block);
         }
     }
     if (pindex == NULL) {
@@ -3514,6 +3682,8 @@ static bool AcceptBlockHeader(const CBlock& block, CValidationState& state, cons
         if (!AddToBlockIndex(block, &pindex, hashProof)) {
             return error("AcceptBlockHeader() : AddToBlockIndex failed");
         }
+        if (hash != chainparams.GetConsensus().hashGenesisBlock && block.IsProofOfWork())
+            SetBlockPoWHash(pindex, hashProof);
     }
 
     if (ppindex)
@@ -3527,11 +3697,30 @@ static bool AcceptBlockHeader(const CBlock& block, CValidationState& state, cons
 // Exposed wrapper for AcceptBlockHeader
 bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, CValidationState& state, const CChainParams& chainparams, const CBlockIndex** ppindex)
 {
-    {
+    // Hash the PoW of the new headers a chunk of scrypt lanes at a time,
+    // outside cs_main, and accept each chunk before hashing the next, so a
+    // bad header costs at most one chunk of hashing
+    const size_t nChunk = std::max(1, scrypt_multi_lanes());
+    for (size_t nStart = 0; nStart < headers.size(); nStart += nChunk) {
+        const size_t nEnd = std::min(headers.size(), nStart + nChunk);
+        std::vector<CBlockHeader> vPoWHeaders;
+        {
+            LOCK(cs_main);
+            // Only batch a chunk that connects to a known header
+            if (mapBlockIndex.count(headers[nStart].hashPrevBlock)) {
+                for (size_t i = nStart; i < nEnd; i++) {
+                    if (headers[i].GetBlockTime() <= CHECK_POW_FROM_NTIME && !mapBlockIndex.count(headers[i].GetHash()))
+                        vPoWHeaders.push_back(headers[i]);
+                }
+            }
+        }
+        if (vPoWHeaders.size() > 1)
+            PrecomputePoWHashes(vPoWHeaders);
+
         LOCK(cs_main);
-        for (const CBlockHeader& header : headers) {
+        for (size_t i = nStart; i < nEnd; i++) {
             CBlockIndex *pindex = NULL; // Use a temp pindex instead of ppindex to avoid a const_cast
-            if (!AcceptBlockHeader(header, state, chainparams, &pindex)) {
+            if (!AcceptBlockHeader(headers[i], state, chainparams, &pindex)) {
                 return false;
             }
             if (ppindex) {
@@ -3544,7 +3733,7 @@ bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, CValidatio
 }
 
 /** Store block on disk. If dbp is non-NULL, the file is known to already reside on disk */
-static bool AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock)
+static bool AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock, bool fCheckStakeSignature = true)
 {
     const CBlock& block = *pblock;
 
@@ -3554,7 +3743,7 @@ static bool AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CValidation
     CBlockIndex *pindexDummy = NULL;
     CBlockIndex *&pindex = ppindex ? *ppindex : pindexDummy;
 
-    if (!AcceptBlockHeader(block, state, chainparams, &pindex)) {
+    if (!AcceptBlockHeader(block, state, chainparams, &pindex, fCheckStakeSignature)) {
         return false;
     }
 
@@ -3585,7 +3774,7 @@ static bool AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CValidation
     }
     if (fNewBlock) *fNewBlock = true;
 
-    if (!CheckBlock(block, state, chainparams.GetConsensus()) ||
+    if (!CheckBlock(block, state, chainparams.GetConsensus(), !(pindex->nStatus & BLOCK_HAVE_POW_HASH)) ||
         !ContextualCheckBlock(block, state, chainparams.GetConsensus(), pindex->pprev)) {
         if (state.IsInvalid() && !state.CorruptionPossible()) {
             pindex->nStatus |= BLOCK_FAILED_VALID;
@@ -3627,21 +3816,22 @@ static bool AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CValidation
     return true;
 }
 
-bool ProcessNewBlock(const CChainParams& chainparams, const std::shared_ptr<const CBlock> pblock, bool fForceProcessing, bool *fNewBlock)
+static bool ProcessNewBlock(const CChainParams& chainparams, const std::shared_ptr<const CBlock> pblock, bool fForceProcessing, bool *fNewBlock, bool fCheckStakeSignature)
 {
     {
         CBlockIndex *pindex = NULL;
         if (fNewBlock) *fNewBlock = false;
         CValidationState state;
         // Ensure that CheckBlock() passes before calling AcceptBlock, as
-        // belt-and-suspenders.
-        bool ret = CheckBlock(*pblock, state, chainparams.GetConsensus());
+        // belt-and-suspenders. Blocks whose signatures passed in a batch
+        // skip their block signature check.
+        bool ret = CheckBlock(*pblock, state, chainparams.GetConsensus(), true, true, fCheckStakeSignature);
 
         LOCK(cs_main);
 
         if (ret) {
             // Store to disk
-            ret = AcceptBlock(pblock, state, chainparams, &pindex, fForceProcessing, NULL, fNewBlock);
+            ret = AcceptBlock(pblock, state, chainparams, &pindex, fForceProcessing, NULL, fNewBlock, fCheckStakeSignature);
         }
         CheckBlockIndex(chainparams.GetConsensus());
         if (!ret) {
@@ -3659,6 +3849,73 @@ bool ProcessNewBlock(const CChainParams& chainparams, const std::shared_ptr<cons
     return true;
 }
 
+bool ProcessNewBlock(const CChainParams& chainparams, const std::shared_ptr<const CBlock> pblock, bool fForceProcessing, bool *fNewBlock)
+{
+    return ProcessNewBlock(chainparams, pblock, fForceProcessing, fNewBlock, true);
+}
+
+void CheckStakeSignatures(const std::vector<std::shared_ptr<const CBlock> >& vpblock, std::vector<bool>& vStakeChecked)
+{
+    vStakeChecked.assign(vpblock.size(), false);
+
+    // The kernel inputs only depend on blocks that are already connected, so
+    // they can all be looked up up front. The checks carry copies of what
+    // they verify, so they run without cs_main.
+    std::vector<CStakeCheck> vChecks;
+    std::vector<size_t> vCheckedBlocks;
+    {
+        LOCK(cs_main);
+        for (size_t i = 0; i < vpblock.size(); i++) {
+            const CBlock& block = *vpblock[i];
+            if (!block.IsProofOfStake() || block.vtx.size() < 2)
+                continue;
+            BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
+            if (mi != mapBlockIndex.end() && (mi->second->nStatus & (BLOCK_HAVE_DATA | BLOCK_FAILED_MASK)))
+                continue;
+            CStakeCheck check;
+            if (!GetProofOfStakeCheck(block.vtx[1], check))
+                continue; // checked again when the block is accepted
+            vChecks.push_back(CStakeCheck());
+            check.swap(vChecks.back());
+            vChecks.push_back(CStakeCheck(vpblock[i]));
+            vCheckedBlocks.push_back(i);
+        }
+    }
+    if (vChecks.empty())
+        return;
+
+    int64_t nTimeStart = GetTimeMicros();
+    CCheckQueueControl<CStakeCheck> control(&stakecheckqueue);
+    control.Add(vChecks);
+    // The queue only reports whether all checks passed; on failure every
+    // block of the run is checked again serially to find the bad one
+    if (control.Wait()) {
+        BOOST_FOREACH(size_t i, vCheckedBlocks)
+            vStakeChecked[i] = true;
+    }
+    LogPrint("bench", "    - Verify %u stake signatures: %.2fms\n", (unsigned)vChecks.size(), 0.001 * (GetTimeMicros() - nTimeStart));
+}
+
+bool ProcessNewBlocks(const CChainParams& chainparams, const std::vector<std::shared_ptr<const CBlock> >& vpblock, bool fForceProcessing, bool* fNewBlock)
+{
+    if (fNewBlock) *fNewBlock = false;
+
+    std::vector<bool> vStakeChecked(vpblock.size(), false);
+    if (nScriptCheckThreads)
+        CheckStakeSignatures(vpblock, vStakeChecked);
+
+    // Index bookkeeping and chain activation stay in block order
+    bool fOk = true;
+    for (size_t i = 0; i < vpblock.size(); i++) {
+        bool fNewBlockOne = false;
+        if (!ProcessNewBlock(chainparams, vpblock[i], fForceProcessing, &fNewBlockOne, !vStakeChecked[i]))
+            fOk = false;
+        if (fNewBlock && fNewBlockOne)
+            *fNewBlock = true;
+    }
+    return fOk;
+}
+
 bool TestBlockValidity(CValidationState& state, const CChainParams& chainparams, const CBlock& block, const CBlockIndex* pindexPrev, bool fCheckPOW, bool fCheckMerkleRoot)
 {
     AssertLockHeld(cs_main);
@@ -3889,6 +4146,9 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
+/** Number of headers hashed per batch by -reverifypow */
+static const size_t REVERIFY_POW_BATCH_SIZE = 1024;
+
 bool static LoadBlockIndexDB(const CChainParams& chainparams)
 {
     if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
@@ -3934,6 +4194,34 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
             pindexBestHeader = pindex;
     }
 
+    // Recompute the PoW hashes stored in the index, a batch of headers at a time
+    if (GetBoolArg("-reverifypow", DEFAULT_REVERIFY_POW)) {
+        std::vector<CBlockIndex*> vPoWIndex;
+        BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+        {
+            if (item.second->nStatus & BLOCK_HAVE_POW_HASH)
+                vPoWIndex.push_back(item.second);
+        }
+        LogPrintf("%s: verifying %u stored PoW hashes...\n", __func__, vPoWIndex.size());
+        for (size_t nBegin = 0; nBegin < vPoWIndex.size(); nBegin += REVERIFY_POW_BATCH_SIZE) {
+            boost::this_thread::interruption_point();
+            size_t nEnd = std::min(nBegin + REVERIFY_POW_BATCH_SIZE, vPoWIndex.size());
+            std::vector<CBlockHeader> vHeaders;
+            for (size_t i = nBegin; i < nEnd; i++)
+                vHeaders.push_back(vPoWIndex[i]->GetBlockHeader());
+            std::vector<uint256> vHashes = GetPoWHashes(vHeaders);
+            for (size_t i = nBegin; i < nEnd; i++) {
+                if (vHashes[i - nBegin] != vPoWIndex[i]->hashPoW)
+                    return error("%s: stored PoW hash does not match block %s", __func__, vPoWIndex[i]->GetBlockHash().ToString());
+            }
+        }
+    }
+
+    // PoSV: fill setStakeSeen with the stakes past the last checkpoint
+    UpdateStakeSeenHorizon(chainparams);
+    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+        AddStakeSeen(item.second);
+
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
     vinfoBlockFile.resize(nLastBlockFile + 1);
@@ -4052,7 +4340,7 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
         if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
             return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
         // check level 1: verify block validity
-        if (nCheckLevel >= 1 && !CheckBlock(block, state, chainparams.GetConsensus(), true, true, true, false))
+        if (nCheckLevel >= 1 && !CheckBlock(block, state, chainparams.GetConsensus(), !(pindex->nStatus & BLOCK_HAVE_POW_HASH), true, true, false))
             return error("%s: *** found bad block at %d, hash=%s (%s)\n", __func__,
                          pindex->nHeight, pindex->GetBlockHash().ToString(), FormatStateMessage(state));
         // check level 2: verify undo validity
@@ -4205,6 +4493,10 @@ void UnloadBlockIndex()
     setDirtyBlockIndex.clear();
     setDirtyFileInfo.clear();
     versionbitscache.Clear();
+    ClearNextWorkCache();
+    setStakeSeen.clear();
+    nStakeSeenHorizon = 0;
+    pindexStakeSeenCheckpoint = NULL;
     for (int b = 0; b < VERSIONBITS_NUM_BITS; b++) {
         warningcache[b].clear();
     }
@@ -4265,6 +4557,37 @@ bool InitBlockIndex(const CChainParams& chainparams)
     return true;
 }
 
+/**
+ * Hash the PoW of a PoW era block read from pos, together with that of the
+ * blocks stored right after it, so reindexing runs scrypt a batch at a time.
+ */
+static void PrecomputePoWHashesAhead(const CChainParams& chainparams, const CBlock& block, const CDiskBlockPos& pos, unsigned int nSize)
+{
+    std::vector<CBlockHeader> vHeaders(1, block.GetBlockHeader());
+    CAutoFile filein(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos + nSize), true), SER_DISK, CLIENT_VERSION);
+    if (!filein.IsNull()) {
+        try {
+            while (vHeaders.size() < (size_t)scrypt_multi_lanes()) {
+                unsigned char buf[CMessageHeader::MESSAGE_START_SIZE];
+                unsigned int nNextSize;
+                filein >> FLATDATA(buf) >> nNextSize;
+                if (memcmp(buf, chainparams.MessageStart(), CMessageHeader::MESSAGE_START_SIZE) || nNextSize < 80 || nNextSize > MAX_BLOCK_SERIALIZED_SIZE)
+                    break;
+                CBlockHeader header;
+                filein >> header;
+                if (header.GetBlockTime() > CHECK_POW_FROM_NTIME)
+                    break;
+                vHeaders.push_back(header);
+                if (fseek(filein.Get(), nNextSize - 80, SEEK_CUR))
+                    break;
+            }
+        } catch (const std::exception&) {
+            // end of the file, hash what was read
+        }
+    }
+    PrecomputePoWHashes(vHeaders);
+}
+
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
 {
     // Map of disk positions for blocks with unknown parent (only used for reindex)
@@ -4323,6 +4646,8 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
 
                 // process in case the block isn't known yet
                 if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+                    if (dbp && block.GetBlockTime() <= CHECK_POW_FROM_NTIME && !HavePoWHash(hash))
+                        PrecomputePoWHashesAhead(chainparams, block, *dbp, nSize);
                     LOCK(cs_main);
                     CValidationState state;
                     if (AcceptBlock(pblock, state, chainparams, NULL, true, dbp, NULL))
@@ -4727,18 +5052,26 @@ bool VerifySignature(const CTransactionRef& txFrom, const CTransactionRef& txTo,
     const CTxIn& txin = txTo->vin[nIn];
     if (txin.prevout.n >= txFrom->vout.size())
         return false;
-    const CTxOut& txout = txFrom->vout[txin.prevout.n];
 
     if (txin.prevout.hash != txFrom->GetHash())
         return false;
 
-    const CScriptWitness *witness = &txTo->vin[nIn].scriptWitness;
+    return VerifySignature(txFrom->vout[txin.prevout.n], txTo, nIn);
+}
+
+bool VerifySignature(const CTxOut& txout, const CTransactionRef& txTo, unsigned int nIn)
+{
+    assert(nIn < txTo->vin.size());
+    const CTxIn& txin = txTo->vin[nIn];
+    const CScriptWitness *witness = &txin.scriptWitness;
 
     const CTransaction& ctxTo = *txTo;
-    //const CTransaction& ctxFrom = *txFrom;
-    
+
+    // Coinstake signatures are checked again by ConnectBlock, so remember
+    // the valid ones
+    PrecomputedTransactionData txdata(ctxTo);
     return VerifyScript(txin.scriptSig, txout.scriptPubKey, witness, (SCRIPT_VERIFY_P2SH), 
-        TransactionSignatureChecker(&ctxTo, nIn, txFrom->vout[txTo->vin[nIn].prevout.n].nValue), NULL);
+        CachingTransactionSignatureChecker(&ctxTo, nIn, txout.nValue, true, txdata), NULL);
 }
 
 // PoSV
@@ -4763,7 +5096,9 @@ bool CheckBlockSignature(const CBlock& block)
             return false;
         }
 
-        return pubKey.Verify(block.GetHash(), block.vchBlockSig);
+        // The same block is checked on receipt, when it is connected and
+        // when it is read back from disk, so remember valid signatures
+        return CachedVerifySignature(pubKey, block.GetHash(), block.vchBlockSig, true);
     }
 
     return false;
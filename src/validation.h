@@ -36,9 +36,11 @@ class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
 class CChainParams;
+class CCoinsViewFlushBuffer;
 class CInv;
 class CConnman;
 class CScriptCheck;
+class CStakeSeenSet;
 class CTxMemPool;
 class CValidationInterface;
 class CValidationState;
@@ -192,7 +194,7 @@ extern uint256 hashAssumeValid;
 extern CBlockIndex *pindexBestHeader;
 
 // Reddcoin PoSV
-extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
+extern CStakeSeenSet setStakeSeen;
 extern const int64_t nTargetSpacing;
 extern int64_t nLastCoinStakeSearchInterval;
 extern int64_t nReserveBalance;
@@ -212,6 +214,8 @@ static const unsigned int MIN_BLOCKS_TO_KEEP = 288;
 
 static const signed int DEFAULT_CHECKBLOCKS = 6 * 4;
 static const unsigned int DEFAULT_CHECKLEVEL = 3;
+/** Default for -reverifypow */
+static const bool DEFAULT_REVERIFY_POW = false;
 
 // Require that user allocate at least 550MB for block & undo files (blk???.dat and rev???.dat)
 // At 1MB per block, 288 blocks = 288MB.
@@ -244,6 +248,33 @@ static const uint64_t MIN_DISK_SPACE_FOR_BLOCK_FILES = 550 * 1024 * 1024;
  */
 bool ProcessNewBlock(const CChainParams& chainparams, const std::shared_ptr<const CBlock> pblock, bool fForceProcessing, bool* fNewBlock);
 
+/**
+ * Process a run of new blocks, as ProcessNewBlock does for each of them in
+ * order. The coinstake and block signatures of the run are verified on the
+ * stake check threads first, so only the kernel checks and the block index
+ * updates are done serially.
+ *
+ * Call without cs_main held.
+ *
+ * @param[in]   vpblock The blocks we want to process, parents first.
+ * @param[in]   fForceProcessing Process these blocks even if unrequested.
+ * @param[out]  fNewBlock Set if any of the blocks was first received via this call
+ * @return True if every block was processed successfully
+ */
+bool ProcessNewBlocks(const CChainParams& chainparams, const std::vector<std::shared_ptr<const CBlock> >& vpblock, bool fForceProcessing, bool* fNewBlock);
+
+/**
+ * Verify the coinstake and block signatures of a run of proof-of-stake blocks
+ * on the stake check threads. Blocks already stored are left out, but blocks
+ * whose header alone is indexed, as in headers first download, are checked.
+ * Valid signatures are stored in the signature cache, where ConnectBlock
+ * finds them.
+ *
+ * @param[in]   vpblock The blocks to check.
+ * @param[out]  vStakeChecked Set for each block whose signatures were all verified.
+ */
+void CheckStakeSignatures(const std::vector<std::shared_ptr<const CBlock> >& vpblock, std::vector<bool>& vStakeChecked);
+
 /**
  * Process incoming block headers.
  *
@@ -274,6 +305,10 @@ bool LoadBlockIndex(const CChainParams& chainparams);
 void UnloadBlockIndex();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the coinstake signature checking thread */
+void ThreadStakeCheck();
+/** Run an instance of the block input prefetching thread */
+void ThreadCoinsPrefetch();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core.
@@ -333,6 +368,7 @@ void PruneBlockFilesManual(int nPruneUpToHeight);
 
 /** Verify a signature */
 bool VerifySignature(const CTransactionRef& txFrom, const CTransactionRef& txTo, unsigned int nIn);
+bool VerifySignature(const CTxOut& txout, const CTransactionRef& txTo, unsigned int nIn);
 
 /** (try to) add transaction to memory pool
  * plTxnReplaced will be appended to with all transactions replaced from mempool **/
@@ -467,8 +503,8 @@ private:
 
 public:
     CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey), amount(txFromIn.vout[txToIn.vin[nInIn].prevout.n].nValue),
+    CScriptCheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn) :
+        scriptPubKey(outIn.scriptPubKey), amount(outIn.nValue),
         ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
     
     bool operator()();
@@ -487,6 +523,37 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * Closure reading a slice of the coins spent by a block from the view
+ * backing pcoinsTip, ahead of ConnectBlock. Each coin is written to the
+ * matching slot of a vector owned by the caller, and left spent if the view
+ * does not have it.
+ */
+class CCoinsPrefetch
+{
+private:
+    const CCoinsView *pview;
+    const std::vector<COutPoint> *pvOutPoints;
+    std::vector<Coin> *pvCoins;
+    size_t nBegin;
+    size_t nEnd;
+
+public:
+    CCoinsPrefetch(): pview(NULL), pvOutPoints(NULL), pvCoins(NULL), nBegin(0), nEnd(0) {}
+    CCoinsPrefetch(const CCoinsView* pviewIn, const std::vector<COutPoint>* pvOutPointsIn, std::vector<Coin>* pvCoinsIn, size_t nBeginIn, size_t nEndIn) :
+        pview(pviewIn), pvOutPoints(pvOutPointsIn), pvCoins(pvCoinsIn), nBegin(nBeginIn), nEnd(nEndIn) { }
+
+    bool operator()();
+
+    void swap(CCoinsPrefetch &check) {
+        std::swap(pview, check.pview);
+        std::swap(pvOutPoints, check.pvOutPoints);
+        std::swap(pvCoins, check.pvCoins);
+        std::swap(nBegin, check.nBegin);
+        std::swap(nEnd, check.nEnd);
+    }
+};
+
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
@@ -558,6 +625,9 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** The view backing pcoinsTip that commits its flushes in the background, if any (protected by cs_main) */
+extern CCoinsViewFlushBuffer *pcoinsFlushBuffer;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
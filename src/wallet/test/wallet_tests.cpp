@@ -9,9 +9,15 @@
 #include <utility>
 #include <vector>
 
+#include "arith_uint256.h"
+#include "chainparams.h"
+#include "consensus/consensus.h"
+#include "kernel.h"
+#include "miner.h"
 #include "rpc/server.h"
 #include "test/test_bitcoin.h"
 #include "validation.h"
+#include "validationinterface.h"
 #include "wallet/test/wallet_test_fixture.h"
 
 #include <boost/foreach.hpp>
@@ -490,4 +496,214 @@ BOOST_FIXTURE_TEST_CASE(importwallet_rescan, TestChain100Setup)
     ::pwalletMain = pwalletMainBackup;
 }
 
+// Stake weight of an output as GetStakeWeight counts it at nTime
+static uint64_t StakeCoinWeight(const CTransaction& tx, int64_t nTime)
+{
+    int64_t nTimeWeight = GetCoinAgeWeight(tx.nTime, nTime);
+    return ArithToUint256(arith_uint256(tx.vout[0].nValue) * nTimeWeight / COIN / (24 * 60 * 60)).GetUint64(0);
+}
+
+// A script paying to a new key of the wallet
+static CScript NewStakeScript()
+{
+    CKey key;
+    key.MakeNewKey(true);
+    pwalletMain->AddKeyPubKey(key, key.GetPubKey());
+    return GetScriptForDestination(key.GetPubKey().GetID());
+}
+
+// Load a wallet transaction confirmed in index with a single output of nValue
+static CTransaction AddStakeOutput(const CBlockIndex& index, int n, CAmount nValue, const CScript& scriptPubKey)
+{
+    CMutableTransaction tx;
+    tx.nTime = index.nTime;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(ArithToUint256(n + 1), 0);
+    tx.vout.push_back(CTxOut(nValue, scriptPubKey));
+    CWalletTx wtx(pwalletMain, MakeTransactionRef(tx));
+    wtx.hashBlock = index.GetBlockHash();
+    wtx.nIndex = 1;
+    pwalletMain->LoadToWallet(wtx);
+    return CTransaction(tx);
+}
+
+BOOST_AUTO_TEST_CASE(stake_weight)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    // A chain of one minute blocks ending now
+    const int64_t nNow = 1500000000;
+    SetMockTime(nNow);
+    const int nChainLength = 1000;
+    TestBlockIndexChain chain(nChainLength, nNow - (nChainLength - 1) * 60);
+    std::vector<CBlockIndex>& vIndex = chain.vIndex;
+
+    // Outputs of 100 to 1000 coins, confirmed from well past the min age up
+    // to the tip, so that only some of them weigh
+    CScript scriptPubKey = NewStakeScript();
+    std::vector<CTransaction> vtx;
+    for (int i = 0; i < 10; i++)
+        vtx.push_back(AddStakeOutput(vIndex[50 + i * 100], i, (i + 1) * 100 * COIN, scriptPubKey));
+    pwalletMain->BuildStakeKernelCache();
+
+    uint64_t nExpected = 0, nCount = 0;
+    for (const CTransaction& tx : vtx) {
+        if (GetCoinAgeWeight(tx.nTime, nNow) > 0) {
+            nExpected += StakeCoinWeight(tx, nNow);
+            nCount++;
+        }
+    }
+    BOOST_CHECK(nCount > 0 && nCount < vtx.size());
+
+    uint64_t nAverageWeight = 0, nTotalWeight = 0;
+    BOOST_CHECK(pwalletMain->GetStakeWeight(nAverageWeight, nTotalWeight));
+    BOOST_CHECK_EQUAL(nTotalWeight, nExpected);
+    BOOST_CHECK_EQUAL(nAverageWeight, nExpected / nCount);
+
+    // Spending an output takes its weight back right away
+    CMutableTransaction txSpend;
+    txSpend.nTime = nNow;
+    txSpend.vin.push_back(CTxIn(vtx[0].GetHash(), 0));
+    txSpend.vout.push_back(CTxOut(vtx[0].vout[0].nValue, CScript() << OP_TRUE));
+    pwalletMain->SyncTransaction(txSpend, NULL, CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK);
+    nExpected -= StakeCoinWeight(vtx[0], nNow);
+    nCount--;
+    BOOST_CHECK(pwalletMain->GetStakeWeight(nAverageWeight, nTotalWeight));
+    BOOST_CHECK_EQUAL(nTotalWeight, nExpected);
+
+    // as does disconnecting the block of an output
+    pwalletMain->SyncTransaction(vtx[1], NULL, CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK);
+    nExpected -= StakeCoinWeight(vtx[1], nNow);
+    nCount--;
+    BOOST_CHECK(pwalletMain->GetStakeWeight(nAverageWeight, nTotalWeight));
+    BOOST_CHECK_EQUAL(nTotalWeight, nExpected);
+    BOOST_CHECK_EQUAL(nAverageWeight, nExpected / nCount);
+
+    // Locked outputs do not weigh
+    pwalletMain->LockCoin(COutPoint(vtx[2].GetHash(), 0));
+    BOOST_CHECK(pwalletMain->GetStakeWeight(nAverageWeight, nTotalWeight));
+    BOOST_CHECK_EQUAL(nTotalWeight, nExpected - StakeCoinWeight(vtx[2], nNow));
+    pwalletMain->UnlockCoin(COutPoint(vtx[2].GetHash(), 0));
+
+    // A later interval reweighs every output as it has aged; the newest one
+    // is past the min age by then, but still not deep enough
+    int64_t nLater = nNow + 6 * 60 * 60;
+    SetMockTime(nLater);
+    nExpected = 0;
+    for (size_t i = 2; i < vtx.size() - 1; i++)
+        nExpected += StakeCoinWeight(vtx[i], nLater);
+    BOOST_CHECK(pwalletMain->GetStakeWeight(nAverageWeight, nTotalWeight));
+    BOOST_CHECK_EQUAL(nTotalWeight, nExpected);
+
+    // A new tip that buries the newest output deep enough reweighs it
+    // within the same interval
+    CBlockIndex indexTip;
+    indexTip.nHeight = nChainLength - 1 + COINBASE_MATURITY + 20;
+    pwalletMain->UpdatedBlockTip(&indexTip, NULL, false);
+    nExpected += StakeCoinWeight(vtx.back(), nLater);
+    BOOST_CHECK(pwalletMain->GetStakeWeight(nAverageWeight, nTotalWeight));
+    BOOST_CHECK_EQUAL(nTotalWeight, nExpected);
+
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(stake_coin_selection)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    // A chain of one minute blocks ending now
+    const int64_t nNow = 1500000000;
+    SetMockTime(nNow);
+    const int nChainLength = 1000;
+    TestBlockIndexChain chain(nChainLength, nNow - (nChainLength - 1) * 60);
+    std::vector<CBlockIndex>& vIndex = chain.vIndex;
+
+    // Outputs confirmed in reverse order of their heights, so that the
+    // wallet holds them in neither maturity nor hash order
+    CScript scriptPubKey = NewStakeScript();
+    std::vector<CTransaction> vtx;
+    std::vector<int> vHeight;
+    for (int i = 0; i < 10; i++) {
+        vHeight.push_back(950 - i * 100);
+        vtx.push_back(AddStakeOutput(vIndex[vHeight.back()], i, (i + 1) * COIN, scriptPubKey));
+    }
+    pwalletMain->BuildStakeKernelCache();
+    BOOST_CHECK_EQUAL(pwalletMain->GetStakeMaturityTime(), vIndex[50].nTime + Params().StakeMinAge());
+
+    // Coins are selected once they are past the min age and deep enough
+    const int nMinConf = COINBASE_MATURITY + 20;
+    const int64_t vSpendTime[] = {nNow - 6 * 60 * 60, nNow, nNow + 6 * 60 * 60};
+    for (int64_t nSpendTime : vSpendTime) {
+        std::set<std::pair<const CWalletTx*, unsigned int> > setExpected;
+        for (size_t i = 0; i < vtx.size(); i++) {
+            if (vIndex[vHeight[i]].nTime + Params().StakeMinAge() <= nSpendTime && nChainLength - vHeight[i] >= nMinConf)
+                setExpected.insert(std::make_pair(pwalletMain->GetWalletTx(vtx[i].GetHash()), 0));
+        }
+        std::set<std::pair<const CWalletTx*, unsigned int> > setCoins;
+        int64_t nValue = 0;
+        BOOST_CHECK(pwalletMain->SelectStakeCoins(setCoins, nValue, nSpendTime, nMinConf));
+        BOOST_CHECK(setCoins == setExpected);
+    }
+
+    // Spending the earliest maturing output moves the next maturity on
+    CMutableTransaction txSpend;
+    txSpend.nTime = nNow;
+    txSpend.vin.push_back(CTxIn(vtx.back().GetHash(), 0));
+    txSpend.vout.push_back(CTxOut(vtx.back().vout[0].nValue, CScript() << OP_TRUE));
+    pwalletMain->SyncTransaction(txSpend, NULL, CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK);
+    BOOST_CHECK_EQUAL(pwalletMain->GetStakeMaturityTime(), vIndex[150].nTime + Params().StakeMinAge());
+
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(stake_reserve_balance)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    // A chain of one minute blocks ending now
+    const int64_t nNow = 1500000000;
+    SetMockTime(nNow);
+    const int nChainLength = 1000;
+    TestBlockIndexChain chain(nChainLength, nNow - (nChainLength - 1) * 60);
+    std::vector<CBlockIndex>& vIndex = chain.vIndex;
+
+    // 600 coins that can stake, and as many again not deep enough to stake
+    // yet and locked
+    CScript scriptPubKey = NewStakeScript();
+    AddStakeOutput(vIndex[50], 0, 100 * COIN, scriptPubKey);
+    AddStakeOutput(vIndex[150], 1, 500 * COIN, scriptPubKey);
+    AddStakeOutput(vIndex[nChainLength - 10], 2, 1000 * COIN, scriptPubKey);
+    CTransaction txLocked = AddStakeOutput(vIndex[100], 3, 1000 * COIN, scriptPubKey);
+    pwalletMain->LockCoin(COutPoint(txLocked.GetHash(), 0));
+    pwalletMain->BuildStakeKernelCache();
+
+    // Keeping 500 coins in reserve leaves only the oldest output to stake. A
+    // hash target no kernel meets makes the search go through all selected
+    // coins.
+    const int64_t nReserveBalancePrev = nReserveBalance;
+    nReserveBalance = 500 * COIN;
+    uint64_t nAverageWeight = 0, nTotalWeight = 0;
+    BOOST_CHECK(pwalletMain->GetStakeWeight(nAverageWeight, nTotalWeight));
+    CMutableTransaction txCoinStake;
+    txCoinStake.nTime = nNow;
+    CKey key;
+    BOOST_CHECK(!pwalletMain->CreateCoinStake(0x03000001, 1, 0, txCoinStake, key));
+    {
+        LOCK(cs_stakerStats);
+        BOOST_CHECK_EQUAL(stakerStats.nLastCandidates, 1U);
+    }
+
+    // Reserving all of it stakes nothing
+    nReserveBalance = 600 * COIN;
+    BOOST_CHECK(!pwalletMain->GetStakeWeight(nAverageWeight, nTotalWeight));
+
+    nReserveBalance = nReserveBalancePrev;
+
+    // Unlocking a coin tells the staker to search its window again
+    unsigned int nGeneration = pwalletMain->GetStakeGeneration();
+    pwalletMain->UnlockCoin(COutPoint(txLocked.GetHash(), 0));
+    BOOST_CHECK(pwalletMain->GetStakeGeneration() != nGeneration);
+    SetMockTime(0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
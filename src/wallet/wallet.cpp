@@ -14,6 +14,7 @@
 #include "consensus/validation.h"
 #include "key.h"
 #include "keystore.h"
+#include "miner.h"
 #include "net.h"
 #include "policy/policy.h"
 #include "primitives/block.h"
@@ -327,8 +328,10 @@ bool CWallet::Unlock(const SecureString& strWalletPassphrase)
                 return false;
             if (!crypter.Decrypt(pMasterKey.second.vchCryptedKey, vMasterKey))
                 continue; // try another master key
-            if (CCryptoKeyStore::Unlock(vMasterKey))
+            if (CCryptoKeyStore::Unlock(vMasterKey)) {
+                nStakeGeneration++; // the staker can sign again
                 return true;
+            }
         }
     }
     return false;
@@ -1129,6 +1132,7 @@ bool CWallet::AbandonTransaction(const uint256& hashTx)
             wtx.MarkDirty();
             walletdb.WriteTx(wtx);
             NotifyTransactionChanged(this, wtx.GetHash(), CT_UPDATED);
+            RestoreStakeKernels(wtx);
             // Iterate over all its outputs, and mark transactions in the wallet that spend them abandoned too
             TxSpends::const_iterator iter = mapTxSpends.lower_bound(COutPoint(hashTx, 0));
             while (iter != mapTxSpends.end() && iter->first.hash == now) {
@@ -1190,6 +1194,7 @@ void CWallet::MarkConflicted(const uint256& hashBlock, const uint256& hashTx)
             wtx.hashBlock = hashBlock;
             wtx.MarkDirty();
             walletdb.WriteTx(wtx);
+            RestoreStakeKernels(wtx);
             // Iterate over all its outputs, and mark transactions in the wallet that spend them conflicted too
             TxSpends::const_iterator iter = mapTxSpends.lower_bound(COutPoint(now, 0));
             while (iter != mapTxSpends.end() && iter->first.hash == now) {
@@ -1216,6 +1221,8 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlockIndex *pindex,
     if (!AddToWalletIfInvolvingMe(tx, pindex, posInBlock, true))
         return; // Not one of ours
 
+    UpdateStakeKernelCache(tx, pindex, posInBlock);
+
     // If a transaction changes 'conflicted' state, that changes the balance
     // available of the outputs it spends. So force those to be
     // recomputed, also:
@@ -1226,6 +1233,182 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlockIndex *pindex,
     }
 }
 
+void CWallet::UpdateStakeKernelCache(const CTransaction& tx, const CBlockIndex* pindex, int posInBlock)
+{
+    AssertLockHeld(cs_wallet);
+
+    // Spent outputs can no longer stake
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        EraseStakeKernel(txin.prevout);
+
+    const uint256& hash = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        COutPoint outpoint(hash, i);
+        if (posInBlock == CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK || !pindex)
+            EraseStakeKernel(outpoint); // unconfirmed or disconnected
+        else if (IsMine(tx.vout[i]) & ISMINE_SPENDABLE)
+            AddStakeKernel(outpoint, CStakeKernelContext(pindex, i, tx.nTime, tx.vout[i].nValue));
+    }
+}
+
+// Time from which an output can stake
+static unsigned int StakeKernelMaturity(const CStakeKernelContext& kernel)
+{
+    return kernel.nTimeBlockFrom + Params().StakeMinAge();
+}
+
+void CWallet::AddStakeKernel(const COutPoint& outpoint, const CStakeKernelContext& kernel)
+{
+    AssertLockHeld(cs_wallet);
+    EraseStakeKernel(outpoint);
+    mapStakeKernelCache.insert(std::make_pair(outpoint, kernel));
+    setStakeKernelMaturity.insert(std::make_pair(StakeKernelMaturity(kernel), outpoint));
+    WeighStakeKernel(outpoint, kernel, true);
+    nStakeGeneration++;
+}
+
+void CWallet::EraseStakeKernel(const COutPoint& outpoint)
+{
+    AssertLockHeld(cs_wallet);
+    std::map<COutPoint, CStakeKernelContext>::iterator it = mapStakeKernelCache.find(outpoint);
+    if (it == mapStakeKernelCache.end())
+        return;
+    WeighStakeKernel(outpoint, it->second, false);
+    setStakeKernelMaturity.erase(std::make_pair(StakeKernelMaturity(it->second), outpoint));
+    mapStakeKernelCache.erase(it);
+}
+
+// Outputs spent by an abandoned or conflicted transaction can stake again
+void CWallet::RestoreStakeKernels(const CWalletTx& wtx)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    BOOST_FOREACH(const CTxIn& txin, wtx.tx->vin)
+    {
+        std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(txin.prevout.hash);
+        if (mi == mapWallet.end() || txin.prevout.n >= mi->second.tx->vout.size() || IsSpent(txin.prevout.hash, txin.prevout.n))
+            continue;
+        if (!(IsMine(mi->second.tx->vout[txin.prevout.n]) & ISMINE_SPENDABLE))
+            continue;
+        CStakeKernelContext kernel;
+        GetStakeKernelContext(mi->second, txin.prevout.n, kernel);
+    }
+}
+
+void CWallet::BuildStakeKernelCache()
+{
+    LOCK2(cs_main, cs_wallet);
+    mapStakeKernelCache.clear();
+    setStakeKernelMaturity.clear();
+    nStakeWeightTime = 0;
+    nStakeTipHeight = chainActive.Height();
+    for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    {
+        const CWalletTx& wtx = it->second;
+        const CBlockIndex* pindex = NULL;
+        if (wtx.GetDepthInMainChain(pindex) <= 0)
+            continue;
+        for (unsigned int i = 0; i < wtx.tx->vout.size(); i++)
+        {
+            const CTxOut& txout = wtx.tx->vout[i];
+            if (txout.nValue > 0 && !IsSpent(it->first, i) && (IsMine(txout) & ISMINE_SPENDABLE))
+                AddStakeKernel(COutPoint(it->first, i), CStakeKernelContext(pindex, i, wtx.tx->nTime, txout.nValue));
+        }
+    }
+}
+
+unsigned int CWallet::GetStakeMaturityTime() const
+{
+    LOCK(cs_wallet);
+    return setStakeKernelMaturity.empty() ? 0 : setStakeKernelMaturity.begin()->first;
+}
+
+// Add or take back the weight of a cached output under the current weighing.
+// Outputs count once they are as deep as staking requires, unlocked and
+// past the min age, as in the coin selection of CreateCoinStake.
+void CWallet::WeighStakeKernel(const COutPoint& outpoint, const CStakeKernelContext& kernel, bool fAdd)
+{
+    if (!nStakeWeightTime)
+        return; // reweighed from scratch on the next query
+
+    if (nStakeWeightHeight - kernel.pindexFrom->nHeight + 1 < COINBASE_MATURITY + 20)
+        return;
+    if (IsLockedCoin(outpoint.hash, outpoint.n))
+        return;
+    nStakeWeightValue += fAdd ? kernel.nValue : -kernel.nValue;
+
+    int64_t nTimeWeight = GetCoinAgeWeight((int64_t)kernel.nTimeTxPrev, nStakeWeightTime);
+    if (nTimeWeight <= 0)
+        return;
+    arith_uint256 bnCoinDayWeight = arith_uint256(kernel.nValue) * nTimeWeight / COIN / (24 * 60 * 60);
+    uint64_t nWeight = ArithToUint256(bnCoinDayWeight).GetUint64(0);
+
+    if (fAdd)
+    {
+        nStakeWeightTotal += nWeight;
+        nStakeWeightCount++;
+    }
+    else
+    {
+        nStakeWeightTotal -= nWeight;
+        nStakeWeightCount--;
+    }
+}
+
+// Reweigh all cached outputs when the weighing is older than its interval,
+// or was made on another tip, where other outputs were deep enough to stake
+void CWallet::UpdateStakeWeight(int64_t nTime)
+{
+    AssertLockHeld(cs_wallet);
+    if (nStakeWeightTime && nStakeWeightTime / STAKE_WEIGHT_INTERVAL == nTime / STAKE_WEIGHT_INTERVAL &&
+        nStakeWeightHeight == nStakeTipHeight)
+        return;
+
+    nStakeWeightTime = nTime;
+    nStakeWeightHeight = nStakeTipHeight;
+    nStakeWeightTotal = nStakeWeightCount = 0;
+    nStakeWeightValue = 0;
+    for (std::map<COutPoint, CStakeKernelContext>::const_iterator it = mapStakeKernelCache.begin(); it != mapStakeKernelCache.end(); ++it)
+        WeighStakeKernel(it->first, it->second, true);
+}
+
+void CWallet::UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload)
+{
+    LOCK(cs_wallet);
+    nStakeTipHeight = pindexNew->nHeight;
+}
+
+bool CWallet::GetStakeKernelContext(const CWalletTx& wtx, unsigned int n, CStakeKernelContext& kernel)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    COutPoint outpoint(wtx.GetHash(), n);
+    std::map<COutPoint, CStakeKernelContext>::iterator it = mapStakeKernelCache.find(outpoint);
+    if (it != mapStakeKernelCache.end() && !chainActive.Contains(it->second.pindexFrom))
+    {
+        // the confirming block was reorganized away without us being told
+        EraseStakeKernel(outpoint);
+        it = mapStakeKernelCache.end();
+    }
+    if (it == mapStakeKernelCache.end())
+    {
+        // not seen confirming since startup, fill from the wallet copy
+        BlockMap::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+        if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second) || n >= wtx.tx->vout.size())
+            return false;
+        AddStakeKernel(outpoint, CStakeKernelContext(mi->second, n, wtx.tx->nTime, wtx.tx->vout[n].nValue));
+        it = mapStakeKernelCache.find(outpoint);
+    }
+
+    // Resolve the modifier in place so later searches reuse it; it stays
+    // unresolved until the chain is a selection interval past the coin
+    ResolveKernelStakeModifier(it->second, fDebug);
+
+    kernel = it->second;
+    return true;
+}
 
 isminetype CWallet::IsMine(const CTxIn &txin) const
 {
@@ -1625,6 +1808,7 @@ CBlockIndex* CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool f
         }
         ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     }
+    BuildStakeKernelCache();
     return ret;
 }
 
@@ -2408,27 +2592,40 @@ bool CWallet::SelectCoins(const vector<COutput>& vAvailableCoins, const CAmount&
     return res;
 }
 
-// PoSV: Select some coins without random shuffle or best subset approximation
+// PoSV: Select some coins without random shuffle or best subset approximation,
+// from those of the stake kernel cache past the min age at nSpendTime
 bool CWallet::SelectCoinsSimple(int64_t nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, unsigned int nSpendTime, int nMinConf) const
 {
-    vector<COutput> vCoins;
-    AvailableCoinsMinConf(vCoins, nMinConf);
-
     setCoinsRet.clear();
     nValueRet = 0;
 
-    BOOST_FOREACH(COutput output, vCoins)
+    LOCK2(cs_main, cs_wallet);
+    std::set<std::pair<unsigned int, COutPoint> >::const_iterator itEnd = setStakeKernelMaturity.lower_bound(std::make_pair(nSpendTime + 1, COutPoint(uint256(), 0)));
+    for (std::set<std::pair<unsigned int, COutPoint> >::const_iterator it = setStakeKernelMaturity.begin(); it != itEnd; ++it)
     {
-        const CWalletTx *pcoin = output.tx;
-        int i = output.i;
-
         // Stop if we've chosen enough inputs
         if (nValueRet >= nTargetValue)
             break;
 
-        int64_t n = pcoin->tx->vout[i].nValue;
+        const COutPoint& outpoint = it->second;
+        const CStakeKernelContext& kernel = mapStakeKernelCache.find(outpoint)->second;
+        if (!chainActive.Contains(kernel.pindexFrom) || chainActive.Height() - kernel.pindexFrom->nHeight + 1 < nMinConf)
+            continue;
+
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+        if (mi == mapWallet.end())
+            continue;
+        const CWalletTx *pcoin = &mi->second;
+        if (!IsFinalTx(*pcoin->tx, chainActive.Height() + 1, GetAdjustedTime()))
+            continue;
+        if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
+            continue;
+        if (IsSpent(outpoint.hash, outpoint.n) || IsLockedCoin(outpoint.hash, outpoint.n) || pcoin->tx->vout[outpoint.n].nValue <= 0)
+            continue;
+
+        int64_t n = pcoin->tx->vout[outpoint.n].nValue;
 
-        pair<int64_t,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, i));
+        pair<int64_t,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, outpoint.n));
 
         if (n >= nTargetValue)
         {
@@ -2448,6 +2645,11 @@ bool CWallet::SelectCoinsSimple(int64_t nTargetValue, set<pair<const CWalletTx*,
     return true;
 }
 
+bool CWallet::SelectStakeCoins(set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, unsigned int nSpendTime, int nMinConf) const
+{
+    return SelectCoinsSimple(MAX_MONEY, setCoinsRet, nValueRet, nSpendTime, nMinConf);
+}
+
 bool CWallet::FundTransaction(CMutableTransaction& tx, CAmount& nFeeRet, bool overrideEstimatedFeeRate, const CFeeRate& specificFeeRate, int& nChangePosInOut, std::string& strFailReason, bool includeWatching, bool lockUnspents, const std::set<int>& setSubtractFeeFromOutputs, bool keepReserveKey, const CTxDestination& destChange)
 {
     vector<CRecipient> vecSend;
@@ -2883,62 +3085,19 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend, CWalletTx& wt
 
 bool CWallet::GetStakeWeight(uint64_t& nAverageWeight, uint64_t& nTotalWeight)
 {
-    // Choose coins to use
-    int64_t nBalance = GetBalance();
-
-    if (nBalance <= nReserveBalance)
-        return false;
-
-    vector<const CWalletTx*> vwtxPrev;
-
-    set<pair<const CWalletTx*,unsigned int> > setCoins;
-    int64_t nValueIn = 0;
-
-    if (!SelectCoinsSimple(nBalance - nReserveBalance, setCoins, nValueIn, GetTime(), COINBASE_MATURITY+20))
-        return false;
+    LOCK(cs_wallet);
+    UpdateStakeWeight(GetTime());
 
-    if (setCoins.empty())
+    if (mapStakeKernelCache.empty() || nStakeWeightValue <= nReserveBalance)
         return false;
 
-    nAverageWeight = nTotalWeight = 0;
-    uint64_t nWeightCount = 0;
-
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
-    {
-        CTransactionRef ctx;
-        uint256 hashBlock;
-        {
-            LOCK2(cs_main, cs_wallet);
-            if (!GetTransaction(pcoin.first->GetHash(), ctx, Params().GetConsensus(), hashBlock, true))
-                continue;
-            if (!mapBlockIndex.count(hashBlock))
-                continue;
-        }
-
-        // Deal with transaction timestmap
-        unsigned int nTimeTx = ctx->nTime ? ctx->nTime : mapBlockIndex[hashBlock]->nTime;
-
-        int64_t nTimeWeight = GetCoinAgeWeight((int64_t)nTimeTx, (int64_t)GetTime());
-        arith_uint256 bnCoinDayWeight = arith_uint256(pcoin.first->tx->vout[pcoin.second].nValue) * nTimeWeight / COIN / (24 * 60 * 60);
-
-        // Weight is greater than zero
-        if (nTimeWeight > 0)
-        {
-            nTotalWeight += ArithToUint256(bnCoinDayWeight).GetUint64(0);
-            nWeightCount++;
-        }
-    }
-
-    if (nWeightCount > 0)
-        nAverageWeight = nTotalWeight / nWeightCount;
-
+    nTotalWeight = nStakeWeightTotal;
+    nAverageWeight = nStakeWeightCount > 0 ? nStakeWeightTotal / nStakeWeightCount : 0;
     return true;
 }
 
-bool CWallet::CreateCoinStake(unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CMutableTransaction& txNew, CKey& key)
+bool CWallet::CreateCoinStake(unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CMutableTransaction& txNew, CKey& key, const std::atomic<bool>* pfCancel)
 {
-    CBlockIndex* pindexBest = chainActive.Tip();
-    CBlockIndex* pindexPrev = pindexBest;
     arith_uint256 bnTargetPerCoinDay;
     bnTargetPerCoinDay.SetCompact(nBits);
 
@@ -2950,8 +3109,14 @@ bool CWallet::CreateCoinStake(unsigned int nBits, int64_t nSearchInterval, int64
     scriptEmpty.clear();
     txNew.vout.push_back(CTxOut(0, scriptEmpty));
 
-    // Choose coins to use
-    int64_t nBalance = GetBalance();
+    // Choose coins to use, out of the value of the outputs deep enough to
+    // stake, so that immature and locked ones do not count toward the reserve
+    int64_t nBalance;
+    {
+        LOCK(cs_wallet);
+        UpdateStakeWeight(GetTime());
+        nBalance = nStakeWeightValue;
+    }
 
     if (nBalance <= nReserveBalance) {
         return false;
@@ -2965,8 +3130,13 @@ bool CWallet::CreateCoinStake(unsigned int nBits, int64_t nSearchInterval, int64
     set<pair<const CWalletTx*,unsigned int> > setCoins;
     int64_t nValueIn = 0;
 
-    // Select coins with suitable depth
-    if (!SelectCoinsSimple(nBalance - nReserveBalance, setCoins, nValueIn, txNew.nTime, COINBASE_MATURITY+20)) {
+    // The search covers nSearchInterval timestamps starting at that of txNew
+    const unsigned int nSearchTimeBegin = txNew.nTime;
+    const unsigned int nSearchTimeEnd = txNew.nTime + nSearchInterval - 1;
+
+    // Select coins with suitable depth, past the min age by the end of the
+    // search; the kernel hash skips them at timestamps before they are
+    if (!SelectCoinsSimple(nBalance - nReserveBalance, setCoins, nValueIn, nSearchTimeEnd, COINBASE_MATURITY+20)) {
         return false;
     }
 
@@ -2974,109 +3144,132 @@ bool CWallet::CreateCoinStake(unsigned int nBits, int64_t nSearchInterval, int64
         return false;
     }
 
+    // Gather the kernel inputs of the selected coins up front, so that the
+    // search below only has to hash
+    vector<pair<const CWalletTx*, unsigned int> > vKernelCoins;
+    vector<pair<COutPoint, CStakeKernelContext> > vKernels;
+    vKernelCoins.reserve(setCoins.size());
+    vKernels.reserve(setCoins.size());
+    int64_t nTimeStart = GetTimeMicros();
+    {
+        LOCK2(cs_main, cs_wallet);
+        {
+            LOCK(cs_stakerStats);
+            stakerStats.lockWait.Add(GetTimeMicros() - nTimeStart);
+        }
+        BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+        {
+            CStakeKernelContext kernel;
+            if (!GetStakeKernelContext(*pcoin.first, pcoin.second, kernel))
+                continue;
+            if (!kernel.pindexModifier)
+                continue; // chain not yet a selection interval past the coin
+            vKernelCoins.push_back(pcoin);
+            vKernels.push_back(make_pair(COutPoint(pcoin.first->GetHash(), pcoin.second), kernel));
+        }
+    }
+
     int64_t nCredit = 0;
     CScript scriptPubKeyKernel;
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    while (nSearchInterval > 0 && !vKernels.empty() && !(pfCancel && *pfCancel))
     {
         boost::this_thread::interruption_point();
 
-        CTransactionRef ctx;
-        uint256 hashBlock;
+        // Hash all candidates at every timestamp of the window on the stake
+        // search threads, and stake the earliest kernel found
+        unsigned int nTimeFound;
+        nTimeStart = GetTimeMicros();
+        int nKernel = SearchStakeKernels(vKernels, nBits, nSearchTimeBegin, nSearchTimeEnd, nTimeFound, pfCancel);
+        if (!(pfCancel && *pfCancel))
         {
-            LOCK2(cs_main, cs_wallet);
-            if (!GetTransaction(pcoin.first->GetHash(), ctx, Params().GetConsensus(), hashBlock, true))
-                continue;
+            LOCK(cs_stakerStats);
+            stakerStats.nSearches++;
+            stakerStats.nCandidates += vKernels.size();
+            stakerStats.nLastCandidates = vKernels.size();
+            stakerStats.nKernels += vKernels.size() * ((nKernel < 0 ? nSearchTimeEnd : nTimeFound) - nSearchTimeBegin + 1);
+            stakerStats.search.Add(GetTimeMicros() - nTimeStart);
         }
+        if (nKernel < 0)
+            break;
+        txNew.nTime = nTimeFound;
 
-        if (!mapBlockIndex.count(hashBlock))
-            continue;
-
-        CBlockHeader block = mapBlockIndex[hashBlock]->GetBlockHeader();
-
-        static int nMaxStakeSearchInterval = 1;
-        
-        if (block.GetBlockTime() + Params().StakeMinAge() > txNew.nTime)
-            continue; // only count coins meeting min age requirement
+        const pair<const CWalletTx*, unsigned int>& pcoin = vKernelCoins[nKernel];
+        const CStakeKernelContext& kernel = vKernels[nKernel].second;
 
         bool fKernelFound = false;
-        COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && pindexPrev == pindexBest; n++)
+        do
         {
-            // Search backward in time from the given txNew timestamp
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            uint256 hashProofOfStake, targetProofOfStake;
-            
-            if (CheckStakeKernelHash(nBits, block, prevoutStake.n, pcoin.first->tx, prevoutStake, txNew.nTime, hashProofOfStake, targetProofOfStake, fDebug))
+            // Found a kernel
+            if (fDebug && GetBoolArg("-printcoinstake", false))
+               LogPrintf("CreateCoinStake : kernel found\n");
+            vector<valtype> vSolutions;
+            txnouttype whichType;
+            CScript scriptPubKeyOut;
+            scriptPubKeyKernel = pcoin.first->tx->vout[pcoin.second].scriptPubKey;
+            if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
             {
-                // Found a kernel
                 if (fDebug && GetBoolArg("-printcoinstake", false))
-                   LogPrintf("CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->tx->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake", false))
-                       LogPrintf("CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
+                   LogPrintf("CreateCoinStake : failed to parse kernel\n");
+                break;
+            }
+            if (fDebug && GetBoolArg("-printcoinstake", false))
+               LogPrintf("CreateCoinStake : parsed kernel type=%d\n", whichType);
+            if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+            {
                 if (fDebug && GetBoolArg("-printcoinstake", false))
-                   LogPrintf("CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+                   LogPrintf("CreateCoinStake : no support for kernel type=%d\n", whichType);
+                break;  // only support pay to public key and pay to address
+            }
+            if (whichType == TX_PUBKEYHASH) // pay to address type
+            {
+                // convert to pay to public key type
+                if (!GetKey(uint160(vSolutions[0]), key))
                 {
                     if (fDebug && GetBoolArg("-printcoinstake", false))
-                       LogPrintf("CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
+                       LogPrintf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                    break;  // unable to find corresponding public key
                 }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
+                scriptPubKeyOut << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+            }
+            if (whichType == TX_PUBKEY)
+            {
+                valtype& vchPubKey = vSolutions[0];
+                if (!GetKey(Hash160(vchPubKey), key))
                 {
-                    // convert to pay to public key type
-                    if (!GetKey(uint160(vSolutions[0]), key))
-                    {
-                        if (fDebug && GetBoolArg("-printcoinstake", false))
-                           LogPrintf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+                    if (fDebug && GetBoolArg("-printcoinstake", false))
+                       LogPrintf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                    break;  // unable to find corresponding public key
                 }
-                if (whichType == TX_PUBKEY)
+                if (key.GetPubKey() != vchPubKey)
                 {
-                    valtype& vchPubKey = vSolutions[0];
-                    if (!GetKey(Hash160(vchPubKey), key))
-                    {
-                        if (fDebug && GetBoolArg("-printcoinstake", false))
-                           LogPrintf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        if (fDebug && GetBoolArg("-printcoinstake", false))
-                           LogPrintf("CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
-                    scriptPubKeyOut = scriptPubKeyKernel;
+                    if (fDebug && GetBoolArg("-printcoinstake", false))
+                       LogPrintf("CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+                    break; // keys mismatch
                 }
+                scriptPubKeyOut = scriptPubKeyKernel;
+            }
 
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second, CScript(), std::numeric_limits<unsigned int>::max() - (fWalletRbf ? 2 : 1)));
-                nCredit += pcoin.first->tx->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                voutPrev.push_back(CTxOut(0, scriptPubKeyOut));
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+            txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second, CScript(), std::numeric_limits<unsigned int>::max() - (fWalletRbf ? 2 : 1)));
+            nCredit += pcoin.first->tx->vout[pcoin.second].nValue;
+            vwtxPrev.push_back(pcoin.first);
+            voutPrev.push_back(CTxOut(0, scriptPubKeyOut));
+            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
 
-                if (GetCoinAgeWeight(block.GetBlockTime(), (int64_t)txNew.nTime) < nStakeSplitAge && nCredit >= nStakeCombineThreshold) {
-                    voutPrev.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
-                    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); 
-                }
-                if (fDebug && GetBoolArg("-printcoinstake", false))
-                   LogPrintf("CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
+            if (GetCoinAgeWeight(kernel.nTimeBlockFrom, (int64_t)txNew.nTime) < nStakeSplitAge && nCredit >= nStakeCombineThreshold) {
+                voutPrev.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); 
             }
-        }
+            if (fDebug && GetBoolArg("-printcoinstake", false))
+               LogPrintf("CreateCoinStake : added kernel type=%d\n", whichType);
+            fKernelFound = true;
+        } while (false);
 
         if (fKernelFound)
             break; // if kernel is found stop searching
+
+        // the kernel cannot be spent by us, search the other candidates
+        vKernelCoins.erase(vKernelCoins.begin() + nKernel);
+        vKernels.erase(vKernels.begin() + nKernel);
     }
 
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance) {
@@ -3103,18 +3296,15 @@ bool CWallet::CreateCoinStake(unsigned int nBits, int64_t nSearchInterval, int64
             if (pcoin.first->tx->vout[pcoin.second].nValue >= nStakeCombineThreshold)
                 continue;
 
-            CTransactionRef ctx;
-            uint256 hashBlock;
+            CStakeKernelContext kernel;
             {
                 LOCK2(cs_main, cs_wallet);
-                if (!GetTransaction(pcoin.first->GetHash(), ctx, Params().GetConsensus(), hashBlock, true))
-                    continue;
-                if (!mapBlockIndex.count(hashBlock))
+                if (!GetStakeKernelContext(*pcoin.first, pcoin.second, kernel))
                     continue;
             }
 
-            // Deal with transaction timestmap
-            unsigned int nTimeTx = ctx->nTime ? ctx->nTime : mapBlockIndex[hashBlock]->nTime;
+            // Transaction timestamp, block timestamp for PoW-era transactions
+            unsigned int nTimeTx = kernel.nTimeTxPrev;
 
             // Do not add input that is still too young
             if (!GetCoinAgeWeight((int64_t)nTimeTx, (int64_t)txNew.nTime))
@@ -3156,6 +3346,7 @@ bool CWallet::CreateCoinStake(unsigned int nBits, int64_t nSearchInterval, int64
     }
 
     // Sign
+    nTimeStart = GetTimeMicros();
     CTransaction txNewConst(txNew);
     int nIn = 0;
     for (const auto& coin : vwtxPrev)
@@ -3177,6 +3368,10 @@ bool CWallet::CreateCoinStake(unsigned int nBits, int64_t nSearchInterval, int64
         }
         nIn++;
     }
+    {
+        LOCK(cs_stakerStats);
+        stakerStats.signCoinStake.Add(GetTimeMicros() - nTimeStart);
+    }
 
     // Limit size
     unsigned int nBytes = ::GetSerializeSize(txNew, SER_NETWORK, PROTOCOL_VERSION);
@@ -3189,7 +3384,7 @@ bool CWallet::CreateCoinStake(unsigned int nBits, int64_t nSearchInterval, int64
 }
 
 // attempt to generate suitable proof-of-stake
-bool CWallet::SignBlock(CBlock *pblock, int64_t nFees)
+bool CWallet::SignBlock(CBlock *pblock, int64_t nFees, unsigned int nSearchTimeBegin, unsigned int nSearchTimeEnd, const std::atomic<bool>* pfCancel)
 {
     // if we are trying to sign something other than proof-of-stake block template
     if (!pblock->vtx[0]->vout[0].IsEmpty())
@@ -3200,22 +3395,19 @@ bool CWallet::SignBlock(CBlock *pblock, int64_t nFees)
     if (pblock->IsProofOfStake())
         return true;
 
-    static int64_t nLastCoinStakeSearchTime = GetAdjustedTime(); // startup timestamp
-
     CKey key;
     CMutableTransaction txCoinStake;
-    txCoinStake.nTime = GetAdjustedTime();
-    int64_t nSearchTime = txCoinStake.nTime; // search to current time
+    txCoinStake.nTime = nSearchTimeBegin;
     CBlockIndex *pindexBest = chainActive.Tip();
 
-    if (nSearchTime > nLastCoinStakeSearchTime)
+    if (nSearchTimeEnd >= nSearchTimeBegin)
     {
-        nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
-        
+        nLastCoinStakeSearchInterval = nSearchTimeEnd - nSearchTimeBegin + 1;
+
         if (fDebug) {
             LogPrintf("SignBlock : about to create coinstake: nFees=%ld\n", nFees);
         }
-        if (CreateCoinStake(pblock->nBits, nSearchTime-nLastCoinStakeSearchTime, nFees, txCoinStake, key))
+        if (CreateCoinStake(pblock->nBits, nSearchTimeEnd - nSearchTimeBegin + 1, nFees, txCoinStake, key, pfCancel))
         {
             if (fDebug) {
                 LogPrintf("SignBlock : coinstake created: nFees=%ld\n", nFees);
@@ -3223,6 +3415,8 @@ bool CWallet::SignBlock(CBlock *pblock, int64_t nFees)
             CTransaction ctx(txCoinStake);
             if (txCoinStake.nTime >= max(pindexBest->GetMedianTimePast()+1, PastDrift(pindexBest->GetBlockTime())))
             {
+                int64_t nTimeStart = GetTimeMicros();
+
                 // make sure coinstake would meet timestamp protocol
                 //    as it would be the same as the block timestamp
                 CMutableTransaction pblock_tx(*pblock->vtx[0]);
@@ -3271,11 +3465,12 @@ bool CWallet::SignBlock(CBlock *pblock, int64_t nFees)
                 pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
 
                 // append a signature to our block
-                if (key.Sign(pblock->GetHash(), pblock->vchBlockSig)) {
-                    return true;
-                } else {
-                    return false;
+                bool fSigned = key.Sign(pblock->GetHash(), pblock->vchBlockSig);
+                {
+                    LOCK(cs_stakerStats);
+                    stakerStats.signBlock.Add(GetTimeMicros() - nTimeStart);
                 }
+                return fSigned;
             }
         }
     }
@@ -3917,18 +4112,23 @@ void CWallet::LockCoin(const COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.insert(output);
+    nStakeWeightTime = 0; // locked coins do not stake
 }
 
 void CWallet::UnlockCoin(const COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.erase(output);
+    nStakeWeightTime = 0;
+    nStakeGeneration++;
 }
 
 void CWallet::UnlockAllCoins()
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.clear();
+    nStakeWeightTime = 0;
+    nStakeGeneration++;
 }
 
 bool CWallet::IsLockedCoin(uint256 hash, unsigned int n) const
@@ -4289,6 +4489,8 @@ CWallet* CWallet::CreateWalletFromFile(const std::string walletFile)
             }
         }
     }
+    else
+        walletInstance->BuildStakeKernelCache();
     walletInstance->SetBroadcastTransactions(GetBoolArg("-walletbroadcast", DEFAULT_WALLETBROADCAST));
 
     {
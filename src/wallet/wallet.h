@@ -74,6 +74,8 @@ static const bool DEFAULT_WALLETBROADCAST = true;
 static const bool DEFAULT_DISABLE_WALLET = false;
 //! if set, all keys will be derived by using BIP32
 static const bool DEFAULT_USE_HD_WALLET = true;
+//! PoSV: seconds between full reweighs of the wallet stake weight
+static const int64_t STAKE_WEIGHT_INTERVAL = 10 * 60;
 
 extern const char * DEFAULT_WALLET_DAT;
 
@@ -610,6 +612,43 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * PoSV: kernel inputs of our confirmed outputs, keyed by outpoint, so
+     * that the staking loop only has to hash. Entries are added when a
+     * transaction confirms (or on first use) and dropped when it is
+     * disconnected or the output is spent.
+     */
+    std::map<COutPoint, CStakeKernelContext> mapStakeKernelCache;
+    //! The outpoints of mapStakeKernelCache by the time they pass the stake min age
+    std::set<std::pair<unsigned int, COutPoint> > setStakeKernelMaturity;
+    void UpdateStakeKernelCache(const CTransaction& tx, const CBlockIndex* pindex, int posInBlock);
+    bool GetStakeKernelContext(const CWalletTx& wtx, unsigned int n, CStakeKernelContext& kernel);
+    void AddStakeKernel(const COutPoint& outpoint, const CStakeKernelContext& kernel);
+    void EraseStakeKernel(const COutPoint& outpoint);
+    void RestoreStakeKernels(const CWalletTx& wtx);
+
+    /**
+     * PoSV: stake weight of the outputs in mapStakeKernelCache, weighed at
+     * nStakeWeightTime against the tip at nStakeWeightHeight. Outputs
+     * entering or leaving the cache adjust the totals; they are reweighed
+     * from scratch once per STAKE_WEIGHT_INTERVAL, once the tip moves off
+     * nStakeWeightHeight, or after a change that cannot be applied
+     * incrementally (nStakeWeightTime is then 0).
+     * nStakeWeightValue is the value of the outputs deep enough to stake
+     * and not locked, which the reserve balance is kept out of.
+     */
+    CAmount nStakeWeightValue;
+    int64_t nStakeWeightTime;
+    int nStakeWeightHeight;
+    int nStakeTipHeight;
+    uint64_t nStakeWeightTotal;
+    uint64_t nStakeWeightCount;
+    void WeighStakeKernel(const COutPoint& outpoint, const CStakeKernelContext& kernel, bool fAdd);
+    void UpdateStakeWeight(int64_t nTime);
+
+    //! PoSV: bumped whenever outputs may have become stakeable without a new tip
+    std::atomic<unsigned int> nStakeGeneration;
+
     /* the HD chain data model (external chain counters) */
     CHDChain hdChain;
 
@@ -691,6 +730,13 @@ public:
         nLastResend = 0;
         nTimeFirstKey = 0;
         fBroadcastTransactions = false;
+        nStakeWeightValue = 0;
+        nStakeWeightTime = 0;
+        nStakeWeightHeight = 0;
+        nStakeTipHeight = 0;
+        nStakeWeightTotal = 0;
+        nStakeWeightCount = 0;
+        nStakeGeneration = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -793,6 +839,7 @@ public:
     bool AddToWallet(const CWalletTx& wtxIn, bool fFlushOnClose=true);
     bool LoadToWallet(const CWalletTx& wtxIn);
     void SyncTransaction(const CTransaction& tx, const CBlockIndex *pindex, int posInBlock) override;
+    void UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload) override;
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlockIndex* pIndex, int posInBlock, bool fUpdate);
     CBlockIndex* ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
     void ReacceptWalletTransactions();
@@ -848,8 +895,16 @@ public:
     // PoSV
     CAmount GetStake() const;
     bool GetStakeWeight(uint64_t& nAverageWeight, uint64_t& nTotalWeight);
-    bool CreateCoinStake(unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CMutableTransaction& txNew, CKey& key);
-    bool SignBlock(CBlock *pblock, int64_t nFees);
+    void BuildStakeKernelCache();
+    //! Time the earliest maturing of our outputs passes the stake min age, or 0 if we have none
+    unsigned int GetStakeMaturityTime() const;
+    //! Changes when outputs may have become stakeable other than by a new tip, e.g. unlocked coins or an unlocked wallet
+    unsigned int GetStakeGeneration() const { return nStakeGeneration; }
+    //! All our outputs past the stake min age at nSpendTime and at least nMinConf deep
+    bool SelectStakeCoins(std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, unsigned int nSpendTime, int nMinConf) const;
+    bool CreateCoinStake(unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CMutableTransaction& txNew, CKey& key, const std::atomic<bool>* pfCancel = NULL);
+    //! Stake the block at the earliest timestamp in [nSearchTimeBegin, nSearchTimeEnd] a kernel of ours meets its target
+    bool SignBlock(CBlock *pblock, int64_t nFees, unsigned int nSearchTimeBegin, unsigned int nSearchTimeEnd, const std::atomic<bool>* pfCancel = NULL);
 
     bool NewKeyPool();
     bool TopUpKeyPool(unsigned int kpSize = 0);
@@ -52,4 +52,11 @@ public:
     bool NotifyTransaction(const CTransaction &transaction);
 };
 
+/** Publishes the staker counters and timings of getstakerstats on every new tip */
+class CZMQPublishStakerStatsNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyBlock(const CBlockIndex *pindex);
+};
+
 #endif // BITCOIN_ZMQ_ZMQPUBLISHNOTIFIER_H